@@ -47,6 +47,7 @@
 #include "TH1.h"
 #include "TH2.h"
 #include "TMatrixDSym.h"
+#include "TMD5.h"
 #include "TSystem.h"
 #include "TTree.h"
 
@@ -55,8 +56,14 @@
 #endif
 
 #include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
 #include <tuple>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace ana;
 
 unsigned gRNGSeed = 0;
@@ -932,6 +939,188 @@ BuildSpectra(PredictionInterp *predFDNumuFHC, PredictionInterp *predFDNueFHC,
   return spectra;
 }
 
+namespace {
+// Everything needed to reproduce the outcome of a RunFitPoint call without
+// redoing the fit
+struct FitCacheEntry {
+  double chisq;
+  double nfcn;
+  double edm;
+  bool isValid;
+  unsigned nseconds;
+  std::vector<double> oscVals, systVals;
+  std::vector<std::string> paramNames;
+  std::vector<double> preFitValues, preFitErrors, postFitValues,
+      postFitErrors, centralValues;
+};
+
+void HashOscCalc(std::ostream &os, osc::IOscCalcAdjustable *calc) {
+  if (!calc) {
+    os << "nocalc\n";
+    return;
+  }
+  os << calc->GetL() << " " << calc->GetRho() << " " << calc->GetDmsq21()
+     << " " << calc->GetDmsq32() << " " << calc->GetTh12() << " "
+     << calc->GetTh13() << " " << calc->GetTh23() << " " << calc->GetdCP()
+     << "\n";
+}
+
+void HashSystShifts(std::ostream &os, const SystShifts &shifts) {
+  for (const ISyst *s : shifts.ActiveSysts())
+    os << s->ShortName() << "=" << shifts.GetShift(s) << " ";
+  os << "\n";
+}
+
+// Everything that goes into a fit. The penalty term is opaque, so is
+// characterized by its value at the fake data and starting points.
+std::string FitCacheKey(std::string const &stateFileName,
+                        std::string const &sampleString,
+                        osc::IOscCalcAdjustable *fakeDataOsc,
+                        SystShifts const &fakeDataSyst, bool fakeDataStats,
+                        std::vector<seeded_spectra> const &spectra,
+                        std::vector<const IFitVar *> const &oscVars,
+                        std::vector<const ISyst *> const &systlist,
+                        osc::IOscCalcAdjustable *fitOsc,
+                        SystShifts const &fitSyst, SeedList const &oscSeeds,
+                        IExperiment *penaltyTerm,
+                        MinuitFitter::FitOpts fitStrategy) {
+  std::ostringstream os;
+  os.precision(17);
+
+  // Cheaper than hashing the whole file, and it never changes in place
+  struct stat st;
+  if (stat(stateFileName.c_str(), &st) == 0) {
+    os << stateFileName << " " << st.st_size << " " << st.st_mtime << "\n";
+  } else {
+    os << stateFileName << "\n";
+  }
+
+  os << sampleString << "\n";
+  HashOscCalc(os, fakeDataOsc);
+  HashSystShifts(os, fakeDataSyst);
+  if (fakeDataStats) {
+    for (const seeded_spectra &s : spectra)
+      os << s.stats_seed << " ";
+  }
+  os << "\n";
+
+  for (const IFitVar *v : oscVars)
+    os << v->ShortName() << " ";
+  os << "\n";
+  for (const ISyst *s : systlist)
+    os << s->ShortName() << " ";
+  os << "\n";
+
+  HashOscCalc(os, fitOsc);
+  HashSystShifts(os, fitSyst);
+  for (const Seed &seed : oscSeeds.GetSeeds()) {
+    for (auto it : seed.GetVals())
+      os << it.first->ShortName() << "=" << it.second << " ";
+    os << "; ";
+  }
+  os << "\n";
+
+  if (penaltyTerm && fakeDataOsc && fitOsc) {
+    os << penaltyTerm->ChiSq(fakeDataOsc, fakeDataSyst) << " "
+       << penaltyTerm->ChiSq(fitOsc, fitSyst);
+  }
+  os << "\n";
+
+  os << int(fitStrategy) << "\n";
+
+  for (const char *env_str :
+       {"CAFANA_ANALYSIS_VERSION", "CAFANA_USE_UNCORRNDCOVMAT",
+        "CAFANA_USE_NDCOVMAT", "CAFANA_IGNORE_CV_WEIGHT",
+        "CAFANA_IGNORE_SELECTION", "CAFANA_DISABLE_DERIVATIVES",
+        "CAFANA_DONT_CLAMP_SYSTS", "CAFANA_FIT_PARALLEL_DERIVS",
+        "CAFANA_FIT_DERIV_STEP", "CAFANA_PRED_MINMCSTATS", "FIT_PRECISION",
+        "FIT_TOLERANCE"}) {
+    if (getenv(env_str))
+      os << env_str << "=" << getenv(env_str) << " ";
+  }
+
+  const std::string str = os.str();
+  TMD5 md5;
+  md5.Update((const UChar_t *)str.data(), str.size());
+  md5.Final();
+  return md5.AsString();
+}
+
+void WriteVec(std::ostream &os, std::string const &name,
+              std::vector<double> const &v) {
+  os << name << " " << v.size();
+  for (double x : v)
+    os << " " << x;
+  os << "\n";
+}
+
+bool ReadVec(std::istream &is, std::string const &name,
+             std::vector<double> &v) {
+  std::string tag;
+  size_t n;
+  if (!(is >> tag >> n) || tag != name)
+    return false;
+  v.resize(n);
+  for (double &x : v)
+    if (!(is >> x))
+      return false;
+  return true;
+}
+
+bool ReadFitCache(std::string const &fname, FitCacheEntry &e) {
+  std::ifstream is(fname);
+  if (!is)
+    return false;
+
+  std::string tag;
+  size_t n;
+  if (!(is >> tag >> e.chisq >> e.nfcn >> e.edm >> e.isValid >> e.nseconds) ||
+      tag != "fit")
+    return false;
+  if (!(is >> tag >> n) || tag != "names")
+    return false;
+  e.paramNames.resize(n);
+  for (std::string &s : e.paramNames)
+    if (!(is >> s))
+      return false;
+
+  return ReadVec(is, "osc", e.oscVals) && ReadVec(is, "syst", e.systVals) &&
+         ReadVec(is, "prefit", e.preFitValues) &&
+         ReadVec(is, "prefiterr", e.preFitErrors) &&
+         ReadVec(is, "postfit", e.postFitValues) &&
+         ReadVec(is, "postfiterr", e.postFitErrors) &&
+         ReadVec(is, "central", e.centralValues);
+}
+
+void WriteFitCache(std::string const &fname, FitCacheEntry const &e) {
+  // Write somewhere private then move into place, so that concurrent jobs
+  // never see a partial file
+  const std::string tmpName =
+      fname + ".tmp" + std::to_string(gSystem->GetPid());
+  {
+    std::ofstream os(tmpName);
+    os.precision(17);
+    os << "fit " << e.chisq << " " << e.nfcn << " " << e.edm << " "
+       << e.isValid << " " << e.nseconds << "\n";
+    os << "names " << e.paramNames.size();
+    for (std::string const &s : e.paramNames)
+      os << " " << s;
+    os << "\n";
+    WriteVec(os, "osc", e.oscVals);
+    WriteVec(os, "syst", e.systVals);
+    WriteVec(os, "prefit", e.preFitValues);
+    WriteVec(os, "prefiterr", e.preFitErrors);
+    WriteVec(os, "postfit", e.postFitValues);
+    WriteVec(os, "postfiterr", e.postFitErrors);
+    WriteVec(os, "central", e.centralValues);
+  }
+  if (rename(tmpName.c_str(), fname.c_str()) != 0) {
+    std::cerr << "[CACHE]: Failed to write " << fname << std::endl;
+    unlink(tmpName.c_str());
+  }
+}
+} // namespace
+
 double RunFitPoint(std::string stateFileName, std::string sampleString,
                    osc::IOscCalcAdjustable *fakeDataOsc,
                    SystShifts fakeDataSyst, bool fakeDataStats,
@@ -979,7 +1168,10 @@ double RunFitPoint(std::string stateFileName, std::string sampleString,
           "CAFANA_USE_NDCOVMAT", "CAFANA_IGNORE_CV_WEIGHT",
           "CAFANA_IGNORE_SELECTION", "CAFANA_DISABLE_DERIVATIVES",
           "CAFANA_DONT_CLAMP_SYSTS", "CAFANA_FIT_TURBOSE",
-          "CAFANA_FIT_FORCE_HESSE", "CAFANA_PRED_MINMCSTATS", "FIT_PRECISION",
+          "CAFANA_FIT_FORCE_HESSE", "CAFANA_FIT_PARALLEL_SEEDS",
+          "CAFANA_FIT_PARALLEL_DERIVS", "CAFANA_FIT_DERIV_STEP",
+          "CAFANA_SURFACE_NPROCS", "CAFANA_FIT_CACHE_DIR",
+          "CAFANA_NTHREADS", "CAFANA_PRED_MINMCSTATS", "FIT_PRECISION",
           "FIT_TOLERANCE", "SLURM_JOB_ID", "SLURM_PROCID", "SLURM_NODEID",
           "SLURM_LOCALID"}) {
       if (getenv(env_str)) {
@@ -1161,6 +1353,54 @@ double RunFitPoint(std::string stateFileName, std::string sampleString,
               << std::endl;
   }
 
+  // Results can be reused from an identical earlier fit. Not when writing
+  // out the full fit details though, since they aren't cached.
+  std::string cacheFile;
+  if (getenv("CAFANA_FIT_CACHE_DIR") && !outDir) {
+    cacheFile = std::string(getenv("CAFANA_FIT_CACHE_DIR")) + "/" +
+                FitCacheKey(stateFileName, sampleString, fakeDataOsc,
+                            fakeDataSyst, fakeDataStats, *spectra, oscVars,
+                            systlist, fitOsc, fitSyst, oscSeeds, penaltyTerm,
+                            fitStrategy) +
+                ".txt";
+
+    FitCacheEntry e;
+    if (ReadFitCache(cacheFile, e) && e.oscVals.size() == oscVars.size() &&
+        e.systVals.size() == systlist.size()) {
+      std::cerr << "[CACHE]: Reusing fit result from " << cacheFile
+                << std::endl;
+
+      for (size_t i = 0; i < oscVars.size(); ++i)
+        oscVars[i]->SetValue(fitOsc, e.oscVals[i]);
+      for (size_t i = 0; i < systlist.size(); ++i)
+        fitSyst.SetShift(systlist[i], e.systVals[i]);
+      bf = fitSyst;
+
+      if (PostFitTreeBlob) {
+        (*PostFitTreeBlob->fParamNames) = e.paramNames;
+        (*PostFitTreeBlob->fPreFitValues) = e.preFitValues;
+        (*PostFitTreeBlob->fPreFitErrors) = e.preFitErrors;
+        (*PostFitTreeBlob->fPostFitValues) = e.postFitValues;
+        (*PostFitTreeBlob->fPostFitErrors) = e.postFitErrors;
+        (*PostFitTreeBlob->fCentralValues) = e.centralValues;
+        (*PostFitTreeBlob->fFakeDataVals) = fFakeDataVals;
+        PostFitTreeBlob->fNFCN = e.nfcn;
+        PostFitTreeBlob->fEDM = e.edm;
+        PostFitTreeBlob->fIsValid = e.isValid;
+        PostFitTreeBlob->fChiSq = e.chisq;
+        PostFitTreeBlob->fNSeconds = e.nseconds;
+        PostFitTreeBlob->fNOscSeeds = oscSeeds.size();
+
+        ProcInfo_t procinfo;
+        gSystem->GetProcInfo(&procinfo);
+        PostFitTreeBlob->fResMemUsage = procinfo.fMemResident;
+        PostFitTreeBlob->fVirtMemUsage = procinfo.fMemVirtual;
+      }
+
+      return e.chisq;
+    }
+  }
+
   // Save prefit starting distributions
   if (outDir) {
 
@@ -1300,6 +1540,14 @@ double RunFitPoint(std::string stateFileName, std::string sampleString,
   // Now set up the fit itself
   std::cerr << "[INFO]: Beginning fit. " << BuildLogInfoString();
   MinuitFitter this_fit(&this_expt, oscVars, systlist, fitStrategy);
+  if (getenv("CAFANA_FIT_PARALLEL_SEEDS") &&
+      bool(atoi(getenv("CAFANA_FIT_PARALLEL_SEEDS")))) {
+    this_fit.SetParallelSeeds();
+  }
+  if (getenv("CAFANA_FIT_PARALLEL_DERIVS") &&
+      bool(atoi(getenv("CAFANA_FIT_PARALLEL_DERIVS")))) {
+    this_fit.SetParallelDerivatives();
+  }
   double thischisq =
       this_fit.Fit(fitOsc, fitSyst, oscSeeds, {}, MinuitFitter::kVerbose)->EvalMetricVal();
   auto end_fit = std::chrono::system_clock::now();
@@ -1313,6 +1561,28 @@ double RunFitPoint(std::string stateFileName, std::string sampleString,
 
   bf = fitSyst;
 
+  if (!cacheFile.empty()) {
+    FitCacheEntry e;
+    e.chisq = thischisq;
+    e.nfcn = this_fit.GetNFCN();
+    e.edm = this_fit.GetEDM();
+    e.isValid = this_fit.GetIsValid();
+    e.nseconds =
+        std::chrono::duration_cast<std::chrono::seconds>(end_fit - start_fit)
+            .count();
+    for (const IFitVar *v : oscVars)
+      e.oscVals.push_back(v->GetValue(fitOsc));
+    for (const ISyst *s : systlist)
+      e.systVals.push_back(fitSyst.GetShift(s));
+    e.paramNames = this_fit.GetParamNames();
+    e.preFitValues = this_fit.GetPreFitValues();
+    e.preFitErrors = this_fit.GetPreFitErrors();
+    e.postFitValues = this_fit.GetPostFitValues();
+    e.postFitErrors = this_fit.GetPostFitErrors();
+    e.centralValues = this_fit.GetCentralValues();
+    WriteFitCache(cacheFile, e);
+  }
+
   // If we have a directory to save to... save some stuff...
   if (outDir) {
     if (turbose) {
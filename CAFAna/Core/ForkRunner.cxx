@@ -0,0 +1,254 @@
+#include "CAFAna/Core/ForkRunner.h"
+
+#include "CAFAna/Core/WorkerPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace ana
+{
+  namespace
+  {
+    //----------------------------------------------------------------------
+    /// Number of threads in this process, or zero if we can't tell
+    unsigned int NumProcessThreads()
+    {
+      DIR* d = opendir("/proc/self/task");
+      if(!d) return 0;
+
+      unsigned int n = 0;
+      while(const dirent* e = readdir(d)) if(e->d_name[0] != '.') ++n;
+      closedir(d);
+      return n;
+    }
+
+    //----------------------------------------------------------------------
+    /// Body of a worker process. Never returns.
+    void ForkWorker(const std::vector<unsigned int>& todo,
+                    std::atomic<unsigned int>* next,
+                    const std::function<std::vector<double>(unsigned int)>& func,
+                    const std::string& fname,
+                    unsigned int nThreads)
+    {
+      int status = 0;
+
+      FILE* f = fopen(fname.c_str(), "wb");
+      if(!f){
+        perror(("ForkMap: can't open "+fname).c_str());
+        _exit(1);
+      }
+
+      try{
+        const ThreadBudgetGuard guard(nThreads);
+
+        while(true){
+          const unsigned int i = (*next)++;
+          if(i >= todo.size()) break;
+
+          const std::vector<double> ret = func(todo[i]);
+
+          // Each record is complete on disk before we move on, so the
+          // parent can use everything up to a crash
+          const unsigned int hdr[2] = {todo[i], (unsigned int)ret.size()};
+          if(fwrite(hdr, sizeof(unsigned int), 2, f) != 2 ||
+             fwrite(ret.data(), sizeof(double), ret.size(), f) != ret.size() ||
+             fflush(f) != 0){
+            // The parent discards the incomplete record, and retries this
+            // index and any we didn't get to
+            perror(("ForkMap: writing "+fname).c_str());
+            status = 2;
+            break;
+          }
+        }
+      }
+      catch(std::exception& e){
+        std::cerr << "ForkMap: worker " << getpid() << " threw: " << e.what() << std::endl;
+        status = 1;
+      }
+
+      if(fclose(f) != 0 && status == 0){
+        perror(("ForkMap: closing "+fname).c_str());
+        status = 2;
+      }
+
+      // Don't run any of the parent's atexit handlers or static destructors
+      fflush(stdout);
+      fflush(stderr);
+      _exit(status);
+    }
+
+    //----------------------------------------------------------------------
+    /// Read back a worker's results file, filling \a ret and \a got
+    void ReadResults(const std::string& fname,
+                     std::vector<std::vector<double>>& ret,
+                     std::vector<bool>& got)
+    {
+      FILE* f = fopen(fname.c_str(), "rb");
+      if(!f) return;
+
+      unsigned int hdr[2];
+      while(fread(hdr, sizeof(unsigned int), 2, f) == 2){
+        // Not something we asked for, so the file can't be trusted from here
+        if(hdr[0] >= ret.size()){
+          std::cerr << "ForkMap: corrupt results in " << fname << std::endl;
+          break;
+        }
+
+        std::vector<double> vals(hdr[1]);
+        // A truncated record from a crashed worker
+        if(fread(vals.data(), sizeof(double), hdr[1], f) != hdr[1]) break;
+
+        ret[hdr[0]] = std::move(vals);
+        got[hdr[0]] = true;
+      }
+
+      fclose(f);
+      unlink(fname.c_str());
+    }
+
+    //----------------------------------------------------------------------
+    /// Run one round of workers over \a todo
+    void ForkRound(const std::vector<unsigned int>& todo,
+                   const std::function<std::vector<double>(unsigned int)>& func,
+                   unsigned int nProcs,
+                   const std::string& dir,
+                   std::vector<std::vector<double>>& ret,
+                   std::vector<bool>& got)
+    {
+      // The queue is just the next index into todo, shared with the workers
+      void* mem = mmap(0, sizeof(std::atomic<unsigned int>),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      if(mem == MAP_FAILED){
+        perror("ForkMap: mmap");
+        abort();
+      }
+      std::atomic<unsigned int>* next = new (mem) std::atomic<unsigned int>(0);
+
+      const unsigned int nThreads = std::max(1u, LocalThreadBudget() / nProcs);
+
+      // Don't want buffered output printed by every child
+      std::cout.flush();
+      std::cerr.flush();
+      fflush(0);
+
+      std::vector<pid_t> pids;
+      std::vector<std::string> fnames;
+      for(unsigned int w = 0; w < nProcs; ++w){
+        const std::string fname = dir+"/worker"+std::to_string(w);
+        const pid_t pid = fork();
+        if(pid < 0){
+          perror("ForkMap: fork");
+          break; // Make do with the workers we have
+        }
+        if(pid == 0) ForkWorker(todo, next, func, fname, nThreads);
+
+        pids.push_back(pid);
+        fnames.push_back(fname);
+      }
+
+      if(pids.empty()){
+        std::cout << "ForkMap: unable to start any workers" << std::endl;
+        abort();
+      }
+
+      for(unsigned int w = 0; w < pids.size(); ++w){
+        int status;
+        if(waitpid(pids[w], &status, 0) < 0){
+          perror("ForkMap: waitpid");
+          abort();
+        }
+        // However the worker failed, only the complete records in its file
+        // are used, and its other indices go to the next round
+        if(WIFSIGNALED(status)){
+          std::cerr << "ForkMap: worker " << pids[w] << " killed by signal "
+                    << WTERMSIG(status) << std::endl;
+        }
+        else if(WIFEXITED(status) && WEXITSTATUS(status) != 0){
+          std::cerr << "ForkMap: worker " << pids[w] << " exited with status "
+                    << WEXITSTATUS(status) << std::endl;
+        }
+
+        ReadResults(fnames[w], ret, got);
+      }
+
+      munmap(mem, sizeof(std::atomic<unsigned int>));
+    }
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<std::vector<double>>
+  ForkMap(unsigned int n,
+          const std::function<std::vector<double>(unsigned int)>& func,
+          unsigned int nProcs)
+  {
+    if(nProcs == 0) nProcs = LocalThreadBudget();
+    nProcs = std::min(nProcs, n);
+
+    std::vector<std::vector<double>> ret(n);
+
+    // A forked child only has the thread that called fork(). Any lock
+    // another thread held at that moment (eg inside malloc, or a WorkerPool
+    // mutex) is held forever in the child, which can then deadlock.
+    if(nProcs >= 2){
+      const unsigned int nThreads = NumProcessThreads();
+      if(nThreads > 1){
+        std::cerr << "ForkMap: refusing to fork with " << nThreads-1
+                  << " other threads running. Using " << nProcs
+                  << " threads instead. Call ForkMap before any WorkerPool or"
+                  << " other thread is started." << std::endl;
+        WorkerPool pool(nProcs);
+        pool.ParallelFor(n, [&](unsigned int i){ret[i] = func(i);});
+        return ret;
+      }
+    }
+
+    if(nProcs < 2){
+      for(unsigned int i = 0; i < n; ++i) ret[i] = func(i);
+      return ret;
+    }
+
+    const char* tmp = getenv("TMPDIR");
+    std::string dir = std::string(tmp ? tmp : "/tmp")+"/cafana_fork_XXXXXX";
+    if(!mkdtemp(&dir[0])){
+      perror("ForkMap: mkdtemp");
+      abort();
+    }
+
+    std::vector<bool> got(n, false);
+
+    for(int round = 0; round < 2; ++round){
+      std::vector<unsigned int> todo;
+      for(unsigned int i = 0; i < n; ++i) if(!got[i]) todo.push_back(i);
+      if(todo.empty()) break;
+
+      if(round > 0){
+        std::cerr << "ForkMap: retrying " << todo.size()
+                  << " indices from failed workers" << std::endl;
+      }
+
+      ForkRound(todo, func, std::min(nProcs, (unsigned int)todo.size()), dir, ret, got);
+    }
+
+    rmdir(dir.c_str());
+
+    for(unsigned int i = 0; i < n; ++i){
+      if(!got[i]){
+        std::cout << "ForkMap: index " << i
+                  << " failed in two separate workers. Giving up." << std::endl;
+        abort();
+      }
+    }
+
+    return ret;
+  }
+}
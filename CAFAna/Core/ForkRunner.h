@@ -0,0 +1,33 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+namespace ana
+{
+  /// \brief Evaluate func(0) ... func(n-1) in forked worker processes
+  ///
+  /// Everything already loaded in this process is shared with the workers
+  /// copy-on-write, so nothing needs to be thread-safe. The indices are
+  /// handed out one at a time from a shared queue, and each worker writes its
+  /// results to its own file, which are merged once all the workers are
+  /// done. If a worker dies, any indices it didn't complete are retried once
+  /// in a fresh worker before giving up.
+  ///
+  /// Must be called while this is the only thread in the process, ie before
+  /// any WorkerPool, sample-streaming or other thread is started. A forked
+  /// child inherits any lock held by another thread, and can deadlock on it.
+  /// If there are other threads (as counted from /proc/self/task), ForkMap
+  /// warns and runs func on a WorkerPool of nProcs threads in this process
+  /// instead. So func should be thread-safe too, unless you're sure of
+  /// calling this single-threaded.
+  ///
+  /// \param nProcs Number of worker processes. Zero means the thread budget
+  ///               (\ref LocalThreadBudget). With one process, or fewer than
+  ///               two indices, func is simply called in this process.
+  /// \return The vector returned by func for each index
+  std::vector<std::vector<double>>
+  ForkMap(unsigned int n,
+          const std::function<std::vector<double>(unsigned int)>& func,
+          unsigned int nProcs = 0);
+}
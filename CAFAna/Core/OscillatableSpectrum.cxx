@@ -15,7 +15,11 @@
 #include "TMD5.h"
 #include "TObjString.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdlib>
+#include <iostream>
 #include <memory>
 
 namespace ana
@@ -24,6 +28,163 @@ namespace ana
   const Var kTrueE([](const caf::SRProxy* sr)
                    {return sr->Ev;});
 
+  namespace
+  {
+    unsigned int DefaultOscCacheEntries()
+    {
+      const char* env = getenv("CAFANA_OSC_CACHE_SIZE");
+      if(!env) return 4;
+
+      // Parse signed, so that a negative value doesn't wrap to a huge size
+      const long n = atol(env);
+      if(n <= 0){
+        std::cerr << "CAFANA_OSC_CACHE_SIZE=" << env
+                  << " must be a positive number of entries. Using 4" << std::endl;
+        return 4;
+      }
+      return n;
+    }
+
+    long DefaultOscCacheMaxBytes()
+    {
+      const char* env = getenv("CAFANA_OSC_CACHE_MAX_MB");
+      if(!env) return 1024l*1024*1024;
+
+      const double mb = atof(env);
+      if(mb <= 0){
+        std::cerr << "CAFANA_OSC_CACHE_MAX_MB=" << env
+                  << " must be positive. Using 1024" << std::endl;
+        return 1024l*1024*1024;
+      }
+      return long(mb*1024*1024);
+    }
+
+    std::atomic<unsigned int> gOscCacheMaxEntries(DefaultOscCacheEntries());
+    std::atomic<long> gOscCacheMaxBytes(DefaultOscCacheMaxBytes());
+
+    std::atomic<long> gOscCacheHits(0);
+    std::atomic<long> gOscCacheMisses(0);
+    std::atomic<long> gOscCacheEvictions(0);
+    std::atomic<long> gOscCacheBytes(0);
+  }
+
+  //----------------------------------------------------------------------
+  OscCache::OscCache(const OscCache&)
+  {
+    // Copies are mostly short-lived temporaries, so duplicating the entries
+    // would only cost memory. Start empty.
+  }
+
+  //----------------------------------------------------------------------
+  OscCache& OscCache::operator=(const OscCache& rhs)
+  {
+    if(this != &rhs) Clear();
+    return *this;
+  }
+
+  //----------------------------------------------------------------------
+  OscCache::OscCache(OscCache&& rhs)
+  {
+    *this = std::move(rhs);
+  }
+
+  //----------------------------------------------------------------------
+  OscCache& OscCache::operator=(OscCache&& rhs)
+  {
+    if(this == &rhs) return *this;
+
+    Clear();
+    // The entries change hands, so the process-wide total is unchanged
+    fEntries = std::move(rhs.fEntries);
+    rhs.fEntries.clear();
+
+    return *this;
+  }
+
+  //----------------------------------------------------------------------
+  OscCache::~OscCache()
+  {
+    Clear();
+  }
+
+  //----------------------------------------------------------------------
+  const Spectrum* OscCache::Get(const TMD5& hash, int from, int to) const
+  {
+    for(auto it = fEntries.begin(); it != fEntries.end(); ++it){
+      if(it->from == from && it->to == to && it->hash == hash){
+        // Move to the front to mark as most-recently-used
+        if(it != fEntries.begin()) fEntries.splice(fEntries.begin(), fEntries, it);
+        ++gOscCacheHits;
+        return &fEntries.front().spect;
+      }
+    }
+
+    ++gOscCacheMisses;
+    return nullptr;
+  }
+
+  //----------------------------------------------------------------------
+  void OscCache::Insert(const TMD5& hash, int from, int to,
+                        const Spectrum& s, int nbins)
+  {
+    const unsigned int maxEntries = gOscCacheMaxEntries;
+    if(maxEntries == 0) return;
+
+    const long bytes = sizeof(Entry) + nbins*sizeof(double);
+
+    while(fEntries.size() >= maxEntries) PopBack();
+
+    // Make space within the per-process budget by evicting our own oldest
+    // entries. Memory held by other caches we can't touch, so if that's what
+    // is using the budget up simply don't store this one.
+    while(!fEntries.empty() && gOscCacheBytes + bytes > gOscCacheMaxBytes) PopBack();
+    if(gOscCacheBytes + bytes > gOscCacheMaxBytes) return;
+
+    fEntries.push_front({hash, from, to, s, bytes});
+    gOscCacheBytes += bytes;
+  }
+
+  //----------------------------------------------------------------------
+  void OscCache::PopBack()
+  {
+    gOscCacheBytes -= fEntries.back().bytes;
+    ++gOscCacheEvictions;
+    fEntries.pop_back();
+  }
+
+  //----------------------------------------------------------------------
+  void OscCache::Clear()
+  {
+    for(const Entry& e: fEntries) gOscCacheBytes -= e.bytes;
+    fEntries.clear();
+  }
+
+  //----------------------------------------------------------------------
+  OscCache::Stats OscCache::GetStats()
+  {
+    return {gOscCacheHits, gOscCacheMisses, gOscCacheEvictions, gOscCacheBytes};
+  }
+
+  //----------------------------------------------------------------------
+  void OscCache::ResetStats()
+  {
+    gOscCacheHits = 0;
+    gOscCacheMisses = 0;
+    gOscCacheEvictions = 0;
+  }
+
+  //----------------------------------------------------------------------
+  void OscCache::SetMaxEntries(unsigned int n)
+  {
+    gOscCacheMaxEntries = n;
+  }
+
+  //----------------------------------------------------------------------
+  void OscCache::SetMaxMegabytes(double mb)
+  {
+    gOscCacheMaxBytes = long(mb*1024*1024);
+  }
+
   //----------------------------------------------------------------------
   OscillatableSpectrum::
   OscillatableSpectrum(const std::string& label, const Binning& bins,
@@ -70,11 +231,6 @@ namespace ana
   OscillatableSpectrum::OscillatableSpectrum(const OscillatableSpectrum& rhs)
     : ReweightableSpectrum(rhs)
   {
-    if(rhs.fCache->hash){
-      fCache->spect = rhs.fCache->spect;
-      fCache->hash = std::make_unique<TMD5>(*rhs.fCache->hash);
-    }
-
     assert( rhs.fReferences.empty() ); // Copying with pending loads is unexpected
   }
 
@@ -82,10 +238,7 @@ namespace ana
   OscillatableSpectrum::OscillatableSpectrum(OscillatableSpectrum&& rhs)
     : ReweightableSpectrum(rhs)
   {
-    if(rhs.fCache->hash){
-      fCache->spect = std::move(rhs.fCache->spect);
-      fCache->hash = std::move(rhs.fCache->hash);
-    }
+    *fCache = std::move(*rhs.fCache);
 
     assert( rhs.fReferences.empty() ); // Copying with pending loads is unexpected
   }
@@ -97,13 +250,7 @@ namespace ana
 
     ReweightableSpectrum::operator=(rhs);
 
-    if(rhs.fCache->hash){
-      fCache->spect = rhs.fCache->spect;
-      fCache->hash = std::make_unique<TMD5>(*rhs.fCache->hash);
-    }
-    else{
-      fCache->hash.reset();
-    }
+    fCache->Clear();
 
     assert( rhs.fReferences.empty() ); // Copying with pending loads is unexpected
     assert( fReferences.empty() ); // Copying with pending loads is unexpected
@@ -118,13 +265,7 @@ namespace ana
 
     ReweightableSpectrum::operator=(rhs);
 
-    if(rhs.fCache->hash){
-      fCache->spect = std::move(rhs.fCache->spect);
-      fCache->hash = std::move(rhs.fCache->hash);
-    }
-    else{
-      fCache->hash.reset();
-    }
+    *fCache = std::move(*rhs.fCache);
 
     assert( rhs.fReferences.empty() ); // Copying with pending loads is unexpected
     assert( fReferences.empty() ); // Copying with pending loads is unexpected
@@ -136,18 +277,15 @@ namespace ana
   template<class T> Spectrum OscillatableSpectrum::
   _Oscillated(osc::_IOscCalc<T>* calc, int from, int to) const
   {
-    TMD5* hash = calc->GetParamsHash();
-    if(hash && fCache->hash && *hash == *fCache->hash){
-      delete hash;
-      return fCache->spect;
+    const std::unique_ptr<TMD5> hash(calc->GetParamsHash());
+    if(hash){
+      const Spectrum* cached = fCache->Get(*hash, from, to);
+      if(cached) return *cached;
     }
 
     const OscCurve curve(calc, from, to);
     const Spectrum ret = WeightedBy(curve);
-    if(hash){
-      fCache->spect = ret;
-      fCache->hash.reset(hash);
-    }
+    if(hash) fCache->Insert(*hash, from, to, ret, fMat.rows());
 
     return ret;
   }
@@ -166,13 +304,90 @@ namespace ana
     return _Oscillated(calc, from, to);
   }
 
+  //----------------------------------------------------------------------
+  FusedOscillator::FusedOscillator(const std::vector<const OscillatableSpectrum*>& specs,
+                                   const std::vector<std::pair<int, int>>& chans)
+    : fSpecs(specs), fChans(chans), fBinning(Spectrum::Uninitialized())
+  {
+    assert(!specs.empty());
+    assert(specs.size() == chans.size());
+
+    for(const OscillatableSpectrum* s: specs){
+      assert(s->fMat.rows() == specs[0]->fMat.rows() &&
+             s->fMat.cols() == specs[0]->fMat.cols());
+    }
+
+    fBinning = specs[0]->Unoscillated();
+    fBinning.Clear();
+  }
+
+  //----------------------------------------------------------------------
+  Spectrum FusedOscillator::Oscillated(osc::IOscCalc* calc,
+                                       const std::vector<bool>& use) const
+  {
+    assert(use.size() == fChans.size());
+
+    const unsigned int N = kTrueEnergyBinCenters.size();
+    const std::unique_ptr<TMD5> hash(calc->GetParamsHash());
+
+    // The components generally come from different (swap) files and so have
+    // different exposures. Normalize everything to the largest.
+    double pot = 0, livetime = 0;
+    for(unsigned int c = 0; c < fChans.size(); ++c){
+      if(!use[c]) continue;
+      pot = std::max(pot, fSpecs[c]->fPOT);
+      livetime = std::max(livetime, fSpecs[c]->fLivetime);
+    }
+
+    const HistAxis axis(fBinning.GetLabels(), fBinning.GetBinnings());
+
+    Eigen::VectorXd tot = Eigen::VectorXd::Zero(fSpecs[0]->fMat.rows());
+    Eigen::VectorXd P(N+2);
+    for(unsigned int c = 0; c < fChans.size(); ++c){
+      if(!use[c]) continue;
+
+      const OscillatableSpectrum& s = *fSpecs[c];
+      if(s.fPOT <= 0) continue;
+
+      const int from = fChans[c].first;
+      const int to = fChans[c].second;
+
+      if(hash){
+        const Spectrum* cached = s.fCache->Get(*hash, from, to);
+        if(cached){
+          tot += cached->GetEigen(pot).matrix();
+          continue;
+        }
+      }
+
+      assert(s.fMat.cols() == int(N+2));
+
+      // Same layout as OscCurve, including the under and overflow bins
+      P[0] = 0;
+      P[N+1] = (from == to || to == 0) ? 1 : 0;
+      P.segment(1, N) = calc->P(from, to, kTrueEnergyBinCenters).matrix();
+
+      const Eigen::VectorXd osc = s.fMat * P;
+
+      tot += osc * (pot/s.fPOT);
+
+      if(hash){
+        s.fCache->Insert(*hash, from, to,
+                         Spectrum(Eigen::ArrayXd(osc), axis, s.fPOT, s.fLivetime),
+                         s.fMat.rows());
+      }
+    }
+
+    return Spectrum(Eigen::ArrayXd(tot), axis, pot, livetime);
+  }
+
   //----------------------------------------------------------------------
   OscillatableSpectrum& OscillatableSpectrum::operator+=(const OscillatableSpectrum& rhs)
   {
     ReweightableSpectrum::operator+=(rhs);
 
     // invalidate
-    fCache->hash.reset(nullptr);
+    fCache->Clear();
 
     return *this;
   }
@@ -191,7 +406,7 @@ namespace ana
     ReweightableSpectrum::operator-=(rhs);
 
     // invalidate
-    fCache->hash.reset(nullptr);
+    fCache->Clear();
 
     return *this;
   }
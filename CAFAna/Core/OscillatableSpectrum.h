@@ -10,7 +10,10 @@
 #include "CAFAna/Core/StanTypedefs.h"
 #include "CAFAna/Core/ThreadLocal.h"
 
+#include <list>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "TMD5.h"
 
@@ -23,14 +26,64 @@ namespace ana
 {
   class Binning;
 
-  struct OscCache
+  /// \brief Small LRU cache of oscillated spectra
+  ///
+  /// Entries are keyed by the calculator's parameter hash and the (from, to)
+  /// flavour channel. The number of entries per cache can be set with
+  /// $CAFANA_OSC_CACHE_SIZE (default 4) and the memory held by all caches in
+  /// the process is capped by $CAFANA_OSC_CACHE_MAX_MB (default 1024). Values
+  /// that aren't positive are ignored in favour of the defaults.
+  ///
+  /// A copy starts out empty, so the cache is only useful on a long-lived
+  /// spectrum, such as the components an IExtrap holds.
+  class OscCache
   {
-    std::unique_ptr<TMD5> hash;
-    Spectrum spect;
+  public:
+    struct Stats
+    {
+      long hits;
+      long misses;
+      long evictions;
+      long bytes; ///< Currently held by all caches in the process
+    };
+
+    OscCache() {}
+    OscCache(const OscCache& rhs);
+    OscCache& operator=(const OscCache& rhs);
+    OscCache(OscCache&& rhs);
+    OscCache& operator=(OscCache&& rhs);
+    ~OscCache();
+
+    /// Returns nullptr on a miss
+    const Spectrum* Get(const TMD5& hash, int from, int to) const;
+
+    void Insert(const TMD5& hash, int from, int to, const Spectrum& s, int nbins);
+
+    void Clear();
+
+    bool Empty() const {return fEntries.empty();}
+
+    static Stats GetStats();
+    static void ResetStats();
+
+    /// Override $CAFANA_OSC_CACHE_SIZE. Zero disables caching entirely
+    static void SetMaxEntries(unsigned int n);
+    /// Override $CAFANA_OSC_CACHE_MAX_MB
+    static void SetMaxMegabytes(double mb);
+
+  protected:
+    struct Entry
+    {
+      TMD5 hash;
+      int from, to;
+      Spectrum spect;
+      long bytes;
+    };
+
+    void PopBack();
 
-    OscCache()
-      : spect(Spectrum::Uninitialized())
-    {}
+    /// Most-recently-used at the front
+    mutable std::list<Entry> fEntries;
   };
 
   /// %Spectrum with true energy information, allowing it to be oscillated
@@ -40,6 +93,7 @@ namespace ana
     friend class SpectrumLoaderBase;
     friend class SpectrumLoader;
     friend class NullLoader;
+    friend class FusedOscillator;
 
     OscillatableSpectrum(const std::string& label,
                          const Binning& bins,
@@ -75,12 +129,20 @@ namespace ana
     // Expose these ones directly
     using ReweightableSpectrum::Fill;
     using ReweightableSpectrum::ToTH2;
-    using ReweightableSpectrum::Clear;
+    void Clear(){ReweightableSpectrum::Clear(); fCache->Clear();}
 
     /// Rescale bins so that \ref TrueEnergy will return \a target
-    using ReweightableSpectrum::ReweightToTrueSpectrum;
+    template<class... A> void ReweightToTrueSpectrum(A&&... args)
+    {
+      ReweightableSpectrum::ReweightToTrueSpectrum(std::forward<A>(args)...);
+      fCache->Clear();
+    }
     /// Rescale bins so that \ref Unoscillated will return \a target
-    using ReweightableSpectrum::ReweightToRecoSpectrum;
+    template<class... A> void ReweightToRecoSpectrum(A&&... args)
+    {
+      ReweightableSpectrum::ReweightToRecoSpectrum(std::forward<A>(args)...);
+      fCache->Clear();
+    }
 
     // These under a different name
     Spectrum Unoscillated() const {return UnWeighted();}
@@ -108,4 +170,35 @@ namespace ana
 
     mutable ThreadLocal<OscCache> fCache;
   };
+
+  /// \brief Oscillate many components at once
+  ///
+  /// Holds pointers to the components, which must outlive it, and reads
+  /// their contents on every call, so it never goes stale. The transition
+  /// probabilities of each selected channel are evaluated once and applied
+  /// directly to that component's reco-vs-true matrix, without the
+  /// intermediate OscCurve and Spectrum objects of
+  /// OscillatableSpectrum::Oscillated(). Results go in, and are looked up
+  /// from, the components' own OscCache, so they are shared with any other
+  /// use of the same components.
+  class FusedOscillator
+  {
+  public:
+    /// \param specs Components to combine. Must share their reco binning
+    /// \param chans (from, to) flavours to oscillate each component with
+    FusedOscillator(const std::vector<const OscillatableSpectrum*>& specs,
+                    const std::vector<std::pair<int, int>>& chans);
+
+    /// Sum of the oscillated components for which \a use is set
+    Spectrum Oscillated(osc::IOscCalc* calc, const std::vector<bool>& use) const;
+
+    unsigned int NChannels() const {return fChans.size();}
+
+  protected:
+    std::vector<const OscillatableSpectrum*> fSpecs;
+    std::vector<std::pair<int, int>> fChans;
+
+    /// Empty spectrum providing the reco binning
+    Spectrum fBinning;
+  };
 }
@@ -5,19 +5,124 @@
 
 namespace ana
 {
+  namespace
+  {
+    /// \brief A sum over bins as one node on the autodiff tape
+    ///
+    /// The adjoint of each bin of \a exp is incremented by the corresponding
+    /// entry of \a grads. Bins with zero gradient aren't stored at all.
+    class BinnedSumVari: public stan::math::vari
+    {
+    public:
+      BinnedSumVari(double val,
+                    const Eigen::ArrayXstan& exp,
+                    const Eigen::ArrayXd& grads)
+        : stan::math::vari(val), fN(0)
+      {
+        for(int i = 0; i < grads.size(); ++i) if(grads[i] != 0) ++fN;
+
+        // Lives as long as the tape does
+        auto& mem = stan::math::ChainableStack::instance_->memalloc_;
+        fOperands = mem.alloc_array<stan::math::vari*>(fN);
+        fGrads = mem.alloc_array<double>(fN);
+
+        int n = 0;
+        for(int i = 0; i < grads.size(); ++i){
+          if(grads[i] == 0) continue;
+          fOperands[n] = exp[i].vi_;
+          fGrads[n] = grads[i];
+          ++n;
+        }
+      }
+
+      void chain() override
+      {
+        for(int n = 0; n < fN; ++n) fOperands[n]->adj_ += adj_ * fGrads[n];
+      }
+
+    protected:
+      int fN;
+      stan::math::vari** fOperands;
+      double* fGrads;
+    };
+  }
+
   //----------------------------------------------------------------------
   stan::math::var LogLikelihood(const Eigen::ArrayXstan& exp,
                                 const Eigen::ArrayXd& obs)
   {
     assert(exp.size() >= 2 && exp.size() == obs.size());
 
-    stan::math::var chi = 0;
+    // The per-bin systematic is profiled within each bin, which the simple
+    // derivative below doesn't account for. Let autodiff take care of it.
+    if(LLPerBinFracSystErr::GetError() > 0){
+      stan::math::var chi = 0;
 
-    for (int i = 1; i < exp.size() - 1; ++i)
-    {
-      chi += LogLikelihood(exp[i], obs[i]);
+      for (int i = 1; i < exp.size() - 1; ++i)
+      {
+        chi += LogLikelihood(exp[i], obs[i]);
+      }
+
+      return chi;
     }
 
-    return chi;
+    double chi = 0;
+    Eigen::ArrayXd grads = Eigen::ArrayXd::Zero(exp.size());
+
+    for(int i = 1; i < exp.size() - 1; ++i){
+      const double e = exp[i].val();
+      chi += LogLikelihood(e, obs[i]);
+      // d/de of 2(e-o+o*ln(o/e)), which all the numerically-stable forms in
+      // LogLikelihood() share
+      grads[i] = obs[i] ? 2*(1 - obs[i]/e) : 2;
+    }
+
+    return stan::math::var(new BinnedSumVari(chi, exp, grads));
+  }
+
+  //----------------------------------------------------------------------
+  stan::math::var LogLikelihoodCovMx(const Eigen::ArrayXstan& exp,
+                                     const Eigen::ArrayXd& obs,
+                                     const Eigen::MatrixXd& covmxinv,
+                                     std::vector<double>* hint,
+                                     CovMxLLStatus* status)
+  {
+    assert(exp.size() >= 2 && exp.size() == obs.size());
+
+    const int N = exp.size()-2; // no under/overflow
+
+    Eigen::ArrayXd e(exp.size());
+    for(int i = 0; i < exp.size(); ++i) e[i] = exp[i].val();
+
+    // We need the solution back even if the caller doesn't want it
+    std::vector<double> localm;
+    std::vector<double>& m = hint ? *hint : localm;
+
+    CovMxLLStatus localStatus;
+    CovMxLLStatus& st = status ? *status : localStatus;
+
+    double chi = LogLikelihoodCovMxNewton(e, obs, covmxinv, &m, &st);
+
+    // The gradient below is only right at the minimum. If the Newton solver
+    // didn't get there, carry on from where it stopped with the
+    // coordinate-wise one
+    if(!st.converged){
+      const int nNewton = st.nIterations;
+      chi = LogLikelihoodCovMx(e, obs, covmxinv, &m, &st);
+      st.nIterations += nNewton;
+    }
+
+    // The chisq is minimized over m, so the only dependence left on the
+    // nominal m0 is the explicit one in (m-m0)^T M (m-m0). Bins with zero
+    // nominal are held at zero and take no part.
+    Eigen::VectorXd diff = Eigen::VectorXd::Zero(N);
+    for(int i = 0; i < N; ++i) if(e[i+1] != 0) diff[i] = m[i] - e[i+1];
+
+    const Eigen::VectorXd Mdiff = covmxinv * diff;
+
+    Eigen::ArrayXd grads = Eigen::ArrayXd::Zero(exp.size());
+    for(int i = 0; i < N; ++i) if(e[i+1] != 0) grads[i+1] = -2*Mdiff[i];
+
+    return stan::math::var(new BinnedSumVari(chi, exp, grads));
   }
 }
@@ -4,6 +4,8 @@
 
 #include <Eigen/Dense>
 
+#include <vector>
+
 namespace Eigen{
   using ArrayXstan = Eigen::Array<stan::math::var, Eigen::Dynamic, 1>;
 }
@@ -44,8 +46,30 @@ namespace util
 
 namespace ana
 {
-  /// Variant that handles the prediction in the form of Stan vars
+  struct CovMxLLStatus;
+
+  /// \brief Variant that handles the prediction in the form of Stan vars
+  ///
+  /// The whole sum is recorded as a single node on the autodiff tape, with the
+  /// derivative with respect to each bin computed analytically, rather than
+  /// as a handful of operations per bin. (Except when a
+  /// LLPerBinFracSystErr is set, where ordinary autodiff is used.)
   stan::math::var LogLikelihood(const Eigen::ArrayXstan& exp,
                                 const Eigen::ArrayXd& obs);
 
+  /// \brief Variant of \ref LogLikelihoodCovMxNewton that handles the
+  /// prediction in the form of Stan vars
+  ///
+  /// The best expectation is solved for with doubles. At that minimum the
+  /// derivatives with respect to it vanish, so the gradient with respect to
+  /// the nominal is just that of the covariance penalty, and the result is
+  /// again a single node on the tape. If the Newton solver fails to
+  /// converge the coordinate-wise one continues from where it stopped. If
+  /// that fails too \a status says so, and the gradient can't be trusted.
+  /// Arguments are as for \ref LogLikelihoodCovMx.
+  stan::math::var LogLikelihoodCovMx(const Eigen::ArrayXstan& exp,
+                                     const Eigen::ArrayXd& obs,
+                                     const Eigen::MatrixXd& covmxinv,
+                                     std::vector<double>* hint = 0,
+                                     CovMxLLStatus* status = 0);
 }
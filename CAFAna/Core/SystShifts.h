@@ -37,6 +37,13 @@ namespace ana
 
     std::vector<const ISyst*> ActiveSysts() const;
 
+    /// Call \a f on each active systematic, without the allocation involved
+    /// in \ref ActiveSysts
+    template<class F> void ForEachActiveSyst(F f) const
+    {
+      for(const auto& it: fSystsDbl) f(it.first);
+    }
+
     /// Allow derived classes to overload so they can copy themselves
     /// in case they overload Penalty().  Used in IFitter.
     /// Note that you own the copy...
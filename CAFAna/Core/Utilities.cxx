@@ -186,7 +186,8 @@ namespace ana
   double LogLikelihoodCovMx(const Eigen::ArrayXd& e,
                             const Eigen::ArrayXd& o,
                             const Eigen::MatrixXd& M,
-                            std::vector<double>* hint)
+                            std::vector<double>* hint,
+                            CovMxLLStatus* status)
   {
     // Don't use under/overflow bins (the covariance matrix doesn't have them)
     const double* m0 = e.data()+1;
@@ -213,8 +214,14 @@ namespace ana
     double prev = -999;
     double ret = 0;
 
+    CovMxLLStatus localStatus;
+    if(!status) status = &localStatus;
+    status->converged = false;
+
     // Normally converges in ~200 iterations
     for(int n = 0; n < 1000; ++n){
+      status->nIterations = n+1;
+
       // The derivatives of the chisq are quadratic functions, so it's not easy
       // to solved for all the variables simultaneously. Instead, we iterate
       // through the m's and solve them holding all the others fixed, and
@@ -261,7 +268,10 @@ namespace ana
           ret += (m[i]-m0[i]) * M(i, j) * (m[j]-m0[j]);
 
       // If the updates didn't change anything at all then we're done
-      if(ret == prev) return ret;
+      if(ret == prev){
+        status->converged = true;
+        return ret;
+      }
     } // end for n
 
     // We're most likely flipping between two extremely similar numbers at the
@@ -269,15 +279,163 @@ namespace ana
     if(fabs(ret-prev) < 1e-6){
       //      std::cout << "Warning: partially stalled LLCovMx "
       //                << fabs(ret-prev) << std::endl;
+      status->converged = true;
       return ret;
     }
 
-    // If not, we have an actual problem. Print out the bins to give some hints
-    std::cout << "LogLikelihoodCovMx stalled" << std::endl;
-    for(unsigned int i = 0; i < N; ++i){
-      std::cout << i << " " << d[i] << " " << m0[i] << " -> " << m[i] << " " << LogLikelihood(m[i], d[i]) << std::endl;
+    // If not, we have an actual problem. Leave it to the caller to decide
+    // what to do, but if they aren't checking print out the bins to give
+    // some hints.
+    if(status == &localStatus){
+      std::cout << "Warning: LogLikelihoodCovMx stalled" << std::endl;
+      for(unsigned int i = 0; i < N; ++i){
+        std::cout << i << " " << d[i] << " " << m0[i] << " -> " << m[i] << " " << LogLikelihood(m[i], d[i]) << std::endl;
+      }
     }
-    abort();
+
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  double LogLikelihoodCovMxNewton(const Eigen::ArrayXd& e,
+                                  const Eigen::ArrayXd& o,
+                                  const Eigen::MatrixXd& M,
+                                  std::vector<double>* hint,
+                                  CovMxLLStatus* status)
+  {
+    // Don't use under/overflow bins (the covariance matrix doesn't have them)
+    const double* m0 = e.data()+1;
+    const double* d = o.data()+1;
+    const unsigned int N = e.size()-2;
+
+    assert(M.rows() == int(N));
+
+    CovMxLLStatus localStatus;
+    if(!status) status = &localStatus;
+    status->converged = false;
+    status->nIterations = 0;
+
+    // As in the coordinate-wise version, bins with no expectation are held
+    // at zero, and so don't contribute to the penalty.
+    std::vector<int> idx;
+    idx.reserve(N);
+    for(unsigned int i = 0; i < N; ++i) if(m0[i] != 0) idx.push_back(i);
+    const int K = idx.size();
+
+    Eigen::VectorXd dA(K), m0A(K), mA(K);
+    Eigen::MatrixXd MA(K, K);
+    for(int a = 0; a < K; ++a){
+      dA[a] = d[idx[a]];
+      m0A[a] = m0[idx[a]];
+      for(int b = 0; b < K; ++b) MA(a, b) = M(idx[a], idx[b]);
+    }
+
+    // Warm start from a similar previous problem if we have one, otherwise
+    // from the nominal MC
+    std::vector<double> localm;
+    std::vector<double>& mv = hint ? *hint : localm;
+    const bool warm = (mv.size() == N);
+    for(int a = 0; a < K; ++a){
+      mA[a] = (warm && mv[idx[a]] > 0) ? mv[idx[a]] : m0A[a];
+    }
+
+    // Inactive bins still contribute their (constant) LL term
+    double inactiveLL = 0;
+    for(unsigned int i = 0; i < N; ++i) if(m0[i] == 0) inactiveLL += LogLikelihood(0, d[i]);
+
+    auto Objective = [&](const Eigen::VectorXd& m)
+    {
+      double ret = inactiveLL;
+      for(int a = 0; a < K; ++a) ret += LogLikelihood(m[a], dA[a]);
+      const Eigen::VectorXd diff = m-m0A;
+      return ret + diff.dot(MA*diff);
+    };
+
+    double ret = Objective(mA);
+
+    Eigen::VectorXd grad(K), step(K), mNew(K);
+    Eigen::MatrixXd hess(K, K);
+
+    for(int n = 0; n < 100; ++n){
+      status->nIterations = n+1;
+
+      const Eigen::VectorXd Mdiff = MA*(mA-m0A);
+
+      // Derivatives of the chisq. Bins with zero data and zero expectation
+      // sit on the boundary, and we hold them there if the gradient would
+      // push them negative.
+      hess = 2*MA;
+      std::vector<bool> fixed(K, false);
+      for(int a = 0; a < K; ++a){
+        grad[a] = 2*(1 - (mA[a] > 0 ? dA[a]/mA[a] : 0)) + 2*Mdiff[a];
+        if(mA[a] > 0) hess(a, a) += 2*dA[a]/util::sqr(mA[a]);
+        if(mA[a] == 0 && dA[a] == 0 && grad[a] > 0) fixed[a] = true;
+      }
+      for(int a = 0; a < K; ++a){
+        if(!fixed[a]) continue;
+        grad[a] = 0;
+        hess.row(a).setZero();
+        hess.col(a).setZero();
+        hess(a, a) = 1;
+      }
+
+      Eigen::LLT<Eigen::MatrixXd> llt(hess);
+      if(llt.info() == Eigen::Success){
+        step = -llt.solve(grad);
+      }
+      else{
+        // Should only happen for a badly-formed matrix. Fall back to
+        // something that is at least a descent direction.
+        step = -grad;
+      }
+
+      // Newton decrement. Once this is tiny we're at the minimum to within
+      // floating-point precision.
+      const double decrement = -grad.dot(step);
+      if(decrement < 1e-12*(1+fabs(ret))){
+        status->converged = true;
+        break;
+      }
+
+      // Bins with data must stay strictly positive, empty ones can go to
+      // zero
+      double alpha = 1;
+      for(int a = 0; a < K; ++a){
+        if(step[a] < 0 && dA[a] > 0) alpha = std::min(alpha, -.9*mA[a]/step[a]);
+      }
+
+      // Backtrack until we get sufficient decrease
+      double newret = ret;
+      for(int ls = 0; ls < 50; ++ls){
+        mNew = (mA + alpha*step).cwiseMax(0.);
+        newret = Objective(mNew);
+        if(newret <= ret - 1e-4*alpha*decrement) break;
+        alpha /= 2;
+      }
+
+      if(!(newret < ret)){
+        // No progress possible, we're as converged as we can get
+        status->converged = (fabs(newret-ret) < 1e-6);
+        break;
+      }
+
+      mA = mNew;
+      ret = newret;
+    } // end for n
+
+    if(!status->converged && status == &localStatus){
+      std::cout << "Warning: LogLikelihoodCovMxNewton did not converge after "
+                << status->nIterations << " iterations" << std::endl;
+    }
+
+    // Save our solution to seed the next call
+    if(!warm){
+      mv.resize(N);
+      for(unsigned int i = 0; i < N; ++i) mv[i] = m0[i];
+    }
+    for(int a = 0; a < K; ++a) mv[idx[a]] = mA[a];
+
+    return ret;
   }
 
   //----------------------------------------------------------------------
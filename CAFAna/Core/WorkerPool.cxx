@@ -0,0 +1,138 @@
+#include "CAFAna/Core/WorkerPool.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace ana
+{
+  namespace
+  {
+    // Zero means "the total budget"
+    thread_local unsigned gLocalBudget = 0;
+  }
+
+  //----------------------------------------------------------------------
+  unsigned TotalThreadBudget()
+  {
+    static const unsigned total = [](){
+      const char* env = getenv("CAFANA_NTHREADS");
+      if(env && atoi(env) > 0) return unsigned(atoi(env));
+      return std::max(1u, std::thread::hardware_concurrency());
+    }();
+    return total;
+  }
+
+  //----------------------------------------------------------------------
+  unsigned LocalThreadBudget()
+  {
+    return gLocalBudget ? gLocalBudget : TotalThreadBudget();
+  }
+
+  //----------------------------------------------------------------------
+  ThreadBudgetGuard::ThreadBudgetGuard(unsigned n)
+    : fPrev(gLocalBudget)
+  {
+    gLocalBudget = std::max(1u, n);
+  }
+
+  //----------------------------------------------------------------------
+  ThreadBudgetGuard::~ThreadBudgetGuard()
+  {
+    gLocalBudget = fPrev;
+  }
+
+  //----------------------------------------------------------------------
+  WorkerPool::WorkerPool(unsigned nThreads)
+    : fFunc(0), fNTasks(0), fNextTask(0), fNRemaining(0), fShare(1),
+      fGeneration(0), fStop(false)
+  {
+    if(nThreads == 0) nThreads = LocalThreadBudget();
+
+    for(unsigned i = 1; i < nThreads; ++i)
+      fThreads.emplace_back(&WorkerPool::WorkerLoop, this);
+  }
+
+  //----------------------------------------------------------------------
+  WorkerPool::~WorkerPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fStop = true;
+    }
+    fWake.notify_all();
+    for(std::thread& t: fThreads) t.join();
+  }
+
+  //----------------------------------------------------------------------
+  void WorkerPool::ParallelFor(unsigned n,
+                               const std::function<void(unsigned)>& func)
+  {
+    std::unique_lock<std::mutex> busy(fBusy, std::try_to_lock);
+
+    if(!busy.owns_lock() || fThreads.empty() || n < 2){
+      for(unsigned i = 0; i < n; ++i) func(i);
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fFunc = &func;
+      fNTasks = n;
+      fNextTask = 0;
+      fNRemaining = n;
+      fShare = std::max(1u, LocalThreadBudget() / std::min(n, NThreads()));
+      fError = nullptr;
+      ++fGeneration;
+    }
+    fWake.notify_all();
+
+    RunTasks();
+
+    std::unique_lock<std::mutex> lock(fMutex);
+    fDone.wait(lock, [this]{return fNRemaining == 0;});
+    fFunc = 0;
+
+    if(fError) std::rethrow_exception(fError);
+  }
+
+  //----------------------------------------------------------------------
+  void WorkerPool::RunTasks()
+  {
+    std::unique_lock<std::mutex> lock(fMutex);
+
+    const ThreadBudgetGuard guard(fShare);
+
+    while(fFunc && fNextTask < fNTasks){
+      const unsigned i = fNextTask++;
+      const std::function<void(unsigned)>& func = *fFunc;
+      lock.unlock();
+
+      std::exception_ptr err;
+      try{
+        func(i);
+      }
+      catch(...){
+        err = std::current_exception();
+      }
+
+      lock.lock();
+      if(err && !fError) fError = err;
+      if(--fNRemaining == 0) fDone.notify_all();
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void WorkerPool::WorkerLoop()
+  {
+    long seen = 0;
+    while(true){
+      {
+        std::unique_lock<std::mutex> lock(fMutex);
+        fWake.wait(lock, [&]{return fStop || fGeneration != seen;});
+        if(fStop) return;
+        seen = fGeneration;
+      }
+      RunTasks();
+    }
+  }
+}
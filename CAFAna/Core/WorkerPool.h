@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ana
+{
+  /// \brief Total number of threads CAFAna should use, across all levels of
+  /// parallelism
+  ///
+  /// Taken from $CAFANA_NTHREADS if set, otherwise the hardware concurrency
+  unsigned TotalThreadBudget();
+
+  /// \brief Number of threads the calling thread may use for any nested
+  /// parallelism of its own
+  ///
+  /// This is the total budget for the main thread, and a share of it for
+  /// tasks run by \ref WorkerPool
+  unsigned LocalThreadBudget();
+
+  /// Restrict \ref LocalThreadBudget for the current thread within a scope
+  class ThreadBudgetGuard
+  {
+  public:
+    ThreadBudgetGuard(unsigned n);
+    ~ThreadBudgetGuard();
+  protected:
+    unsigned fPrev;
+  };
+
+  /// \brief Persistent set of threads for repeatedly running small batches
+  /// of tasks
+  ///
+  /// Unlike ThreadPool, threads are kept alive between batches, so this is
+  /// suitable for use inside a fit's function evaluation.
+  class WorkerPool
+  {
+  public:
+    /// \param nThreads Number of threads including the caller's. Zero means
+    ///                 use \ref LocalThreadBudget of the constructing thread
+    WorkerPool(unsigned nThreads = 0);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    /// \brief Run func(0) ... func(n-1), returning once all are complete
+    ///
+    /// The calling thread takes part. Each task gets an equal share of the
+    /// caller's \ref LocalThreadBudget. Any exception thrown by a task is
+    /// rethrown here. If the pool is already busy (eg a reentrant call) the
+    /// tasks are simply run serially.
+    void ParallelFor(unsigned n, const std::function<void(unsigned)>& func);
+
+    unsigned NThreads() const {return fThreads.size()+1;}
+
+  protected:
+    void WorkerLoop();
+    void RunTasks();
+
+    std::vector<std::thread> fThreads;
+
+    std::mutex fBusy; ///< Held for the duration of a ParallelFor
+    std::mutex fMutex;
+    std::condition_variable fWake, fDone;
+
+    // State of the current batch, protected by fMutex
+    const std::function<void(unsigned)>* fFunc;
+    unsigned fNTasks;
+    unsigned fNextTask;
+    unsigned fNRemaining;
+    unsigned fShare;
+    long fGeneration;
+    bool fStop;
+    std::exception_ptr fError;
+  };
+}
@@ -12,8 +12,6 @@ namespace ana
     double ChiSq(Eigen::ArrayXd apred, Eigen::ArrayXd adata) const override;
 
   protected:
-    Eigen::MatrixXd GetAbsInvCovMat(const Eigen::ArrayXd& apred) const;
-
     Eigen::MatrixXd fCovMxFrac;
   };
 }
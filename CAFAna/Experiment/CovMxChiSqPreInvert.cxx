@@ -1,6 +1,6 @@
 #include "CAFAna/Experiment/CovMxChiSqPreInvert.h"
 
-#include "CAFAna/Core/Utilities.h"
+#include <cassert>
 
 namespace ana
 {
@@ -28,38 +28,18 @@ namespace ana
   //----------------------------------------------------------------------
   double CovMxChiSqPreInvert::ChiSq(Eigen::ArrayXd apred,
                                     Eigen::ArrayXd adata) const
-  {
-    Eigen::MatrixXd covInvM = GetAbsInvCovMat(apred);
-
-    // Now the matrix is in order apply the mask to the two histograms
-    ApplyMask(apred, adata);
-
-    // Now it's absolute it's suitable for use in the chisq calculation
-    return Chi2CovMx(apred, adata, covInvM);
-  }
-
-  //----------------------------------------------------------------------
-  Eigen::MatrixXd CovMxChiSqPreInvert::GetAbsInvCovMat(const Eigen::ArrayXd& apred) const
   {
     // Prediction has under/overflow and matrix does not
     assert(apred.size() == fCovMxInv.rows()+2);
 
-    Eigen::MatrixXd covInv = fCovMxInv;
-
-    const int N = apred.size()-2; // no under/overflow
+    // Masked bins have zero prediction and so drop out of the residual
+    ApplyMask(apred, adata);
 
-    // Covariance matrix is fractional; convert it to absolute by multiplying
-    // out the prediction
-    //
-    // TODO there is probably a nice Eigen expression that will do this
-    for(int b0 = 0; b0 < N; ++b0){
-      for(int b1 = 0; b1 < N; ++b1){
-        const double f = apred[b0+1] * apred[b1+1];
-        if(f != 0) covInv.coeffRef(b0, b1) /= f;
-        else covInv.coeffRef(b0, b1) = 0.;
-      }
-    }
+    // Covariance matrix is fractional. Rather than converting it to absolute
+    // by dividing out the prediction, express the residual in the same
+    // fractional terms.
+    const Eigen::VectorXd r = FracResidual(apred, adata);
 
-    return covInv;
+    return r.dot(fCovMxInv*r);
   }
 }
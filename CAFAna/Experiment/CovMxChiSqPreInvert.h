@@ -13,8 +13,6 @@ namespace ana
     virtual double ChiSq(Eigen::ArrayXd apred, Eigen::ArrayXd adata) const override;
 
   protected:
-    Eigen::MatrixXd GetAbsInvCovMat(const Eigen::ArrayXd& apred) const;
-
     Eigen::MatrixXd fCovMxInv;
   };
 }
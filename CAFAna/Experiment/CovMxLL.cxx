@@ -1,12 +1,56 @@
 #include "CAFAna/Experiment/CovMxLL.h"
 
-#include "CAFAna/Core/Utilities.h"
+#include "CAFAna/Core/Stan.h"
+
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <string>
 
 namespace ana
 {
+  namespace
+  {
+    std::atomic<long> gNNotConverged(0);
+
+    /// Report the total at the end of the job, if there's anything to say
+    struct NotConvergedSummary
+    {
+      ~NotConvergedSummary()
+      {
+        if(gNNotConverged > 1){
+          std::cerr << "CovMxLL: solver failed to converge in "
+                    << gNNotConverged << " evaluations in total" << std::endl;
+        }
+      }
+    };
+  }
+
+  //----------------------------------------------------------------------
+  void CovMxLL::NotConverged(const CovMxLLStatus& status,
+                             const std::string& outcome)
+  {
+    static NotConvergedSummary summary;
+
+    // In a fit or scan this can happen thousands of times, so only the first
+    // is reported as it happens
+    if(gNNotConverged++ == 0){
+      std::cerr << "CovMxLL: solver did not converge after "
+                << status.nIterations << " iterations. "
+                << outcome
+                << ". Further failures will only be counted" << std::endl;
+    }
+  }
+
+  //----------------------------------------------------------------------
+  long CovMxLL::NumNotConverged()
+  {
+    return gNNotConverged;
+  }
+
   //----------------------------------------------------------------------
-  CovMxLL::CovMxLL(const Eigen::MatrixXd& mat)
-    : fCovMxInv(mat.inverse())
+  CovMxLL::CovMxLL(const Eigen::MatrixXd& mat, ESolver solver)
+    : fCovMxInv(mat.inverse()), fSolver(solver)
   {
   }
 
@@ -15,6 +59,38 @@ namespace ana
   {
     ApplyMask(apred, adata);
 
-    return LogLikelihoodCovMx(apred, adata, fCovMxInv, &fState);
+    std::vector<double>& state = *fState;
+    CovMxLLStatus& status = *fStatus;
+
+    const double ret = (fSolver == kNewton) ?
+      LogLikelihoodCovMxNewton(apred, adata, fCovMxInv, &state, &status) :
+      LogLikelihoodCovMx(apred, adata, fCovMxInv, &state, &status);
+
+    if(!status.converged){
+      NotConverged(status, "Returning best value "+std::to_string(ret));
+    }
+
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  stan::math::var CovMxLL::ChiSq(Eigen::ArrayXstan apred,
+                                 Eigen::ArrayXd adata) const
+  {
+    ApplyMask(apred, adata);
+
+    CovMxLLStatus& status = *fStatus;
+
+    const stan::math::var ret = LogLikelihoodCovMx(apred, adata, fCovMxInv,
+                                                   &*fState, &status);
+
+    // The gradient is only right at the minimum. Stan takes a domain_error
+    // as a rejection of the point, like a divergence
+    if(!status.converged){
+      NotConverged(status, "Rejecting the point, since the gradient is unreliable");
+      throw std::domain_error("CovMxLL: solver did not converge");
+    }
+
+    return ret;
   }
 }
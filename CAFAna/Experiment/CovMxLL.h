@@ -2,18 +2,48 @@
 
 #include "CAFAna/Experiment/ICovarianceMatrix.h"
 
+#include "CAFAna/Core/ThreadLocal.h"
+#include "CAFAna/Core/Utilities.h"
+
 namespace ana
 {
   class CovMxLL: public ICovarianceMatrix
   {
   public:
-    CovMxLL(const Eigen::MatrixXd& mat);
+    enum ESolver{
+      kNewton,           ///< Newton steps on all bins simultaneously
+      kCoordinateDescent ///< Original bin-by-bin solution
+    };
+
+    CovMxLL(const Eigen::MatrixXd& mat, ESolver solver = kNewton);
 
     double ChiSq(Eigen::ArrayXd apred, Eigen::ArrayXd adata) const override;
 
+    /// Always uses the Newton solver, see \ref LogLikelihoodCovMx. Throws
+    /// std::domain_error, which Stan treats as a rejected point, if the
+    /// solution isn't found
+    stan::math::var ChiSq(Eigen::ArrayXstan apred,
+                          Eigen::ArrayXd adata) const override;
+
+    /// Convergence information from the calling thread's most recent call
+    /// to \ref ChiSq
+    CovMxLLStatus GetLastStatus() const {return *fStatus;}
+
+    /// How many evaluations, by any CovMxLL in the process, the solver
+    /// failed to converge in. Only the first is reported as it happens, and
+    /// the total at exit
+    static long NumNotConverged();
+
   protected:
+    static void NotConverged(const CovMxLLStatus& status,
+                             const std::string& outcome);
+
     Eigen::MatrixXd fCovMxInv;
+    ESolver fSolver;
 
-    mutable std::vector<double> fState;
+    /// Solver warm start and status. Per-thread, since one experiment is
+    /// commonly evaluated from several threads at once
+    mutable ThreadLocal<std::vector<double>> fState;
+    mutable ThreadLocal<CovMxLLStatus> fStatus;
   };
 }
@@ -1,5 +1,6 @@
 #include "CAFAna/Experiment/CovarianceExperiment.h"
 
+#include "CAFAna/Core/Stan.h"
 #include "CAFAna/Core/Utilities.h"
 
 #include "CAFAna/Experiment/CovMxChiSq.h"
@@ -13,6 +14,31 @@
 
 namespace ana
 {
+  namespace
+  {
+    /// Implementation of CovarianceExperiment::Concatenate for doubles or
+    /// Stan vars
+    template<class T> Eigen::Array<T, Eigen::Dynamic, 1>
+    ConcatenateT(const std::vector<Eigen::Array<T, Eigen::Dynamic, 1>>& arrs)
+    {
+      // Drop under/overflow from each argument, but include dummy
+      // under/overflows as expected by fCov
+      int N = 2;
+      for(const auto& arr: arrs) N += arr.size()-2;
+      Eigen::Array<T, Eigen::Dynamic, 1> ret(N);
+      ret[0] = 0;
+      ret[N-1] = 0;
+
+      T* p = &ret.data()[1]; // start writing at first non-underflow bin
+
+      for(const auto& arr: arrs){
+        for(int i = 1; i < arr.size()-1; ++i) *p++ = arr[i];
+      }
+
+      return ret;
+    }
+  }
+
   //----------------------------------------------------------------------
   TMatrixD* CovarianceExperiment::GetCov(const std::string& fname,
                                          const std::string& matname)
@@ -81,21 +107,13 @@ namespace ana
   //----------------------------------------------------------------------
   Eigen::ArrayXd CovarianceExperiment::Concatenate(const std::vector<Eigen::ArrayXd>& arrs)
   {
-    // Drop under/overflow from each argument, but include dummy
-    // under/overflows as expected by fCov
-    int N = 2;
-    for(const Eigen::ArrayXd& arr: arrs) N += arr.size()-2;
-    Eigen::ArrayXd ret(N);
-    ret[0] = 0;
-    ret[N-1] = 0;
-
-    double* p = &ret.data()[1]; // start writing at first non-underflow bin
-
-    for(const Eigen::ArrayXd& arr: arrs){
-      for(int i = 1; i < arr.size()-1; ++i) *p++ = arr[i];
-    }
+    return ConcatenateT(arrs);
+  }
 
-    return ret;
+  //----------------------------------------------------------------------
+  Eigen::ArrayXstan CovarianceExperiment::Concatenate(const std::vector<Eigen::ArrayXstan>& arrs)
+  {
+    return ConcatenateT(arrs);
   }
 
   //----------------------------------------------------------------------
@@ -111,6 +129,25 @@ namespace ana
     return Concatenate(apreds);
   }
 
+  //----------------------------------------------------------------------
+  Eigen::ArrayXstan CovarianceExperiment::PredictStan(osc::IOscCalcAdjustableStan* calc,
+                                                      const SystShifts& syst) const
+  {
+    std::vector<Eigen::ArrayXstan> apreds(fMCs.size());
+
+    for(unsigned int i = 0; i < fMCs.size(); ++i){
+      const Spectrum pred = fMCs[i]->PredictSyst(calc, syst);
+      // It's possible to have a non-stan prediction. e.g. from a NoOsc
+      // prediction with no systs.
+      if(pred.HasStan())
+        apreds[i] = pred.GetEigenStan(fDatas[i].POT());
+      else
+        apreds[i] = pred.GetEigen(fDatas[i].POT()).cast<stan::math::var>();
+    }
+
+    return Concatenate(apreds);
+  }
+
   //----------------------------------------------------------------------
   double CovarianceExperiment::ChiSq(osc::IOscCalcAdjustable* calc,
                                      const SystShifts& syst) const
@@ -122,8 +159,8 @@ namespace ana
   stan::math::var CovarianceExperiment::LogLikelihood(osc::IOscCalcAdjustableStan *osc,
                                                       const SystShifts &syst) const
   {
-    std::cout << "CovarianceExperiment doesn't yet support OscCalcStan" << std::endl;
-    abort();
+    // ChiSq(), confusingly, returns chi2=-2*LL
+    return fCov->ChiSq(PredictStan(osc, syst), fDataA) / -2.;
   }
 
   //----------------------------------------------------------------------
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "CAFAna/Core/FwdDeclare.h"
+#include "CAFAna/Core/StanUtils.h"
 #include "CAFAna/Prediction/IPrediction.h"
 #include "CAFAna/Experiment/IExperiment.h"
 
@@ -87,10 +88,14 @@ namespace ana
     /// NB handling of under/overflow here. Result of concatenating N M-bin
     /// arrays will have 2+N*(M-2) bins
     static Eigen::ArrayXd Concatenate(const std::vector<Eigen::ArrayXd>& arrs);
+    static Eigen::ArrayXstan Concatenate(const std::vector<Eigen::ArrayXstan>& arrs);
 
     Eigen::ArrayXd Predict(osc::IOscCalc* osc,
                            const SystShifts& syst = kNoShift) const;
 
+    Eigen::ArrayXstan PredictStan(osc::IOscCalcAdjustableStan* osc,
+                                  const SystShifts& syst = kNoShift) const;
+
     std::vector<const IPrediction*> fMCs;
     std::vector<Spectrum> fDatas;
     Eigen::ArrayXd fDataA;
@@ -1,7 +1,20 @@
 #include "CAFAna/Experiment/ICovarianceMatrix.h"
 
+#include "CAFAna/Core/Stan.h"
+
+#include <cassert>
+#include <iostream>
+
 namespace ana
 {
+  //----------------------------------------------------------------------
+  stan::math::var ICovarianceMatrix::ChiSq(Eigen::ArrayXstan apred,
+                                           Eigen::ArrayXd adata) const
+  {
+    std::cout << "This ICovarianceMatrix doesn't support OscCalcStan" << std::endl;
+    abort();
+  }
+
   //----------------------------------------------------------------------
   void ICovarianceMatrix::ApplyMask(Eigen::ArrayXd& a, Eigen::ArrayXd& b) const
   {
@@ -14,4 +27,33 @@ namespace ana
     a *= fMaskA;
     b *= fMaskA;
   }
+
+  //----------------------------------------------------------------------
+  void ICovarianceMatrix::ApplyMask(Eigen::ArrayXstan& a, Eigen::ArrayXd& b) const
+  {
+    if(fMaskA.size() == 0) return;
+
+    assert(a.size() == fMaskA.size());
+    assert(b.size() == fMaskA.size());
+
+    // Only touch the masked bins, to keep the rest off the autodiff tape
+    for(int i = 0; i < a.size(); ++i) if(fMaskA[i] != 1) a[i] *= fMaskA[i];
+    b *= fMaskA;
+  }
+
+  //----------------------------------------------------------------------
+  Eigen::VectorXd ICovarianceMatrix::FracResidual(const Eigen::ArrayXd& pred,
+                                                  const Eigen::ArrayXd& data)
+  {
+    assert(pred.size() == data.size());
+
+    const int N = pred.size()-2; // no under/overflow
+
+    Eigen::VectorXd ret(N);
+    for(int b = 0; b < N; ++b){
+      const double p = pred[b+1];
+      ret[b] = (p != 0) ? (p-data[b+1])/p : 0;
+    }
+    return ret;
+  }
 }
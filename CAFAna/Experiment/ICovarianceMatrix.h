@@ -1,5 +1,7 @@
 #pragma once
 
+#include "CAFAna/Core/StanUtils.h"
+
 #include <Eigen/Dense>
 
 namespace ana
@@ -11,12 +13,26 @@ namespace ana
 
     virtual double ChiSq(Eigen::ArrayXd apred, Eigen::ArrayXd adata) const = 0;
 
+    /// Variant for a prediction in the form of Stan vars. Aborts unless
+    /// overridden
+    virtual stan::math::var ChiSq(Eigen::ArrayXstan apred,
+                                  Eigen::ArrayXd adata) const;
+
     void SetMask(const Eigen::ArrayXd& mask){fMaskA = mask;}
 
   protected:
     ICovarianceMatrix() {}
 
     void ApplyMask(Eigen::ArrayXd& a, Eigen::ArrayXd& b) const;
+    void ApplyMask(Eigen::ArrayXstan& a, Eigen::ArrayXd& b) const;
+
+    /// \brief (pred-data)/pred, excluding under/overflow
+    ///
+    /// For use with fractional matrices, where
+    /// \f$ r^T (D^{-1} M D^{-1}) r = (r/p)^T M (r/p) \f$ with \f$D=diag(p)\f$
+    /// saves scaling the matrix. Bins with zero prediction don't contribute.
+    static Eigen::VectorXd FracResidual(const Eigen::ArrayXd& pred,
+                                        const Eigen::ArrayXd& data);
 
     Eigen::ArrayXd fMaskA;
   };
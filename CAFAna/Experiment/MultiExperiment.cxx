@@ -4,6 +4,7 @@
 
 #include "CAFAna/Core/LoadFromFile.h"
 #include "CAFAna/Core/Stan.h"
+#include "CAFAna/Core/WorkerPool.h"
 
 #include "OscLib/IOscCalc.h"
 
@@ -13,9 +14,17 @@
 #include "TVectorD.h"
 
 #include <cassert>
+#include <mutex>
 
 namespace ana
 {
+  //----------------------------------------------------------------------
+  struct MultiExperiment::ParallelState
+  {
+    std::once_flag init;
+    std::unique_ptr<WorkerPool> pool;
+  };
+
   //----------------------------------------------------------------------
   SystShifts MultiExperiment::TranslateShifts(const SystShifts& syst, int idx) const
   {
@@ -49,6 +58,8 @@ namespace ana
   double MultiExperiment::ChiSq(osc::IOscCalcAdjustable* osc,
                                 const SystShifts& syst) const
   {
+    if(fParallel && fExpts.size() > 1) return ParallelChiSq(osc, syst);
+
     double ret = 0.;
     for(unsigned int idx = 0; idx < fExpts.size(); ++idx){
       ret += fExpts[idx]->ChiSq(osc, TranslateShifts(syst, idx));
@@ -56,6 +67,50 @@ namespace ana
     return ret;
   }
 
+  //----------------------------------------------------------------------
+  double MultiExperiment::ParallelChiSq(osc::IOscCalcAdjustable* osc,
+                                        const SystShifts& syst) const
+  {
+    const unsigned int N = fExpts.size();
+
+    // The first call is made serially. PredictionInterp initializes itself
+    // safely under a lock, but we can't vouch for every other experiment and
+    // prediction type, so give them all the chance to set themselves up
+    // before they're called concurrently.
+    bool first = false;
+    double ret = 0.;
+    std::call_once(fParallelState->init, [&](){
+      first = true;
+      for(unsigned int idx = 0; idx < N; ++idx){
+        ret += fExpts[idx]->ChiSq(osc, TranslateShifts(syst, idx));
+      }
+      fParallelState->pool = std::make_unique<WorkerPool>(std::min(N, LocalThreadBudget()));
+    });
+    if(first) return ret;
+
+    // Calculators cache internally, so they can't be shared between threads
+    std::vector<std::unique_ptr<osc::IOscCalcAdjustable>> oscs(N);
+    for(unsigned int idx = 1; idx < N; ++idx) oscs[idx].reset(osc->Copy());
+
+    std::vector<double> chis(N);
+    fParallelState->pool->ParallelFor(N, [&](unsigned int idx){
+      chis[idx] = fExpts[idx]->ChiSq(idx == 0 ? osc : oscs[idx].get(),
+                                     TranslateShifts(syst, idx));
+    });
+
+    // Sum in a fixed order so that the result is reproducible
+    for(double chi: chis) ret += chi;
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  void MultiExperiment::SetParallel(bool parallel)
+  {
+    fParallel = parallel;
+    if(fParallel && !fParallelState)
+      fParallelState = std::make_shared<ParallelState>();
+  }
+
   //----------------------------------------------------------------------
   void MultiExperiment::
   SetSystCorrelations(int idx,
@@ -11,7 +11,8 @@ namespace ana
   class MultiExperiment: public IExperiment
   {
   public:
-    MultiExperiment(std::vector<const IExperiment*> expts = {}) : fExpts(expts)
+    MultiExperiment(std::vector<const IExperiment*> expts = {})
+      : fExpts(expts), fParallel(false)
     {
       fSystCorrelations.resize(expts.size());
     }
@@ -44,14 +45,33 @@ namespace ana
                              const std::vector<std::pair<const ISyst*,
                                                          const ISyst*>>& corrs);
 
+    /// \brief Evaluate the sub-experiments concurrently in \ref ChiSq
+    ///
+    /// Each sub-experiment gets its own copy of the oscillation calculator,
+    /// and an equal share of \ref LocalThreadBudget for any parallelism
+    /// within its prediction. The threads persist between calls. Results are
+    /// summed in a fixed order, so the total doesn't depend on scheduling.
+    ///
+    /// \ref LogLikelihood is always serial, because the Stan autodiff stack
+    /// belongs to a single thread.
+    void SetParallel(bool parallel = true);
+
     virtual void SaveTo(TDirectory* dir, const std::string& name) const override;
     static std::unique_ptr<MultiExperiment> LoadFrom(TDirectory* dir, const std::string& name);
 
   protected:
     SystShifts TranslateShifts(const SystShifts& syst, int idx) const;
 
+    double ParallelChiSq(osc::IOscCalcAdjustable* osc,
+                         const SystShifts& syst) const;
+
     std::vector<std::vector<std::pair<const ISyst*, const ISyst*>>> fSystCorrelations;
 
     std::vector<const IExperiment*> fExpts;
+
+    struct ParallelState;
+    bool fParallel;
+    /// Shared between copies, which is fine since the pool is reentrant
+    std::shared_ptr<ParallelState> fParallelState;
   };
 }
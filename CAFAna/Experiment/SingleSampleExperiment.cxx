@@ -16,8 +16,10 @@ namespace ana
   //----------------------------------------------------------------------
   SingleSampleExperiment::SingleSampleExperiment(const IPrediction* pred,
                                                  const Spectrum& data)
-    : fMC(pred), fData(data)
+    : fMC(pred), fData(data), fDataA(data.GetEigen(data.POT()))
   {
+    // Everything except the overflow, as in LogLikelihood()
+    fLiveBins = {{0, int(fDataA.size())-1}};
   }
 
   //----------------------------------------------------------------------
@@ -29,14 +31,23 @@ namespace ana
   double SingleSampleExperiment::ChiSq(osc::IOscCalcAdjustable* calc,
                                        const SystShifts& syst) const
   {
-    Eigen::ArrayXd apred = fMC->PredictSyst(calc, syst).GetEigen(fData.POT());
-    Eigen::ArrayXd adata = fData.GetEigen(fData.POT());
-
-    ApplyMask(apred, adata);
-
-    // full namespace qualification to avoid degeneracy with method inherited
-    // from IExperiment
-    return ana::LogLikelihood(apred, adata);
+    // Once the storage is sized this involves no allocations
+    Eigen::ArrayXd& apred = *fPredA;
+    apred.resize(fDataA.size());
+
+    // Masked bins don't need predicting, and contribute nothing to the
+    // likelihood
+    fMC->PredictSystInto(calc, syst, fData.POT(), apred, &fLiveBins);
+
+    double ret = 0;
+    for(const std::pair<int, int>& r: fLiveBins){
+      for(int i = r.first; i < r.second; ++i){
+        // full namespace qualification to avoid degeneracy with method
+        // inherited from IExperiment
+        ret += ana::LogLikelihood(apred[i], fDataA[i]);
+      }
+    }
+    return ret;
   }
 
   //----------------------------------------------------------------------
@@ -118,5 +129,19 @@ namespace ana
   void SingleSampleExperiment::SetMaskHist(double xmin, double xmax, double ymin, double ymax)
   {
     fMaskA = GetMaskArray(fData, xmin, xmax, ymin, ymax);
+
+    fDataA = fData.GetEigen(fData.POT()) * fMaskA;
+
+    // Collect contiguous runs of unmasked bins. The overflow bin never
+    // contributes to the likelihood.
+    fLiveBins.clear();
+    const int N = fMaskA.size()-1;
+    for(int i = 0; i < N; ++i){
+      if(fMaskA[i] == 0) continue;
+      if(!fLiveBins.empty() && fLiveBins.back().second == i)
+        ++fLiveBins.back().second;
+      else
+        fLiveBins.emplace_back(i, i+1);
+    }
   }
 }
@@ -4,6 +4,8 @@
 #include "CAFAna/Prediction/IPrediction.h"
 #include "CAFAna/Experiment/IExperiment.h"
 
+#include "CAFAna/Core/ThreadLocal.h"
+
 namespace ana
 {
   /// Compare a single data spectrum to the MC expectation
@@ -32,7 +34,9 @@ namespace ana
 
     // need to explicitly declare move constructor since copy constructor is deleted
     SingleSampleExperiment(SingleSampleExperiment&& s)
-      : fMC(s.fMC), fData(std::move(s.fData))
+      : fMC(s.fMC), fData(std::move(s.fData)),
+        fMaskA(std::move(s.fMaskA)), fLiveBins(std::move(s.fLiveBins)),
+        fDataA(std::move(s.fDataA))
     {
       s.fMC = nullptr;
     }
@@ -46,5 +50,12 @@ namespace ana
     const IPrediction* fMC;
     Spectrum fData;
     Eigen::ArrayXd fMaskA;
+    /// The bins that survive fMaskA and count towards the likelihood
+    BinRanges fLiveBins;
+
+    /// fData at its own POT, with the mask already applied
+    Eigen::ArrayXd fDataA;
+    /// Storage for the prediction, reused between calls to \ref ChiSq
+    mutable ThreadLocal<Eigen::ArrayXd> fPredA;
   };
 }
@@ -43,23 +43,23 @@ namespace ana
                   const SystShifts& shift = kNoShift,
                   const Weight& wei = kUnweighted);
 
-    virtual OscillatableSpectrum NueSurvComponent()       {return fNueSurv;}
-    virtual OscillatableSpectrum AntiNueSurvComponent()   {return fNueSurvAnti;}
+    virtual const OscillatableSpectrum& NueSurvComponent()       {return fNueSurv;}
+    virtual const OscillatableSpectrum& AntiNueSurvComponent()   {return fNueSurvAnti;}
 
-    virtual OscillatableSpectrum NumuSurvComponent()      {return fNumuSurv;}
-    virtual OscillatableSpectrum AntiNumuSurvComponent()  {return fNumuSurvAnti;}
+    virtual const OscillatableSpectrum& NumuSurvComponent()      {return fNumuSurv;}
+    virtual const OscillatableSpectrum& AntiNumuSurvComponent()  {return fNumuSurvAnti;}
 
-    virtual OscillatableSpectrum NueAppComponent()        {return fNueApp;}
-    virtual OscillatableSpectrum AntiNueAppComponent()    {return fNueAppAnti;}
+    virtual const OscillatableSpectrum& NueAppComponent()        {return fNueApp;}
+    virtual const OscillatableSpectrum& AntiNueAppComponent()    {return fNueAppAnti;}
 
-    virtual OscillatableSpectrum NumuAppComponent()       {return fNumuApp;}
-    virtual OscillatableSpectrum AntiNumuAppComponent()   {return fNumuAppAnti;}
+    virtual const OscillatableSpectrum& NumuAppComponent()       {return fNumuApp;}
+    virtual const OscillatableSpectrum& AntiNumuAppComponent()   {return fNumuAppAnti;}
 
-    virtual OscillatableSpectrum TauFromEComponent()      {return fTauFromE;}
-    virtual OscillatableSpectrum AntiTauFromEComponent()  {return fTauFromEAnti;}
+    virtual const OscillatableSpectrum& TauFromEComponent()      {return fTauFromE;}
+    virtual const OscillatableSpectrum& AntiTauFromEComponent()  {return fTauFromEAnti;}
 
-    virtual OscillatableSpectrum TauFromMuComponent()     {return fTauFromMu;}
-    virtual OscillatableSpectrum AntiTauFromMuComponent() {return fTauFromMuAnti;}
+    virtual const OscillatableSpectrum& TauFromMuComponent()     {return fTauFromMu;}
+    virtual const OscillatableSpectrum& AntiTauFromMuComponent() {return fTauFromMuAnti;}
 
     virtual Spectrum NCTotalComponent() override {return fNCTot;}
     virtual Spectrum NCComponent() {return fNC;}
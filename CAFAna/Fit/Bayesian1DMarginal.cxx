@@ -40,8 +40,12 @@ namespace ana
     else if (fMode == MarginalMode::kKNN)
     {
       fCachedHist = std::make_unique<TH1D>(UniqueName().c_str(), (";"+name).c_str(), bins.NBins(), &bins.Edges()[0]);
+      std::vector<std::vector<double>> points;
       for (int bin = 1; bin <= bins.NBins(); bin++)
-        fCachedHist->SetBinContent(bin, EstimateLLFromKNN({float(fCachedHist->GetBinCenter(bin))}));
+        points.push_back({fCachedHist->GetBinCenter(bin)});
+      const std::vector<double> LLs = EstimateLLsFromKNN(points);
+      for (int bin = 1; bin <= bins.NBins(); bin++)
+        fCachedHist->SetBinContent(bin, LLs[bin-1]);
     }
     return *fCachedHist;
   }
@@ -58,6 +62,16 @@ namespace ana
 
     double threshold = QuantileThreshold(quantile, hist.get());
 
+    // the kNN is evaluated at all the edges in one go
+    std::vector<double> edgeLLs;
+    if (!hist)
+    {
+      std::vector<std::vector<double>> points;
+      for (const auto & edge : bins.Edges())
+        points.push_back({edge});
+      edgeLLs = EstimateLLsFromKNN(points);
+    }
+
     // walk through the bins.
     // if we cross from above to below the threshold (or vice versa),
     // take that as a boundary of a range
@@ -80,7 +94,7 @@ namespace ana
       else
       {
         bnd = bins.Edges()[bin];
-        y = EstimateLLFromKNN({float(bnd)});
+        y = edgeLLs[bin];
       }
 
       // only do anything if we are changing from being above threshold to below
@@ -34,6 +34,9 @@ namespace ana
       TH1D ToTH1(const Binning & bins) const;
 
     private:
+      /// Seeds the histogram cache with what it filled
+      friend class BayesianMarginalBatch;
+
       mutable std::unique_ptr<Binning> fCachedBinning;
       mutable std::unique_ptr<TH1D>    fCachedHist;
   };
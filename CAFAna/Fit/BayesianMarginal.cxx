@@ -3,22 +3,17 @@
 #include "TH1D.h"
 #include "TH2D.h"
 #include "TH3D.h"
-#include "TFile.h"
 #include "TMap.h"
 #include "TObjString.h"
 #include "TParameter.h"
-#include "TSystem.h"
-#include "TMVA/Config.h"
-#include "TMVA/DataLoader.h"
-#include "TMVA/DataInputHandler.h"
-#include "TMVA/Factory.h"
-#include "TMVA/MethodKNN.h"
-#include "TMVA/Types.h"
+#include "TTree.h"
+#include "TMVA/ModulekNN.h"
 
 #include "CAFAna/Core/Binning.h"
 #include "CAFAna/Core/IFitVar.h"
 #include "CAFAna/Core/ISyst.h"
 #include "CAFAna/Core/Utilities.h"
+#include "CAFAna/Core/WorkerPool.h"
 #include "CAFAna/Fit/MCMCSamples.h"
 
 
@@ -26,7 +21,6 @@ namespace ana
 {
 
   // initialize the static members
-  const std::string BayesianMarginal::sKNNName = "bayes_marginal_knn";
   const std::vector<std::pair<Quantile, double>> BayesianMarginal::QuantileUpVals
   {
       {Quantile::kGaussian1Sigma,  0.6827},
@@ -86,39 +80,14 @@ namespace ana
 
     if (fMode == MarginalMode::kKNN)
     {
-      // load the data & train...
-      // Use TMVA to build an k-nearest-neightbor estimator for the LL surface
+      // k-nearest-neighbour estimator for the LL surface,
+      // built straight from the sample columns
       std::cout << "  Building a kNN from the MCMC points to estimate marginals..." << std::flush;
-      bool oldSilent = TMVA::gConfig().IsSilent();
-      TMVA::gConfig().SetSilent(true);
-      fdataLoader = std::make_unique<TMVA::DataLoader>(sKNNName.c_str());
-
-      // we'd rather not mess around with the original tree,
-      // but passing a tree to AddRegressionTree() implicitly
-      // gives the kNN builder permission to modify the tree
-      // because it needs to be able to SetBranchAddress() etc.
-      // unfortunately, there is no 'const' method for cloning a tree
-      // because the clone comes back 'connected' (with all the same
-      // branch addresses etc.) as the original.
-      // so, we use some const_cast<>s just long enough to make a copy
-      // and then disconnect it in the next line.
-      // (that's what the second line is doing, despite the confusing method name,
-      //  and the fact that it looks like it's called on the wrong object;
-      //  see https://root.cern/doc/master/classTTree.html#a67af1e2908bc275c03268f84f1f2b282)
-      // stuff into a unique_ptr<> so taht this copy disappears as soon as training is over.
-      auto trainTree = std::unique_ptr<TTree>(const_cast<TTree *>(samples.ToTTree())->CloneTree());
-      const_cast<TTree *>(samples.ToTTree())->CopyAddresses(trainTree.get(), true);
-      const_cast<TTree *>(samples.ToTTree())->GetListOfClones()->Remove(trainTree.get());
-
-      fdataLoader->AddRegressionTree(trainTree.get());
-      SetupKNN(fdataLoader.get());
-
-      fkNN->Train();
-      TMVA::gConfig().SetSilent(oldSilent);
+      fkNN = std::make_unique<KNNRegressor>(OrderedColumns(samples), samples.LLs());
       std::cout << "  ... done." << std::endl;
     }
 
-    // this is bit painful, but we want to only sort the LLs once in case there are many
+    // the multi-quantile QuantileLL() only sorts the LLs once (and leaves them sorted for later)
     std::vector<double> qVals;
     std::transform(QuantileUpVals.begin(), QuantileUpVals.end(),
                    std::back_inserter(qVals),
@@ -137,14 +106,20 @@ namespace ana
   {}
 
   //----------------------------------------------------------------------
-  double BayesianMarginal::EstimateLLFromKNN(const std::vector<float> &vals) const
+  double BayesianMarginal::EstimateLLFromKNN(const std::vector<double> &vals) const
   {
     assert(fMode == MarginalMode::kKNN);
+    assert(vals.size() == fkNN->NDims());
 
-    assert(vals.size() == fkNN->DataInfo().GetNVariables());
+    return fkNN->Estimate(vals);
+  }
 
-    TMVA::Event ev(vals, fkNN->DataInfo().GetNVariables());
-    return dynamic_cast<TMVA::MethodBase*>(fkNN.get())->GetRegressionValues(&ev)[0];
+  //----------------------------------------------------------------------
+  std::vector<double> BayesianMarginal::EstimateLLsFromKNN(const std::vector<std::vector<double>> &points) const
+  {
+    assert(fMode == MarginalMode::kKNN);
+
+    return fkNN->Estimate(points);
   }
 
   //----------------------------------------------------------------------
@@ -162,17 +137,34 @@ namespace ana
 
     if (marg->fMode == MarginalMode::kKNN)
     {
-      // again we're forced to make a temporary file (see SaveTo()).  c'est la vie...
-      marg->fdataLoader = std::make_unique<TMVA::DataLoader>(sKNNName.c_str());
-      marg->SetupKNN(marg->fdataLoader.get());
-      auto tree = dynamic_cast<TTree *>(dir->Get("kNN_weights"));
-      tree->SetDirectory(nullptr);
-      TFile tmpFile("tmp_surface.root", "recreate");
-      tmpFile.cd();
-      tree->Write("knn");
-      marg->fkNN->ReadWeightsFromStream(tmpFile);
-      tmpFile.Close();
-      gSystem->Unlink("tmp_surface.root");
+      if (dir->FindKey("kNN"))
+        marg->fkNN = KNNRegressor::LoadFrom(dir, "kNN");
+      else
+      {
+        // files from before the TMVA kNN was replaced store its training events instead.
+        // the estimator can be rebuilt from those
+        std::unique_ptr<TTree> tree(dynamic_cast<TTree *>(dir->Get("kNN_weights")));
+        assert(tree && "kNN mode BayesianMarginal has no saved kNN");
+        TMVA::kNN::Event * event = nullptr;
+        tree->SetBranchAddress("event", &event);
+
+        std::vector<std::vector<double>> cols(marg->fVars.size() + marg->fSysts.size());
+        std::vector<double> LLs;
+        for (Long64_t entry = 0; entry < tree->GetEntries(); entry++)
+        {
+          tree->GetEntry(entry);
+          for (std::size_t dim = 0; dim < cols.size(); dim++)
+            cols[dim].push_back(event->GetVar(dim));
+          LLs.push_back(event->GetTgt(0));
+        }
+        tree->ResetBranchAddresses();
+        delete event;
+
+        std::vector<const std::vector<double>*> colPtrs;
+        for (const auto & col : cols)
+          colPtrs.push_back(&col);
+        marg->fkNN = std::make_unique<KNNRegressor>(colPtrs, LLs);
+      }
     }
 
     auto quantMap = dynamic_cast<TMap*>(dir->Get("quantileSamples"));
@@ -215,12 +207,10 @@ namespace ana
     assert(quantile >= 0 && quantile <= 1 && "QuantileSurface(): quantile must be between 0 and 1");
 
 
-    auto quantilePair = samples.QuantileLL(quantile);
-
     if (fMode == MarginalMode::kHistogram)
       return ThresholdFromTH1(pdf, quantile);
 
-    return quantilePair.second;
+    return samples.QuantileLL(quantile).second;
   }
 
   //----------------------------------------------------------------------
@@ -234,17 +224,8 @@ namespace ana
 
     if (fMode == MarginalMode::kKNN)
     {
-      // the fact that the tree gets saved into the file with name 'knn' is an unadvertised implementation detail...
-      // but do they need to save it as its own TFile so badly?
-      // we want to save it into our own file to keep the bits from getting too spread out.
-      TFile tmpFile("tmp_surface.root", "recreate");
-      fkNN->WriteWeightsToStream(tmpFile);
-      auto tree = dynamic_cast<TTree *>(tmpFile.Get("knn"));
-      tree->SetDirectory(nullptr);
+      fkNN->SaveTo(dir, "kNN");
       dir->cd();
-      tree->Write("kNN_weights");
-      tmpFile.Close();
-      gSystem->Unlink("tmp_surface.root");
     }
 
     TMap quantMap;
@@ -267,36 +248,29 @@ namespace ana
   }
 
   //----------------------------------------------------------------------
-  void BayesianMarginal::SetupKNN(TMVA::DataLoader * loader)
+  std::vector<const std::vector<double>*> BayesianMarginal::OrderedColumns(const MCMCSamples & samples) const
   {
-    int entries = 0;
-    if (loader)
-    {
-      entries = loader->DataInput().GetEntries();
-      auto opt = Form("KNN,nkNN=%d", entries > 20 ? 20 : entries-1);  // 20 neighbors is kNN default
-      fkNN = std::make_unique<TMVA::MethodKNN>(loader->GetDataSetInfo(), opt);
-    }
-    else
+    return Columns(samples, fOrderedBrNames);
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<const std::vector<double>*> BayesianMarginal::Columns(const MCMCSamples & samples,
+                                                                    const std::vector<std::string> & brNames)
+  {
+    // look up the columns once, rather than doing lookups inside loops over samples,
+    // which could run into the millions of iterations
+    std::vector<const std::vector<double>*> cols;
+    for (const auto & brName : brNames)
     {
-      TMVA::DataSetInfo info(sKNNName.c_str());
-      fkNN = std::make_unique<TMVA::MethodKNN>(info, "KNN");
+      if (auto var = Registry<IFitVar>::ShortNameToPtr(brName, true))
+        cols.push_back(&samples.Values(var));
+      else if (auto syst = Registry<ISyst>::ShortNameToPtr(brName, true))
+        cols.push_back(&samples.Values(syst));
     }
-
-    auto & dsInfo = fkNN->DataInfo();
-    for (const auto & var : fVars)
-      dsInfo.AddVariable(var->ShortName());
-    for (const auto & syst : fSysts)
-      dsInfo.AddVariable(syst->ShortName());
-    dsInfo.AddTarget(MCMCSamples::LOGLIKELIHOOD_BRANCH_NAME, "", "", 0, 0);
-    if (loader)
-      dsInfo.SetSplitOptions(Form("nTrain_Regression=%d,nTest_Regression=0", entries));
-
-    fkNN->SetAnalysisType( TMVA::Types::kRegression );
-    fkNN->SetupMethod();
-    fkNN->ParseOptions();
-    fkNN->ProcessSetup();
+    return cols;
   }
 
+  //----------------------------------------------------------------------
   double BayesianMarginal::ThresholdFromTH1(const TH1* pdf, double quantile)
   {
     if (pdf->Integral() <= 0)
@@ -381,6 +355,18 @@ namespace ana
 
   //----------------------------------------------------------------------
   std::unique_ptr<TH1> BayesianMarginal::ToHistogram(const std::vector<Binning> & bins) const
+  {
+    assert(fMCMCSamples);
+    assert(bins.size() == fOrderedBrNames.size());
+
+    return std::move(ToHistograms(*fMCMCSamples, {fOrderedBrNames}, {bins}, fMode)[0]);
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<std::unique_ptr<TH1>> BayesianMarginal::ToHistograms(const MCMCSamples & samples,
+                                                                   const std::vector<std::vector<std::string>> & brNames,
+                                                                   const std::vector<std::vector<Binning>> & bins,
+                                                                   MarginalMode mode)
   {
     // idea:
     //  * for mode==kHistogram:
@@ -389,107 +375,135 @@ namespace ana
     //    find the bin-averaged probability distribution
     //    by making the histogram weighted by exp(LL)
     //    and dividing it by the simple histogram of the events
-    assert(fMCMCSamples);
-    assert(bins.size() == fOrderedBrNames.size());
-    assert(bins.size() > 0 && bins.size() < 3);  // could port NOvA CAFAna 3D hist stuff if needed
-
-    auto axisNameStr = std::accumulate(fOrderedBrNames.begin(), fOrderedBrNames.end(),
-                                       std::string(""),
-                                       [this](std::string s, const std::string & b)
-                                       {
-
-                                         std::string name;
-                                         if (auto var = Registry<IFitVar>::ShortNameToPtr(fOrderedBrNames[0], true))
-                                             name = var->LatexName();
-                                         else if (auto syst = Registry<ISyst>::ShortNameToPtr(fOrderedBrNames[0], true))
-                                             name = syst->LatexName();
-                                         return s + ";" + name;
-                                       });
-    std::unique_ptr<TH1> ret;
-    if (bins.size() == 1)
-      ret.reset(MakeTH1D(UniqueName().c_str(), axisNameStr.c_str(), bins[0]));
-    else if (bins.size() == 2)
-      ret.reset(MakeTH2D(UniqueName().c_str(), axisNameStr.c_str(), bins[0], bins[1]));
-    // we haven't implemented MakeTH3D here.  but won't worry about it for now
-    //else if (bins.size() == 3)
-    //  ret.reset(MakeTH3D(UniqueName().c_str(), axisNameStr.c_str(), bins[0], bins[1], bins[2]));
-
-    std::unique_ptr<TH1> denom;
-    if (bins.size() == 1)
-      denom = std::make_unique<TH1D>(*dynamic_cast<TH1D*>(ret.get()));
-    else if (bins.size() == 2)
-      denom = std::make_unique<TH2D>(*dynamic_cast<TH2D*>(ret.get()));
-    //else if (bins.size() == 3)
-    //  denom = std::make_unique<TH3D>(*dynamic_cast<TH3D*>(ret.get()));
-    denom->SetName(UniqueName().c_str());
-
-    // this could certainly be done less sloppily
-    // but I wanted to ensure we don't do lots of expensive lookups in std::maps
-    // inside the loop over samples, which could run into the millions of iterations
-    union VarOrSyst
+    assert(mode == MarginalMode::kHistogram || mode == MarginalMode::kLLWgtdHistogram);
+    assert(samples.NumStreamed() == 0 && "Streamed-out samples must be read back with MCMCSamples::LoadFrom() before marginalizing");
+    assert(brNames.size() == bins.size());
+
+    // each histogram is filled as a flat array of cells,
+    // numbered like the global bins of the TH1 (so including the under- and overflow)
+    std::vector<std::vector<const std::vector<double>*>> cols;
+    std::vector<std::vector<const std::vector<double>*>> edges;
+    std::vector<std::size_t> nCells;
+    for (std::size_t histIdx = 0; histIdx < bins.size(); histIdx++)
     {
-      const IFitVar * var;
-      const ISyst * syst;
-    };
-    std::vector<bool> isVar(fVars.size() + fSysts.size(), true);
-    std::vector<VarOrSyst> varsOrSysts(fVars.size() + fSysts.size());
-    for (std::size_t brIdx = 0; brIdx < fOrderedBrNames.size(); brIdx++)
-    {
-      const auto & brName = fOrderedBrNames[brIdx];
-      if (auto var = Registry<IFitVar>::ShortNameToPtr(brName, true))
-        varsOrSysts[brIdx].var = var;
-      else if (auto syst = Registry<ISyst>::ShortNameToPtr(brName, true))
+      assert(brNames[histIdx].size() == bins[histIdx].size());
+      assert(bins[histIdx].size() > 0 && bins[histIdx].size() < 3);  // could port NOvA CAFAna 3D hist stuff if needed
+
+      cols.push_back(Columns(samples, brNames[histIdx]));
+      assert(cols.back().size() == brNames[histIdx].size() && "Requested variable or syst not in MCMCSamples");
+      edges.emplace_back();
+      nCells.push_back(1);
+      for (const auto & axisBins : bins[histIdx])
       {
-        isVar[brIdx] = false;
-        varsOrSysts[brIdx].syst = syst;
+        edges.back().push_back(&axisBins.Edges());
+        nCells.back() *= axisBins.NBins() + 2;
       }
     }
-    for (std::size_t sample = 0; sample < fMCMCSamples->NumSamples(); ++sample)
+
+    // cell number along one axis, with 0 and NBins()+1 for under- and overflow like TAxis::FindBin()
+    auto AxisCell = [](const std::vector<double> & axisEdges, double x) -> std::size_t
     {
-      double logprob = fMCMCSamples->SampleLL(sample);
-      if (std::isnan(logprob))
-        std::cerr << "Warning: Encountered NaN log-probability in an MCMC sample.  Other things will probably go wrong..." << std::endl;
-
-      std::map<const IFitVar*, double> varVals;
-      std::map<const ISyst*, double> systVals;
-      fMCMCSamples->SampleValues(sample, fVars, varVals, fSysts, systVals);
-      std::vector<double> vals;
-      for (std::size_t brIdx = 0; brIdx < varsOrSysts.size(); ++brIdx)
-        vals.push_back(
-            isVar[brIdx] ? fMCMCSamples->SampleValue(varsOrSysts[brIdx].var, sample)
-                         : fMCMCSamples->SampleValue(varsOrSysts[brIdx].syst, sample));
-
-      // could template this, but probably not worth the effort?
-      double numWgt = (fMode == MarginalMode::kHistogram) ? 1.0 : logprob;
-      if (bins.size() == 1)
-        ret->Fill(vals[0], numWgt);
-      else if (bins.size() == 2)
+      return std::upper_bound(axisEdges.begin(), axisEdges.end(), x) - axisEdges.begin();
+    };
+
+    const auto & LLs = samples.LLs();
+    const std::size_t nSamples = LLs.size();
+    const bool wgtd = (mode == MarginalMode::kLLWgtdHistogram);
+
+    // one set of buffers per block, so the threads never contend.
+    // the samples are only read once however many histograms there are
+    WorkerPool pool;
+    const unsigned int nBlocks = std::max(1u, std::min(pool.NThreads(), unsigned(nSamples)));
+    std::vector<std::vector<std::vector<double>>> nums(nBlocks);
+    std::vector<std::vector<std::vector<double>>> denoms(nBlocks);
+    std::vector<std::size_t> nNaNs(nBlocks, 0);
+    pool.ParallelFor(nBlocks, [&](unsigned int block)
+    {
+      auto & num = nums[block];
+      auto & denom = denoms[block];
+      for (const auto & n : nCells)
       {
-        dynamic_cast<TH2*>(ret.get())->Fill(vals[0], vals[1], numWgt);
-        dynamic_cast<TH2*>(denom.get())->Fill(vals[0], vals[1]);
+        num.emplace_back(n, 0.);
+        // (only needed for the average LL in the weighted mode)
+        if (wgtd)
+          denom.emplace_back(n, 0.);
       }
-      else if (bins.size() == 3)
+
+      for (std::size_t sample = block * nSamples / nBlocks; sample < (block + 1) * nSamples / nBlocks; ++sample)
       {
-        dynamic_cast<TH3*>(ret.get())->Fill(vals[0], vals[1], vals[2], numWgt);
-        dynamic_cast<TH3*>(denom.get())->Fill(vals[0], vals[1], vals[2]);
+        double logprob = LLs[sample];
+        if (std::isnan(logprob))
+          nNaNs[block]++;
+
+        double numWgt = wgtd ? logprob : 1.0;
+        for (std::size_t histIdx = 0; histIdx < cols.size(); histIdx++)
+        {
+          std::size_t cell = AxisCell(*edges[histIdx][0], (*cols[histIdx][0])[sample]);
+          if (cols[histIdx].size() == 2)
+            cell += (edges[histIdx][0]->size() + 1) * AxisCell(*edges[histIdx][1], (*cols[histIdx][1])[sample]);
+
+          num[histIdx][cell] += numWgt;
+          if (wgtd)
+            denom[histIdx][cell] += 1;
+        }
       }
-    }
+    });
+
+    if (std::accumulate(nNaNs.begin(), nNaNs.end(), std::size_t(0)) > 0)
+      std::cerr << "Warning: Encountered NaN log-probability in an MCMC sample.  Other things will probably go wrong..." << std::endl;
 
-    // now exponentiate the log-probs to get probabilities
-    if (fMode == MarginalMode::kLLWgtdHistogram)
+    // merge the other blocks' buffers into the first
+    for (unsigned int block = 1; block < nBlocks; block++)
     {
-      ret->Divide(denom.get());
-      for (int binIdx = 0; binIdx < ret->GetNcells(); binIdx++)
+      for (std::size_t histIdx = 0; histIdx < cols.size(); histIdx++)
       {
-        // if it's *exactly* 0, this is a region where there were no samples altogether.  just leave empty
-        if (ret->GetBinContent(binIdx) != 0.0)
-          ret->SetBinContent(binIdx, exp(ret->GetBinContent(binIdx)));
+        for (std::size_t cell = 0; cell < nCells[histIdx]; cell++)
+        {
+          nums[0][histIdx][cell] += nums[block][histIdx][cell];
+          if (wgtd)
+            denoms[0][histIdx][cell] += denoms[block][histIdx][cell];
+        }
       }
     }
-    else if (fMode == MarginalMode::kHistogram)
+
+    std::vector<std::unique_ptr<TH1>> ret;
+    for (std::size_t histIdx = 0; histIdx < cols.size(); histIdx++)
     {
-      if (ret->Integral() > 0)
-        ret->Scale(1. / ret->Integral());
+      auto axisNameStr = std::accumulate(brNames[histIdx].begin(), brNames[histIdx].end(),
+                                         std::string(""),
+                                         [](std::string s, const std::string & b)
+                                         {
+                                           std::string name;
+                                           if (auto var = Registry<IFitVar>::ShortNameToPtr(b, true))
+                                             name = var->LatexName();
+                                           else if (auto syst = Registry<ISyst>::ShortNameToPtr(b, true))
+                                             name = syst->LatexName();
+                                           return s + ";" + name;
+                                         });
+
+      std::unique_ptr<TH1> hist;
+      if (bins[histIdx].size() == 1)
+        hist.reset(MakeTH1D(UniqueName().c_str(), axisNameStr.c_str(), bins[histIdx][0]));
+      else if (bins[histIdx].size() == 2)
+        hist.reset(MakeTH2D(UniqueName().c_str(), axisNameStr.c_str(), bins[histIdx][0], bins[histIdx][1]));
+      // we haven't implemented MakeTH3D here.  but won't worry about it for now
+
+      const auto & num = nums[0][histIdx];
+      for (std::size_t cell = 0; cell < nCells[histIdx]; cell++)
+      {
+        if (!wgtd)
+          hist->SetBinContent(cell, num[cell]);
+        // now exponentiate the average log-probs to get probabilities.
+        // if there were no samples in a cell, it's a region where there were no samples altogether.  just leave empty
+        else if (denoms[0][histIdx][cell] > 0 && num[cell] != 0.0)
+          hist->SetBinContent(cell, exp(num[cell] / denoms[0][histIdx][cell]));
+      }
+      hist->SetEntries(nSamples);
+
+      if (mode == MarginalMode::kHistogram && hist->Integral() > 0)
+        hist->Scale(1. / hist->Integral());
+
+      ret.push_back(std::move(hist));
     }
 
     return ret;
@@ -1,11 +1,10 @@
 #pragma once
 
 #include <map>
-
-#include "TMVA/MethodKNN.h"
-#include "TMVA/DataLoader.h"
+#include <memory>
 
 #include "CAFAna/Core/Binning.h"
+#include "CAFAna/Fit/KNNRegressor.h"
 #include "CAFAna/Fit/MCMCSample.h"
 
 class TDirectory;
@@ -77,10 +76,26 @@ namespace ana
       std::vector<const ISyst*>   Systs() const { return fSysts; }
       std::vector<const IFitVar*> Vars()  const { return fVars; }
 
+      /// \brief Histogram the samples onto several sets of axes in one parallel pass over them.
+      ///
+      /// Each thread fills its own buffers from a share of the samples, and these are summed at the end.
+      /// \param brNames  For each histogram, the variables/systs on its axes (one or two of them)
+      /// \param bins     For each histogram, the binning of each of its axes
+      /// \param mode     MarginalMode::kHistogram or MarginalMode::kLLWgtdHistogram
+      /// \return         The histograms, normalized the way ToHistogram() would, in the order requested
+      static std::vector<std::unique_ptr<TH1>> ToHistograms(const MCMCSamples & samples,
+                                                            const std::vector<std::vector<std::string>> & brNames,
+                                                            const std::vector<std::vector<Binning>> & bins,
+                                                            MarginalMode mode);
+
     protected:
       BayesianMarginal();
 
-      double EstimateLLFromKNN(const std::vector<float> &vals) const;
+      /// LL at the point \a vals (ordered like the axes) estimated by the kNN
+      double EstimateLLFromKNN(const std::vector<double> &vals) const;
+
+      /// Like EstimateLLFromKNN(), but for many points at once (which are done in parallel)
+      std::vector<double> EstimateLLsFromKNN(const std::vector<std::vector<double>> &points) const;
 
       /// Determine the threshold for the 'histogram' mode from the given histogram with a brute force method
       static double ThresholdFromTH1(const TH1* pdf, double quantile);
@@ -93,6 +108,13 @@ namespace ana
 
       std::unique_ptr<TH1> ToHistogram(const std::vector<Binning> & bins) const;
 
+      /// The columns of \a samples for each entry in fOrderedBrNames
+      std::vector<const std::vector<double>*> OrderedColumns(const MCMCSamples & samples) const;
+
+      /// The columns of \a samples for each of the variables/systs \a brNames
+      static std::vector<const std::vector<double>*> Columns(const MCMCSamples & samples,
+                                                             const std::vector<std::string> & brNames);
+
       /// What mode are we using?
       MarginalMode fMode;
 
@@ -103,24 +125,16 @@ namespace ana
       std::vector<std::string> fOrderedBrNames;
 
     private:
-      void SetupKNN(TMVA::DataLoader * loader = nullptr);
-
       /// The samples that are the boundaries for various commonly-used quantiles
       std::map<Quantile, MCMCSample>  fQuantileSampleMap;
 
       /// the kNN used for approximating the surface from the points when in kNN mode
-      mutable std::unique_ptr<TMVA::MethodKNN> fkNN;
-      /// Needed for kNN
-      mutable std::unique_ptr<TMVA::DataLoader> fdataLoader;
+      std::unique_ptr<KNNRegressor> fkNN;
 
       /// Variables we want to marginalize to (see also fSysts)
       std::vector<const IFitVar*> fVars;
       /// Systs we want to marginalize to (see also fVars)
       std::vector<const ISyst*> fSysts;
-
-
-      static const std::string sKNNName;
-
   };
 
 }
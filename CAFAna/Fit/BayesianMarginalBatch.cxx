@@ -0,0 +1,122 @@
+#include "CAFAna/Fit/BayesianMarginalBatch.h"
+
+#include "CAFAna/Core/IFitVar.h"
+#include "CAFAna/Core/ISyst.h"
+#include "CAFAna/Fit/MCMCSamples.h"
+
+#include "TH1D.h"
+
+#include <cassert>
+#include <iostream>
+
+namespace ana
+{
+  //----------------------------------------------------------------------
+  BayesianMarginalBatch::BayesianMarginalBatch(const MCMCSamples & samples,
+                                               BayesianMarginal::MarginalMode mode)
+    : fSamples(&samples), fMode(mode)
+  {}
+
+  //----------------------------------------------------------------------
+  std::size_t BayesianMarginalBatch::Add(const IFitVarOrISyst & var, const Binning & bins)
+  {
+    assert(fMarginals1D.empty() && fSurfaces.empty() && "BayesianMarginalBatch: can't Add() after Fill()");
+
+    f1DReqs.push_back({var, bins});
+    return f1DReqs.size() - 1;
+  }
+
+  //----------------------------------------------------------------------
+  std::size_t BayesianMarginalBatch::Add(const IFitVarOrISyst & x, int nbinsx, double xmin, double xmax,
+                                         const IFitVarOrISyst & y, int nbinsy, double ymin, double ymax)
+  {
+    assert(fMarginals1D.empty() && fSurfaces.empty() && "BayesianMarginalBatch: can't Add() after Fill()");
+
+    f2DReqs.push_back({x, nbinsx, xmin, xmax, y, nbinsy, ymin, ymax});
+    return f2DReqs.size() - 1;
+  }
+
+  //----------------------------------------------------------------------
+  void BayesianMarginalBatch::Fill()
+  {
+    if (!fMarginals1D.empty() || !fSurfaces.empty())
+      return;
+
+    // everything in one pass over the samples: the 1D ones first, then the surfaces
+    std::vector<std::unique_ptr<TH1>> hists;
+    if (fMode == BayesianMarginal::MarginalMode::kHistogram || fMode == BayesianMarginal::MarginalMode::kLLWgtdHistogram)
+    {
+      std::vector<std::vector<std::string>> brNames;
+      std::vector<std::vector<Binning>> bins;
+      for (const auto & req : f1DReqs)
+      {
+        brNames.push_back({BrName(req.var)});
+        bins.push_back({req.bins});
+      }
+      for (const auto & req : f2DReqs)
+      {
+        brNames.push_back({BrName(req.x), BrName(req.y)});
+        bins.push_back({Binning::Simple(req.nbinsx, req.xmin, req.xmax),
+                        Binning::Simple(req.nbinsy, req.ymin, req.ymax)});
+      }
+
+      hists = BayesianMarginal::ToHistograms(*fSamples, brNames, bins, fMode);
+    }
+
+    for (std::size_t reqIdx = 0; reqIdx < f1DReqs.size(); reqIdx++)
+    {
+      const auto & req = f1DReqs[reqIdx];
+      if (req.var.ifitvar)
+        fMarginals1D.push_back(std::make_unique<Bayesian1DMarginal>(*fSamples, req.var.ifitvar, fMode));
+      else
+        fMarginals1D.push_back(std::make_unique<Bayesian1DMarginal>(*fSamples, req.var.isyst, fMode));
+
+      if (hists.empty())
+        continue;
+
+      // so that ToTH1() with the requested binning doesn't need to go back to the samples
+      Bayesian1DMarginal & marg = *fMarginals1D.back();
+      marg.fCachedBinning = std::make_unique<Binning>(req.bins);
+      marg.fCachedHist.reset(dynamic_cast<TH1D*>(hists[reqIdx].release()));
+    }
+
+    for (std::size_t reqIdx = 0; reqIdx < f2DReqs.size(); reqIdx++)
+    {
+      const auto & req = f2DReqs[reqIdx];
+      const TH1 * hist = hists.empty() ? nullptr : hists[f1DReqs.size() + reqIdx].get();
+      // can't use make_unique<> because the constructor is private
+      fSurfaces.emplace_back(new BayesianSurface(*fSamples,
+                                                 req.x, req.nbinsx, req.xmin, req.xmax,
+                                                 req.y, req.nbinsy, req.ymin, req.ymax,
+                                                 fMode, hist));
+    }
+  }
+
+  //----------------------------------------------------------------------
+  const Bayesian1DMarginal & BayesianMarginalBatch::Marginal1D(std::size_t idx) const
+  {
+    if (fMarginals1D.empty() && !f1DReqs.empty())
+    {
+      std::cerr << "BayesianMarginalBatch: call Fill() before retrieving the marginals" << std::endl;
+      abort();
+    }
+    return *fMarginals1D.at(idx);
+  }
+
+  //----------------------------------------------------------------------
+  const BayesianSurface & BayesianMarginalBatch::Surface(std::size_t idx) const
+  {
+    if (fSurfaces.empty() && !f2DReqs.empty())
+    {
+      std::cerr << "BayesianMarginalBatch: call Fill() before retrieving the surfaces" << std::endl;
+      abort();
+    }
+    return *fSurfaces.at(idx);
+  }
+
+  //----------------------------------------------------------------------
+  std::string BayesianMarginalBatch::BrName(const IFitVarOrISyst & var)
+  {
+    return var.ifitvar ? var.ifitvar->ShortName() : var.isyst->ShortName();
+  }
+}
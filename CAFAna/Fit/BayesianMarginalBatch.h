@@ -0,0 +1,84 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "CAFAna/Core/Binning.h"
+#include "CAFAna/Fit/Bayesian1DMarginal.h"
+#include "CAFAna/Fit/BayesianMarginal.h"
+#include "CAFAna/Fit/BayesianSurface.h"
+
+namespace ana
+{
+  class MCMCSamples;
+
+  /// \brief Make many Bayesian1DMarginals and BayesianSurfaces from one pass over the samples
+  ///
+  /// Constructing each marginal by itself means one pass over all the MCMC samples apiece,
+  /// which for a full set of post-fit plots adds up.  Instead, list them all here
+  /// with Add() and then call Fill(), which histograms all of them together
+  /// (see BayesianMarginal::ToHistograms()).
+  ///
+  /// \code
+  ///   BayesianMarginalBatch batch(samples);
+  ///   std::size_t th13Idx = batch.Add(&kFitSinSq2Theta13, Binning::Simple(50, 0.06, 0.11));
+  ///   std::size_t surfIdx = batch.Add(&kFitSinSqTheta23, 50, 0.3, 0.7, &kFitDeltaInPiUnits, 50, 0, 2);
+  ///   batch.Fill();
+  ///   TH1D th13 = batch.Marginal1D(th13Idx).ToTH1(Binning::Simple(50, 0.06, 0.11));
+  /// \endcode
+  class BayesianMarginalBatch
+  {
+    public:
+      BayesianMarginalBatch(const MCMCSamples & samples,
+                            BayesianMarginal::MarginalMode mode = BayesianMarginal::MarginalMode::kHistogram);
+
+      /// Request a 1D marginal in \a var.  Returns its index for Marginal1D()
+      std::size_t Add(const IFitVarOrISyst & var, const Binning & bins);
+
+      /// Request a surface in \a x and \a y.  Returns its index for Surface()
+      std::size_t Add(const IFitVarOrISyst & x, int nbinsx, double xmin, double xmax,
+                      const IFitVarOrISyst & y, int nbinsy, double ymin, double ymax);
+
+      /// Build all the requested marginals.
+      /// (In MarginalMode::kKNN there's nothing to histogram, and they're just built one by one.)
+      void Fill();
+
+      std::size_t NMarginals1D() const { return f1DReqs.size(); }
+      std::size_t NSurfaces() const { return f2DReqs.size(); }
+
+      /// The 1D marginal from Add() call number \a idx.  Its ToTH1() with the binning given to Add() is ready-made
+      const Bayesian1DMarginal & Marginal1D(std::size_t idx) const;
+
+      /// The surface from Add() call number \a idx
+      const BayesianSurface & Surface(std::size_t idx) const;
+
+    private:
+      struct Request1D
+      {
+        IFitVarOrISyst var;
+        Binning bins;
+      };
+
+      struct Request2D
+      {
+        IFitVarOrISyst x;
+        int nbinsx;
+        double xmin, xmax;
+        IFitVarOrISyst y;
+        int nbinsy;
+        double ymin, ymax;
+      };
+
+      /// Branch name of a var or syst in the samples
+      static std::string BrName(const IFitVarOrISyst & var);
+
+      const MCMCSamples * fSamples;
+      BayesianMarginal::MarginalMode fMode;
+
+      std::vector<Request1D> f1DReqs;
+      std::vector<Request2D> f2DReqs;
+
+      std::vector<std::unique_ptr<Bayesian1DMarginal>> fMarginals1D;
+      std::vector<std::unique_ptr<BayesianSurface>> fSurfaces;
+  };
+}
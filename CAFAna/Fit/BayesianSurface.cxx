@@ -48,11 +48,29 @@ namespace ana
     BuildHist(samples, xsyst, nbinsx, xmin, xmax, ysyst, nbinsy, ymin, ymax);
   }
 
+  //----------------------------------------------------------------------
+  BayesianSurface::BayesianSurface(const MCMCSamples &samples,
+                                   const IFitVarOrISyst & x, int nbinsx, double xmin, double xmax,
+                                   const IFitVarOrISyst & y, int nbinsy, double ymin, double ymax,
+                                   MarginalMode mode, const TH1 * hist)
+      : BayesianMarginal(samples, {x, y}, mode)
+  {
+    if (x.ifitvar && y.ifitvar)
+      BuildHist(samples, x.ifitvar, nbinsx, xmin, xmax, y.ifitvar, nbinsy, ymin, ymax, hist);
+    else if (x.ifitvar)
+      BuildHist(samples, x.ifitvar, nbinsx, xmin, xmax, y.isyst, nbinsy, ymin, ymax, hist);
+    else if (y.ifitvar)
+      BuildHist(samples, x.isyst, nbinsx, xmin, xmax, y.ifitvar, nbinsy, ymin, ymax, hist);
+    else
+      BuildHist(samples, x.isyst, nbinsx, xmin, xmax, y.isyst, nbinsy, ymin, ymax, hist);
+  }
+
   //----------------------------------------------------------------------
   template <typename SystOrVar1, typename SystOrVar2>
   void BayesianSurface::BuildHist(const MCMCSamples &samples,
                                   const SystOrVar1 *x, int nbinsx, double xmin, double xmax,
-                                  const SystOrVar2 *y, int nbinsy, double ymin, double ymax)
+                                  const SystOrVar2 *y, int nbinsy, double ymin, double ymax,
+                                  const TH1 * hist)
   {
     static_assert( (   (std::is_same<SystOrVar1, IFitVar>::value || std::is_same<SystOrVar1, ISyst>::value)
                     && (std::is_same<SystOrVar2, IFitVar>::value || std::is_same<SystOrVar2, ISyst>::value)),
@@ -68,22 +86,36 @@ namespace ana
                               nbinsy, ymin, ymax);
 
     std::unique_ptr<TH1> tmpHist;
-    if (fMode == MarginalMode::kHistogram || fMode == MarginalMode::kLLWgtdHistogram)
+    if ((fMode == MarginalMode::kHistogram || fMode == MarginalMode::kLLWgtdHistogram) && !hist)
+    {
       tmpHist = ToHistogram({Binning::Simple(nbinsx, xmin, xmax),
                              Binning::Simple(nbinsy, ymin, ymax)});
+      hist = tmpHist.get();
+    }
+
+    // in kNN mode, evaluate all the bin centres in one (parallel) batch
+    std::vector<double> knnVals;
+    if (fMode == MarginalMode::kKNN)
+    {
+      std::vector<std::vector<double>> points;
+      for (int xBin = 0; xBin < fHist->GetNbinsX() + 2; xBin++)
+      {
+        for (int yBin = 0; yBin < fHist->GetNbinsY() + 2; yBin++)
+          points.push_back({fHist->GetXaxis()->GetBinCenter(xBin), fHist->GetYaxis()->GetBinCenter(yBin)});
+      }
+      knnVals = EstimateLLsFromKNN(points);
+    }
+
+    std::size_t pointIdx = 0;
     for (int xBin = 0; xBin < fHist->GetNbinsX() + 2; xBin++)
     {
       for (int yBin = 0; yBin < fHist->GetNbinsY() + 2; yBin++)
       {
         double val = std::numeric_limits<double>::signaling_NaN();
-        if ((fMode == MarginalMode::kHistogram || fMode == MarginalMode::kLLWgtdHistogram) && tmpHist)
-          val = tmpHist->GetBinContent(xBin, yBin);
+        if ((fMode == MarginalMode::kHistogram || fMode == MarginalMode::kLLWgtdHistogram) && hist)
+          val = hist->GetBinContent(xBin, yBin);
         else if (fMode == MarginalMode::kKNN)
-        {
-          float xBinCtr = fHist->GetXaxis()->GetBinCenter(xBin);
-          float yBinCtr = fHist->GetYaxis()->GetBinCenter(yBin);
-          val = EstimateLLFromKNN({xBinCtr, yBinCtr});
-        }
+          val = knnVals[pointIdx++];
         fHist->SetBinContent(xBin, yBin, val);
       }
     }
@@ -91,16 +123,20 @@ namespace ana
   // explicitly instantiate the ones we need
   template void BayesianSurface::BuildHist(const MCMCSamples & samples,
                                            const IFitVar * x, int nbinsx, double xmin, double xmax,
-                                           const IFitVar * y, int nbinsy, double ymin, double ymax);
+                                           const IFitVar * y, int nbinsy, double ymin, double ymax,
+                                           const TH1 * hist);
   template void BayesianSurface::BuildHist(const MCMCSamples & samples,
                                            const IFitVar * x, int nbinsx, double xmin, double xmax,
-                                           const ISyst * y, int nbinsy, double ymin, double ymax);
+                                           const ISyst * y, int nbinsy, double ymin, double ymax,
+                                           const TH1 * hist);
   template void BayesianSurface::BuildHist(const MCMCSamples & samples,
                                            const ISyst * x, int nbinsx, double xmin, double xmax,
-                                           const IFitVar * y, int nbinsy, double ymin, double ymax);
+                                           const IFitVar * y, int nbinsy, double ymin, double ymax,
+                                           const TH1 * hist);
   template void BayesianSurface::BuildHist(const MCMCSamples & samples,
                                            const ISyst * x, int nbinsx, double xmin, double xmax,
-                                           const ISyst * y, int nbinsy, double ymin, double ymax);
+                                           const ISyst * y, int nbinsy, double ymin, double ymax,
+                                           const TH1 * hist);
 
   //----------------------------------------------------------------------
   std::unique_ptr<BayesianSurface> BayesianSurface::LoadFrom(TDirectory *dir, const std::string& name)
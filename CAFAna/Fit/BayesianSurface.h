@@ -77,13 +77,22 @@ namespace ana
       static std::unique_ptr<BayesianSurface> LoadFrom(TDirectory * dir, const std::string& name);
 
     private:
+      friend class BayesianMarginalBatch;
+
       BayesianSurface() = default;
 
-      /// Build the TH2 from the kNN
+      /// For BayesianMarginalBatch, which has already filled the marginal histogram \a hist
+      BayesianSurface(const MCMCSamples &samples, const IFitVarOrISyst & x, int nbinsx, double xmin, double xmax,
+                      const IFitVarOrISyst & y, int nbinsy, double ymin, double ymax,
+                      MarginalMode mode, const TH1 * hist);
+
+      /// Build the TH2 from the kNN, or from the histogrammed samples.
+      /// (Those are taken from \a hist if it's supplied.)
       template <typename SystOrVar1, typename SystOrVar2>
       void BuildHist(const MCMCSamples &samples,
                      const SystOrVar1 *x, int nbinsx, double xmin, double xmax,
-                     const SystOrVar2 *y, int nbinsy, double ymin, double ymax);
+                     const SystOrVar2 *y, int nbinsy, double ymin, double ymax,
+                     const TH1 * hist = nullptr);
 
   };
 
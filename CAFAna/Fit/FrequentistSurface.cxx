@@ -1,5 +1,8 @@
+#include <algorithm>
 #include <iostream>
 #include <functional>
+#include <mutex>
+#include <set>
 
 #include "TCanvas.h"
 #include "TGraph.h"
@@ -17,11 +20,13 @@
 #include "CAFAna/Experiment/IExperiment.h"
 #include "CAFAna/Fit/FrequentistSurface.h"
 #include "CAFAna/Fit/MinuitFitter.h"
+#include "CAFAna/Core/ForkRunner.h"
 #include "CAFAna/Core/LoadFromFile.h"
 #include "CAFAna/Core/IFitVar.h"
 #include "CAFAna/Core/Progress.h"
 #include "CAFAna/Core/ThreadPool.h"
 #include "CAFAna/Core/Utilities.h"
+#include "CAFAna/Core/WorkerPool.h"
 
 #include "OscLib/IOscCalc.h"
 
@@ -37,8 +42,11 @@ namespace ana
                                          const SeedList& seedPts,
                                          const std::vector<SystShifts>& systSeedPts,
                                          bool parallel,
-                                         MinuitFitter::FitOpts opts)
-    : fParallel(parallel), fFitOpts(opts)
+                                         MinuitFitter::FitOpts opts,
+                                         FillOrder order,
+                                         int fitBudget)
+    : fParallel(parallel), fFitOpts(opts), fFillOrder(order),
+      fFitBudget(fitBudget)
   {
     CreateHistograms(xvar, nbinsx, xmin, xmax,
                      yvar, nbinsy, ymin, ymax,
@@ -117,6 +125,30 @@ namespace ana
     // run in parallel. But this should cover the whole lot safely.
     DontAddDirectory guard;
 
+    // Without profiling every cell is a single evaluation, so the order
+    // doesn't matter
+    if(fFillOrder == kNeighbour && !(profVars.empty() && profSysts.empty())){
+      FillSurfaceNeighbour(expt, calc, xvar, yvar,
+                           profVars, profSysts, seedPts, systSeedPts);
+      return;
+    }
+
+    // Need at least one point to interpolate in each direction
+    if(fFillOrder == kAdaptive &&
+       fHist->GetNbinsX() > 2 && fHist->GetNbinsY() > 2){
+      FillSurfaceAdaptive(expt, calc, xvar, yvar,
+                          profVars, profSysts, seedPts, systSeedPts);
+      return;
+    }
+
+    // Separate processes, rather than threads sharing the experiment
+    if(fParallel && getenv("CAFANA_SURFACE_NPROCS")){
+      FillSurfaceForked(expt, calc, xvar, yvar, profVars, profSysts,
+                        seedPts, systSeedPts,
+                        atoi(getenv("CAFANA_SURFACE_NPROCS")));
+      return;
+    }
+
     const std::string progTitle = ProgressBarTitle(xvar, yvar, profVars, profSysts);
 
     Progress *prog = 0;
@@ -200,6 +232,360 @@ namespace ana
     }
   }
 
+  //----------------------------------------------------------------------
+  void FrequentistSurface::
+  FillSurfaceForked(const IExperiment* expt,
+                    osc::IOscCalcAdjustable* calc,
+                    const IFitVar* xvar, const IFitVar* yvar,
+                    const std::vector<const IFitVar*>& profVars,
+                    const std::vector<const ISyst*>& profSysts,
+                    const SeedList& seedPts,
+                    const std::vector<SystShifts>& systSeedPts,
+                    unsigned int nProcs)
+  {
+    const int Nx = fHist->GetNbinsX();
+    const int Ny = fHist->GetNbinsY();
+
+    // No evaluating the experiment up front to share its lazy initialization
+    // with the workers. Some of that starts threads (eg MultiExperiment's
+    // pool), and then ForkMap can't fork.
+
+    // Each worker fills its own copy of the histograms, which is discarded,
+    // so return the values to fill here
+    const std::vector<std::vector<double>> res =
+      ForkMap(Nx*Ny, [&](unsigned int i){
+          const int x = i % Nx + 1;
+          const int y = i / Nx + 1;
+
+          std::unique_ptr<osc::IOscCalcAdjustable> c(calc->Copy());
+          for(unsigned int j = 0; j < fSeedValues.size(); ++j) profVars[j]->SetValue(c.get(), fSeedValues[j]);
+          SystShifts bestSysts;
+
+          const PointFit fit = FitSurfacePoint(expt, c.get(),
+                                               xvar, fHist->GetXaxis()->GetBinCenter(x),
+                                               yvar, fHist->GetYaxis()->GetBinCenter(y),
+                                               profVars, profSysts,
+                                               seedPts, systSeedPts, bestSysts);
+          std::vector<double> ret = {fit.chi};
+          ret.insert(ret.end(), fit.prof.begin(), fit.prof.end());
+          return ret;
+        }, nProcs);
+
+    for(int i = 0; i < Nx*Ny; ++i){
+      const double xv = fHist->GetXaxis()->GetBinCenter(i % Nx + 1);
+      const double yv = fHist->GetYaxis()->GetBinCenter(i / Nx + 1);
+
+      FillPoint(xv, yv, {res[i][0], std::vector<double>(res[i].begin()+1, res[i].end())});
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void FrequentistSurface::
+  FillSurfaceNeighbour(const IExperiment* expt,
+                       osc::IOscCalcAdjustable* calc,
+                       const IFitVar* xvar, const IFitVar* yvar,
+                       const std::vector<const IFitVar*>& profVars,
+                       const std::vector<const ISyst*>& profSysts,
+                       const SeedList& seedPts,
+                       const std::vector<SystShifts>& systSeedPts)
+  {
+    const int Nx = fHist->GetNbinsX();
+    const int Ny = fHist->GetNbinsY();
+
+    // Start from the global best fit. This also gives the predictions a
+    // chance to do any lazy initialization before we go parallel.
+    std::unique_ptr<osc::IOscCalcAdjustable> startCalc(calc->Copy());
+    SystShifts startSysts;
+    FitGlobal(expt, startCalc.get(), xvar, yvar,
+              profVars, profSysts, seedPts, systSeedPts, startSysts);
+
+    const int x0 = std::clamp(fHist->GetXaxis()->FindFixBin(xvar->GetValue(startCalc.get())), 1, Nx);
+    const int y0 = std::clamp(fHist->GetYaxis()->FindFixBin(yvar->GetValue(startCalc.get())), 1, Ny);
+
+    // The outcome of each cell, to seed its neighbours from and to fill
+    // once they're all done
+    struct Cell
+    {
+      PointFit fit;
+      SystShifts systs;
+    };
+    std::vector<Cell> cells((Nx+2)*(Ny+2));
+    auto cell = [&](int x, int y) -> Cell& {return cells[y*(Nx+2)+x];};
+
+    Cell start;
+    for(const IFitVar* v: profVars) start.fit.prof.push_back(v->GetValue(startCalc.get()));
+    start.systs = startSysts;
+
+    Progress prog(ProgressBarTitle(xvar, yvar, profVars, profSysts));
+    std::mutex progMutex;
+    int neval = 0;
+
+    auto fillCell = [&](int x, int y, const Cell& seed){
+      std::unique_ptr<osc::IOscCalcAdjustable> c(calc->Copy());
+      for(unsigned int i = 0; i < profVars.size(); ++i) profVars[i]->SetValue(c.get(), seed.fit.prof[i]);
+
+      // The explicitly requested systematic seeds take precedence
+      const std::vector<SystShifts> systSeeds = systSeedPts.empty() ? std::vector<SystShifts>{seed.systs} : systSeedPts;
+
+      Cell& ret = cell(x, y);
+      ret.fit = FitSurfacePoint(expt, c.get(),
+                                xvar, fHist->GetXaxis()->GetBinCenter(x),
+                                yvar, fHist->GetYaxis()->GetBinCenter(y),
+                                profVars, profSysts, seedPts, systSeeds,
+                                ret.systs);
+
+      std::lock_guard<std::mutex> lock(progMutex);
+      prog.SetProgress(++neval / double(Nx * Ny));
+    };
+
+    WorkerPool pool(fParallel ? 0 : 1);
+
+    // The starting row, sweeping out in both directions from the best fit
+    fillCell(x0, y0, start);
+    pool.ParallelFor(2, [&](unsigned int dir){
+      if(dir == 0){
+        for(int x = x0-1; x >= 1; --x) fillCell(x, y0, cell(x+1, y0));
+      }
+      else{
+        for(int x = x0+1; x <= Nx; ++x) fillCell(x, y0, cell(x-1, y0));
+      }
+    });
+
+    // Then the rows above and below, each cell seeded from whichever of its
+    // three neighbours in the previous row has the best chisq. All the cells
+    // in a pair of rows are independent, so are shared between the threads
+    // dynamically.
+    for(int dy = 1; y0+dy <= Ny || y0-dy >= 1; ++dy){
+      std::vector<int> rows;
+      if(y0+dy <= Ny) rows.push_back(y0+dy);
+      if(y0-dy >= 1) rows.push_back(y0-dy);
+
+      pool.ParallelFor(rows.size()*Nx, [&](unsigned int i){
+        const int x = i%Nx + 1;
+        const int y = rows[i/Nx];
+        const int prevY = (y > y0) ? y-1 : y+1;
+
+        const Cell* seed = &cell(x, prevY);
+        for(int nx = std::max(x-1, 1); nx <= std::min(x+1, Nx); ++nx){
+          if(cell(nx, prevY).fit.chi < seed->fit.chi) seed = &cell(nx, prevY);
+        }
+
+        fillCell(x, y, *seed);
+      });
+    }
+
+    // The histograms aren't safe to fill from several threads
+    for(int y = 1; y <= Ny; ++y){
+      for(int x = 1; x <= Nx; ++x){
+        FillPoint(fHist->GetXaxis()->GetBinCenter(x),
+                  fHist->GetYaxis()->GetBinCenter(y),
+                  cell(x, y).fit);
+      }
+    }
+
+    prog.Done();
+  }
+
+  //----------------------------------------------------------------------
+  void FrequentistSurface::
+  FillSurfaceAdaptive(const IExperiment* expt,
+                      osc::IOscCalcAdjustable* calc,
+                      const IFitVar* xvar, const IFitVar* yvar,
+                      const std::vector<const IFitVar*>& profVars,
+                      const std::vector<const ISyst*>& profSysts,
+                      const SeedList& seedPts,
+                      const std::vector<SystShifts>& systSeedPts)
+  {
+    // The up-values of all the GaussianXXX functions below. Cells
+    // straddling any of these are the ones where resolution matters.
+    const std::vector<double> levels = {2.30, 4.61, 5.99, 6.18, 9.21, 11.83,
+                                        1.00, 2.71, 3.84, 4.00, 6.63, 9.00};
+
+    const int Nx = fHist->GetNbinsX();
+    const int Ny = fHist->GetNbinsY();
+
+    // The contours are relative to the global minimum. This also gives the
+    // predictions a chance to do any lazy initialization before we go
+    // parallel.
+    std::unique_ptr<osc::IOscCalcAdjustable> startCalc(calc->Copy());
+    SystShifts startSysts;
+    const double minChi = FitGlobal(expt, startCalc.get(), xvar, yvar,
+                                    profVars, profSysts, seedPts, systSeedPts,
+                                    startSysts);
+
+    // Grid points are indexed from zero, at the bin centres
+    struct Point
+    {
+      bool done = false;
+      double chi;
+      std::vector<double> prof;
+    };
+    std::vector<Point> pts(Nx*Ny);
+    auto pt = [&](int x, int y) -> Point& {return pts[y*Nx+x];};
+
+    WorkerPool pool(fParallel ? 0 : 1);
+    int nFits = 0;
+
+    auto fitPoints = [&](const std::vector<std::pair<int, int>>& todo){
+      pool.ParallelFor(todo.size(), [&](unsigned int i){
+        const int x = todo[i].first;
+        const int y = todo[i].second;
+
+        std::unique_ptr<osc::IOscCalcAdjustable> c(calc->Copy());
+        for(unsigned int j = 0; j < fSeedValues.size(); ++j) profVars[j]->SetValue(c.get(), fSeedValues[j]);
+        SystShifts bestSysts;
+
+        const PointFit fit = FitSurfacePoint(expt, c.get(),
+                                             xvar, fHist->GetXaxis()->GetBinCenter(x+1),
+                                             yvar, fHist->GetYaxis()->GetBinCenter(y+1),
+                                             profVars, profSysts, seedPts, systSeedPts,
+                                             bestSysts);
+        Point& p = pt(x, y);
+        p.chi = fit.chi;
+        p.prof = fit.prof;
+        p.done = true;
+      });
+      nFits += todo.size();
+    };
+
+    // Coarse grid with at least 8 intervals along each axis, always
+    // including the edges
+    auto coarse = [](int N){
+      int step = 1;
+      while((N-1)/(2*step) >= 8) step *= 2;
+      std::vector<int> ret;
+      for(int i = 0; i < N-1; i += step) ret.push_back(i);
+      ret.push_back(N-1);
+      return ret;
+    };
+    const std::vector<int> xs = coarse(Nx);
+    const std::vector<int> ys = coarse(Ny);
+
+    std::vector<std::pair<int, int>> todo;
+    for(int y: ys) for(int x: xs) todo.emplace_back(x, y);
+    fitPoints(todo);
+
+    // Rectangles of grid points, inclusive of both edges
+    struct Cell{int x0, x1, y0, y1;};
+
+    std::vector<Cell> cells, leaves;
+    for(unsigned int j = 0; j+1 < ys.size(); ++j)
+      for(unsigned int i = 0; i+1 < xs.size(); ++i)
+        cells.push_back({xs[i], xs[i+1], ys[j], ys[j+1]});
+
+    auto straddles = [&](const Cell& c){
+      const double a = pt(c.x0, c.y0).chi, b = pt(c.x1, c.y0).chi;
+      const double d = pt(c.x0, c.y1).chi, e = pt(c.x1, c.y1).chi;
+      const double lo = std::min({a, b, d, e}) - minChi;
+      const double hi = std::max({a, b, d, e}) - minChi;
+      for(double level: levels) if(lo < level && hi >= level) return true;
+      return false;
+    };
+
+    // Subdivide breadth-first, so that if the budget runs out the
+    // resolution is at least even along the contours
+    while(!cells.empty()){
+      std::vector<Cell> next;
+      std::set<std::pair<int, int>> newPts;
+
+      for(const Cell& c: cells){
+        if((c.x1-c.x0 <= 1 && c.y1-c.y0 <= 1) || !straddles(c)){
+          leaves.push_back(c);
+          continue;
+        }
+
+        const std::vector<int> cx = (c.x1-c.x0 > 1) ? std::vector<int>{c.x0, (c.x0+c.x1)/2, c.x1} : std::vector<int>{c.x0, c.x1};
+        const std::vector<int> cy = (c.y1-c.y0 > 1) ? std::vector<int>{c.y0, (c.y0+c.y1)/2, c.y1} : std::vector<int>{c.y0, c.y1};
+
+        std::set<std::pair<int, int>> need;
+        for(int y: cy) for(int x: cx){
+          if(!pt(x, y).done && !newPts.count({x, y})) need.emplace(x, y);
+        }
+
+        if(fFitBudget > 0 && nFits + int(newPts.size() + need.size()) > fFitBudget){
+          leaves.push_back(c);
+          continue;
+        }
+
+        newPts.insert(need.begin(), need.end());
+        for(unsigned int j = 0; j+1 < cy.size(); ++j)
+          for(unsigned int i = 0; i+1 < cx.size(); ++i)
+            next.push_back({cx[i], cx[i+1], cy[j], cy[j+1]});
+      }
+
+      fitPoints(std::vector<std::pair<int, int>>(newPts.begin(), newPts.end()));
+      cells = next;
+    } // end while
+
+    // Bilinear interpolation within the leaf cells. Points on the boundary
+    // between cells of different sizes take the value from the smaller one.
+    std::sort(leaves.begin(), leaves.end(), [](const Cell& a, const Cell& b){
+      return (a.x1-a.x0)*(a.y1-a.y0) > (b.x1-b.x0)*(b.y1-b.y0);
+    });
+
+    const unsigned int nProf = fProfHists.size();
+    std::vector<Point> interp(Nx*Ny);
+    for(const Cell& c: leaves){
+      for(int y = c.y0; y <= c.y1; ++y){
+        for(int x = c.x0; x <= c.x1; ++x){
+          if(pt(x, y).done) continue;
+
+          const double tx = double(x-c.x0)/(c.x1-c.x0);
+          const double ty = double(y-c.y0)/(c.y1-c.y0);
+          const double w00 = (1-tx)*(1-ty), w10 = tx*(1-ty);
+          const double w01 = (1-tx)*ty, w11 = tx*ty;
+
+          const Point& p00 = pt(c.x0, c.y0);
+          const Point& p10 = pt(c.x1, c.y0);
+          const Point& p01 = pt(c.x0, c.y1);
+          const Point& p11 = pt(c.x1, c.y1);
+
+          Point& p = interp[y*Nx+x];
+          p.done = true;
+          p.chi = w00*p00.chi + w10*p10.chi + w01*p01.chi + w11*p11.chi;
+          p.prof.resize(nProf);
+          for(unsigned int i = 0; i < nProf; ++i)
+            p.prof[i] = w00*p00.prof[i] + w10*p10.prof[i] + w01*p01.prof[i] + w11*p11.prof[i];
+        }
+      }
+    }
+
+    // Both the fitted and the interpolated points are filled here, since
+    // the histograms aren't safe to fill from the fitting threads
+    for(int y = 0; y < Ny; ++y){
+      for(int x = 0; x < Nx; ++x){
+        const Point& p = pt(x, y).done ? pt(x, y) : interp[y*Nx+x];
+        if(!p.done) continue;
+
+        FillPoint(fHist->GetXaxis()->GetBinCenter(x+1),
+                  fHist->GetYaxis()->GetBinCenter(y+1),
+                  {p.chi, p.prof});
+      }
+    }
+
+    std::cout << "FrequentistSurface: fit " << nFits << " of " << Nx*Ny
+              << " points, interpolated the rest" << std::endl;
+  }
+
+  //----------------------------------------------------------------------
+  double FrequentistSurface::FitGlobal(const IExperiment* expt,
+                                       osc::IOscCalcAdjustable* calc,
+                                       const IFitVar* xvar, const IFitVar* yvar,
+                                       const std::vector<const IFitVar*>& profVars,
+                                       const std::vector<const ISyst*>& profSysts,
+                                       const SeedList& seedPts,
+                                       const std::vector<SystShifts>& systSeedPts,
+                                       SystShifts& bestSysts)
+  {
+    for(unsigned int i = 0; i < fSeedValues.size(); ++i) profVars[i]->SetValue(calc, fSeedValues[i]);
+
+    std::vector<const IFitVar*> allVars = {xvar, yvar};
+    allVars.insert(allVars.end(), profVars.begin(), profVars.end());
+    MinuitFitter fit(expt, allVars, profSysts);
+    fit.SetFitOpts(fFitOpts);
+    return fit.Fit(calc, bestSysts, seedPts, systSeedPts, MinuitFitter::kQuiet)->EvalMetricVal();
+  }
+
   //----------------------------------------------------------------------
   double FrequentistSurface::FillSurfacePoint(const IExperiment* expt,
                                               osc::IOscCalcAdjustable* calc,
@@ -216,35 +602,65 @@ namespace ana
       calc = calc->Copy();
     }
 
-    xvar->SetValue(calc, x);
-    yvar->SetValue(calc, y);
-
     //Make sure that the profiled values of fitvars do not persist between steps.
     for(int i = 0; i < (int)fSeedValues.size(); ++i) profVars[i]->SetValue( calc, fSeedValues[i] );
 
-    double chi;
+    SystShifts bestSysts;
+    const PointFit fit = FitSurfacePoint(expt, calc, xvar, x, yvar, y,
+                                         profVars, profSysts,
+                                         seedPts, systSeedPts, bestSysts);
+
+    if(fParallel) delete calc;
+
+    {
+      // This is called from the ThreadPool tasks
+      static std::mutex fillMutex;
+      std::lock_guard<std::mutex> lock(fillMutex);
+      FillPoint(x, y, fit);
+    }
+
+    return fit.chi;
+  }
+
+  //----------------------------------------------------------------------
+  FrequentistSurface::PointFit FrequentistSurface::
+  FitSurfacePoint(const IExperiment* expt,
+                  osc::IOscCalcAdjustable* calc,
+                  const IFitVar* xvar, double x,
+                  const IFitVar* yvar, double y,
+                  const std::vector<const IFitVar*>& profVars,
+                  const std::vector<const ISyst*>& profSysts,
+                  const SeedList& seedPts,
+                  const std::vector<SystShifts>& systSeedPts,
+                  SystShifts& bestSysts)
+  {
+    xvar->SetValue(calc, x);
+    yvar->SetValue(calc, y);
+
+    PointFit ret;
     if(profVars.empty() && profSysts.empty()){
-      chi = expt->ChiSq(calc);
+      ret.chi = expt->ChiSq(calc);
     }
     else{
       MinuitFitter fitter(expt, profVars, profSysts);
       fitter.SetFitOpts(fFitOpts);
-      SystShifts bestSysts;
-      chi = fitter.Fit(calc, bestSysts, seedPts, systSeedPts, MinuitFitter::kQuiet)->EvalMetricVal();
+      ret.chi = fitter.Fit(calc, bestSysts, seedPts, systSeedPts, MinuitFitter::kQuiet)->EvalMetricVal();
 
-      for(unsigned int i = 0; i < profVars.size(); ++i){
-        fProfHists[i]->Fill(x, y, profVars[i]->GetValue(calc));
-      }
-      for(unsigned int j = 0; j < profSysts.size(); ++j){
-        fProfHists[j+profVars.size()]->Fill(x, y, bestSysts.GetShift(profSysts[j]));
-      }
+      for(const IFitVar* v: profVars) ret.prof.push_back(v->GetValue(calc));
+      for(const ISyst* s: profSysts) ret.prof.push_back(bestSysts.GetShift(s));
     }
 
-    fHist->Fill(x, y, chi);
+    return ret;
+  }
 
-    if(fParallel) delete calc;
+  //----------------------------------------------------------------------
+  void FrequentistSurface::FillPoint(double x, double y, const PointFit& fit)
+  {
+    fHist->Fill(x, y, fit.chi);
 
-    return chi;
+    for(unsigned int i = 0; i < fit.prof.size(); ++i){
+      fProfHists[i]->Fill(x, y, fit.prof[i]);
+    }
   }
 
 
@@ -29,6 +29,19 @@ namespace ana
       friend class NumuSurface;
       friend class NueSurface;
 
+      /// Order in which to visit the cells of a profiled surface
+      enum FillOrder
+      {
+        /// Pseudo-random order, every cell seeded from the same values
+        kScatter,
+        /// \brief Outwards from the global best fit, row by row, each cell
+        /// seeded from the best of its already-fitted neighbours
+        kNeighbour,
+        /// \brief Fit a coarse grid, then only subdivide cells that straddle
+        /// one of the gaussian up-values, interpolating everywhere else
+        kAdaptive
+      };
+
       /// \param expt The experiment object to draw \f$ \chi^2 \f$ values from
       /// \param calc Values for oscillation parameters to be held fixed
       /// \param xvar Oscillation parameter to place on the x axis
@@ -43,6 +56,16 @@ namespace ana
       /// \param seedPts Try all combinations of these params as seeds
       /// \param systSeedPts Try all of these systematic combinations as seeds
       /// \param parallel Use all the cores on this machine? Be careful...
+      ///                 If $CAFANA_SURFACE_NPROCS is set the points are
+      ///                 instead fit in that many forked processes. That
+      ///                 needs this to be the only thread in the process,
+      ///                 otherwise they're fit in that many threads, see
+      ///                 \ref ForkMap.
+      /// \param opts Fit options for the profiling fits
+      /// \param order Order to visit the cells in, see \ref FillOrder
+      /// \param fitBudget Maximum number of points to fit for \ref kAdaptive.
+      ///                  Zero means refine down to the full binning wherever
+      ///                  necessary.
       FrequentistSurface(const IExperiment* expt,
               osc::IOscCalcAdjustable* calc,
               const IFitVar* xvar, int nbinsx, double xmin, double xmax,
@@ -52,7 +75,9 @@ namespace ana
               const SeedList& seedPts = SeedList(),
               const std::vector<SystShifts>& systSeedPts = {},
               bool parallel = false,
-              MinuitFitter::FitOpts opts = MinuitFitter::kNormal);
+              MinuitFitter::FitOpts opts = MinuitFitter::kNormal,
+              FillOrder order = kScatter,
+              int fitBudget = 0);
 
         virtual ~FrequentistSurface();
 
@@ -82,6 +107,47 @@ namespace ana
                                const SeedList& seedPts,
                                const std::vector<SystShifts>& systSeedPts);
 
+      /// \brief Implementation of \ref FillSurface for \ref kScatter using
+      /// forked worker processes
+      void FillSurfaceForked(const IExperiment* expt,
+                             osc::IOscCalcAdjustable* calc,
+                             const IFitVar* xvar, const IFitVar* yvar,
+                             const std::vector<const IFitVar*>& profVars,
+                             const std::vector<const ISyst*>& profSysts,
+                             const SeedList& seedPts,
+                             const std::vector<SystShifts>& systSeedPts,
+                             unsigned int nProcs);
+
+      /// Implementation of \ref FillSurface for \ref kNeighbour
+      void FillSurfaceNeighbour(const IExperiment* expt,
+                                osc::IOscCalcAdjustable* calc,
+                                const IFitVar* xvar, const IFitVar* yvar,
+                                const std::vector<const IFitVar*>& profVars,
+                                const std::vector<const ISyst*>& profSysts,
+                                const SeedList& seedPts,
+                                const std::vector<SystShifts>& systSeedPts);
+
+      /// Implementation of \ref FillSurface for \ref kAdaptive
+      void FillSurfaceAdaptive(const IExperiment* expt,
+                               osc::IOscCalcAdjustable* calc,
+                               const IFitVar* xvar, const IFitVar* yvar,
+                               const std::vector<const IFitVar*>& profVars,
+                               const std::vector<const ISyst*>& profSysts,
+                               const SeedList& seedPts,
+                               const std::vector<SystShifts>& systSeedPts);
+
+      /// \brief Fit all of the parameters, as a starting point for filling
+      ///
+      /// \a calc must be private to the caller, and is left at the best fit
+      double FitGlobal(const IExperiment* expt,
+                       osc::IOscCalcAdjustable* calc,
+                       const IFitVar* xvar, const IFitVar* yvar,
+                       const std::vector<const IFitVar*>& profVars,
+                       const std::vector<const ISyst*>& profSysts,
+                       const SeedList& seedPts,
+                       const std::vector<SystShifts>& systSeedPts,
+                       SystShifts& bestSysts);
+
       double FillSurfacePoint(const IExperiment* expt,
                               osc::IOscCalcAdjustable* calc,
                               const IFitVar* xvar, double x,
@@ -91,6 +157,34 @@ namespace ana
                               const SeedList& seedPts,
                               const std::vector<SystShifts>& systSeedPts);
 
+      /// Outcome of profiling a single point
+      struct PointFit
+      {
+        double chi;
+        /// Best fit values of the profiled variables, then the systematics,
+        /// in the order of \ref fProfHists
+        std::vector<double> prof;
+      };
+
+      /// \brief Profile a single point
+      ///
+      /// \a calc must be private to the caller, and its profiled parameters
+      /// hold the seed values. On return they hold the best fit values, as
+      /// does \a bestSysts for the systematics. Nothing is filled, so this
+      /// is safe to call from several threads at once.
+      PointFit FitSurfacePoint(const IExperiment* expt,
+                             osc::IOscCalcAdjustable* calc,
+                             const IFitVar* xvar, double x,
+                             const IFitVar* yvar, double y,
+                             const std::vector<const IFitVar*>& profVars,
+                             const std::vector<const ISyst*>& profSysts,
+                             const SeedList& seedPts,
+                             const std::vector<SystShifts>& systSeedPts,
+                             SystShifts& bestSysts);
+
+      /// Fill the result of \ref FitSurfacePoint into the histograms
+      void FillPoint(double x, double y, const PointFit& fit);
+
       void FindMinimum(const IExperiment* expt,
                        osc::IOscCalcAdjustable* calc,
                        const IFitVar* xvar, const IFitVar* yvar,
@@ -103,6 +197,9 @@ namespace ana
 
       MinuitFitter::FitOpts fFitOpts;
 
+      FillOrder fFillOrder;
+      int fFitBudget;
+
       // Best fit point
       std::vector<TH2*> fProfHists;
   };
@@ -3,6 +3,7 @@
 #include "CAFAna/Core/IFitVar.h"
 #include "CAFAna/Core/ISyst.h"
 #include "CAFAna/Core/Utilities.h"
+#include "CAFAna/Core/WorkerPool.h"
 #include "CAFAna/Experiment/IExperiment.h"
 
 #include "OscLib/IOscCalc.h"
@@ -29,7 +30,8 @@ namespace ana
   IFitter::IFitter(const IFitter &other)
       : fVars(other.fVars),
         fSysts(other.fSysts),
-        fShifts(std::make_unique<SystShifts>(*other.fShifts))
+        fShifts(other.fShifts ? std::make_unique<SystShifts>(*other.fShifts) : nullptr),
+        fParallelSeeds(other.fParallelSeeds)
   {}
 
   //----------------------------------------------------------------------
@@ -128,6 +130,24 @@ namespace ana
 
     const std::vector<SeedPt> pts = ExpandSeeds(seedPts, systSeedPts);
 
+    if(fParallelSeeds && pts.size() > 1){
+      std::vector<std::unique_ptr<IFitter>> fitters;
+      for(unsigned int i = 0; i < pts.size(); ++i){
+        std::unique_ptr<IFitter> f = CloneForSeed();
+        if(!f){
+          std::cout << "IFitter: this fitter doesn't support parallel seeds. "
+                    << "Fitting them serially." << std::endl;
+          fitters.clear();
+          break;
+        }
+        f->fShifts = fShifts->Copy();
+        fitters.push_back(std::move(f));
+      }
+
+      if(!fitters.empty())
+        return ParallelFitHelper(initseed, bestSysts, pts, fitters, verb);
+    }
+
     std::unique_ptr<IFitSummary> bestFitSummary;
     std::vector<double> bestFitPars, bestSystPars;
 
@@ -172,6 +192,63 @@ namespace ana
     return bestFitSummary;
   }
 
+  //----------------------------------------------------------------------
+  std::unique_ptr<IFitter::IFitSummary>
+  IFitter::ParallelFitHelper(osc::IOscCalcAdjustable* initseed,
+                             SystShifts& bestSysts,
+                             const std::vector<SeedPt>& pts,
+                             std::vector<std::unique_ptr<IFitter>>& fitters,
+                             Verbosity verb) const
+  {
+    struct SeedResult
+    {
+      std::unique_ptr<osc::IOscCalcAdjustable> seed;
+      std::unique_ptr<SystShifts> shift;
+      std::unique_ptr<IFitSummary> summary;
+    };
+
+    const unsigned int N = pts.size();
+    std::vector<SeedResult> results(N);
+
+    // All the copying happens up front, so the tasks share nothing
+    for(unsigned int i = 0; i < N; ++i){
+      if(initseed) results[i].seed.reset(initseed->Copy());
+      pts[i].fitvars.ResetCalc(results[i].seed.get());
+
+      // be sure to keep any derived class stuff around
+      results[i].shift = fShifts->Copy();
+      *results[i].shift = pts[i].shift;
+    }
+
+    PrimeCaches(results[0].seed.get(), *results[0].shift);
+
+    WorkerPool pool(std::min(N, LocalThreadBudget()));
+    pool.ParallelFor(N, [&](unsigned int i){
+      results[i].summary = fitters[i]->FitHelperSeeded(results[i].seed.get(),
+                                                       *results[i].shift,
+                                                       verb);
+    });
+
+    // Pick the best in seed order, exactly as the serial loop would
+    int bestIdx = -1;
+    for(unsigned int i = 0; i < N; ++i){
+      const IFitSummary* best = bestIdx >= 0 ? results[bestIdx].summary.get() : 0;
+      if(results[i].summary->IsBetterThan(best)) bestIdx = i;
+    }
+    assert(bestIdx >= 0);
+
+    for(unsigned int i = 0; i < N; ++i) MergeSeedFit(*fitters[i], int(i) == bestIdx);
+
+    SeedResult& best = results[bestIdx];
+    UpdatePostFit(best.summary.get());
+
+    // Stuff the results of the actual best fit back into the seeds
+    for(const IFitVar* v: fVars) v->SetValue(initseed, v->GetValue(best.seed.get()));
+    for(const ISyst* s: fSysts) bestSysts.SetShift(s, best.shift->GetShift(s));
+
+    return std::move(best.summary);
+  }
+
   //----------------------------------------------------------------------
   void IFitter::ValidateSeeds(osc::IOscCalcAdjustable* seed,
                               const SeedList& seedPts,
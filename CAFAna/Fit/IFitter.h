@@ -83,6 +83,14 @@ namespace ana
 
       std::unique_ptr<SystShifts> GetSystShifts() const {return fShifts->Copy();}
 
+      /// \brief Fit the different seed points concurrently
+      ///
+      /// Only has an effect for fitters that implement \ref CloneForSeed. Each
+      /// seed is fitted by its own clone of the fitter, with its own copy of
+      /// the calculator and SystShifts. The results are compared in seed
+      /// order, so the outcome is the same as for a serial fit.
+      void SetParallelSeeds(bool parallel = true) {fParallelSeeds = parallel;}
+
     protected:
       struct SeedPt
       {
@@ -110,6 +118,41 @@ namespace ana
       /// Make any internal updates needed after each fit cycle.
       virtual void UpdatePostFit(const IFitSummary * summary) const = 0;
 
+      /// \brief Independent fitter with the same configuration, to fit one
+      /// seed of a parallel fit
+      ///
+      /// Return null (the default) if this isn't supported, in which case the
+      /// seeds are fitted serially.
+      virtual std::unique_ptr<IFitter> CloneForSeed() const {return nullptr;}
+
+      /// \brief Absorb any bookkeeping from a fitter returned by
+      /// \ref CloneForSeed, once its fit is complete
+      ///
+      /// Called for each seed in order, once all of them are fitted, and
+      /// before \ref UpdatePostFit. So this is also the place to print out
+      /// anything the seed fitter held back. \a best is set for the fitter
+      /// that found the overall best fit.
+      virtual void MergeSeedFit(const IFitter& seedFitter, bool best) const {}
+
+      /// \brief Build, once and serially, anything the fitters for the
+      /// different seeds would otherwise all build on first use
+      ///
+      /// Called with the first seed, after the clones are made and before any
+      /// of them starts fitting. The clones share the experiment and its
+      /// predictions, some of which create state the first time they're
+      /// evaluated. Doing that here means it's created once, up front, rather
+      /// than by whichever seed gets there first. Default does nothing.
+      virtual void PrimeCaches(osc::IOscCalcAdjustable* seed,
+                               const SystShifts& shift) const {}
+
+      /// Parallel implementation of \ref FitHelper
+      std::unique_ptr<IFitSummary>
+      ParallelFitHelper(osc::IOscCalcAdjustable* initseed,
+                        SystShifts& bestSysts,
+                        const std::vector<SeedPt>& pts,
+                        std::vector<std::unique_ptr<IFitter>>& fitters,
+                        Verbosity verb) const;
+
 
       /// Check that the seeds that were specified are compatible with the vars being fitted
       void ValidateSeeds(osc::IOscCalcAdjustable* seed,
@@ -121,6 +164,8 @@ namespace ana
       mutable std::unique_ptr<SystShifts> fShifts;
       mutable Verbosity fVerb;
 
+      bool fParallelSeeds = false;
+
   };
 
 }
@@ -0,0 +1,313 @@
+#include "CAFAna/Fit/KNNRegressor.h"
+
+#include "CAFAna/Core/WorkerPool.h"
+
+#include "TDirectory.h"
+#include "TObjString.h"
+#include "TParameter.h"
+#include "TVectorD.h"
+
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+
+namespace ana
+{
+  namespace
+  {
+    /// Subtrees with this many points or fewer are just searched exhaustively
+    const std::size_t kLeafSize = 8;
+  }
+
+  //----------------------------------------------------------------------
+  KNNRegressor::KNNRegressor(const std::vector<const std::vector<double>*> & columns,
+                             const std::vector<double> & targets,
+                             unsigned int k)
+  {
+    const std::size_t nPoints = targets.size();
+    const std::size_t nDims = columns.size();
+    assert(nPoints > 1);
+    assert(nDims > 0 && nDims < 256);
+    for (const auto & col : columns)
+      assert(col->size() == nPoints);
+
+    // the TMVA version this replaces needed k smaller than the number of points too
+    fK = std::min(std::size_t(k), nPoints - 1);
+
+    // scale each dimension by the width of its central 80%,
+    // like TMVA's kNN (ScaleFrac=0.8) did
+    fScales.resize(nDims);
+    std::vector<double> sorted;
+    for (std::size_t dim = 0; dim < nDims; dim++)
+    {
+      sorted = *columns[dim];
+      const std::size_t loIdx = std::size_t(0.1 * (nPoints - 1));
+      const std::size_t hiIdx = std::size_t(0.9 * (nPoints - 1));
+      std::nth_element(sorted.begin(), sorted.begin() + loIdx, sorted.end());
+      const double loVal = sorted[loIdx];
+      // everything above loIdx is now no smaller, so only that part needs searching
+      if (hiIdx > loIdx)
+        std::nth_element(sorted.begin() + loIdx + 1, sorted.begin() + hiIdx, sorted.end());
+      const double width = sorted[hiIdx] - loVal;
+      fScales[dim] = width > 0 ? 1 / width : 1;
+    }
+
+    std::vector<double> points(nPoints * nDims);
+    for (std::size_t dim = 0; dim < nDims; dim++)
+    {
+      const auto & col = *columns[dim];
+      for (std::size_t pt = 0; pt < nPoints; pt++)
+        points[pt * nDims + dim] = col[pt] * fScales[dim];
+    }
+
+    Build(std::move(points), std::vector<double>(targets));
+  }
+
+  //----------------------------------------------------------------------
+  void KNNRegressor::Build(std::vector<double> && points, std::vector<double> && targets)
+  {
+    fPoints = std::move(points);
+    fTargets = std::move(targets);
+
+    const std::size_t nPoints = fTargets.size();
+    const std::size_t nDims = NDims();
+
+    fIdx.resize(nPoints);
+    std::iota(fIdx.begin(), fIdx.end(), 0);
+    fSplitDim.assign(nPoints, 0);
+
+    // split serially until there are enough independent subtrees
+    // to keep all the threads busy, then build those in parallel
+    WorkerPool pool;
+    unsigned int maxDepth = 0;
+    while ((1u << maxDepth) < 4 * pool.NThreads() && (nPoints >> maxDepth) > kLeafSize)
+      maxDepth++;
+    std::vector<std::pair<std::size_t, std::size_t>> subtrees;
+    BuildNode(0, nPoints, 0, maxDepth, &subtrees);
+    pool.ParallelFor(subtrees.size(), [&](unsigned int subtreeIdx)
+    {
+      BuildNode(subtrees[subtreeIdx].first, subtrees[subtreeIdx].second);
+    });
+
+    // finally put the points in tree order,
+    // so that searches don't have to jump around in memory
+    std::vector<double> orderedPoints(fPoints.size());
+    std::vector<double> orderedTargets(nPoints);
+    for (std::size_t pos = 0; pos < nPoints; pos++)
+    {
+      std::copy_n(&fPoints[fIdx[pos] * nDims], nDims, &orderedPoints[pos * nDims]);
+      orderedTargets[pos] = fTargets[fIdx[pos]];
+    }
+    fPoints.swap(orderedPoints);
+    fTargets.swap(orderedTargets);
+
+    fIdx.clear();
+    fIdx.shrink_to_fit();
+  }
+
+  //----------------------------------------------------------------------
+  void KNNRegressor::BuildNode(std::size_t lo, std::size_t hi,
+                               unsigned int depth, unsigned int maxDepth,
+                               std::vector<std::pair<std::size_t, std::size_t>> * deferred)
+  {
+    if (deferred && depth == maxDepth)
+    {
+      deferred->emplace_back(lo, hi);
+      return;
+    }
+    if (hi - lo <= kLeafSize)
+      return;
+
+    // split on whichever dimension the points are most spread out in
+    const std::size_t nDims = NDims();
+    unsigned char splitDim = 0;
+    double widest = -1;
+    for (std::size_t dim = 0; dim < nDims; dim++)
+    {
+      double min = fPoints[fIdx[lo] * nDims + dim];
+      double max = min;
+      for (std::size_t pos = lo + 1; pos < hi; pos++)
+      {
+        const double val = fPoints[fIdx[pos] * nDims + dim];
+        min = std::min(min, val);
+        max = std::max(max, val);
+      }
+      if (max - min > widest)
+      {
+        widest = max - min;
+        splitDim = static_cast<unsigned char>(dim);
+      }
+    }
+
+    // the median point becomes this node
+    const std::size_t mid = lo + (hi - lo) / 2;
+    std::nth_element(fIdx.begin() + lo, fIdx.begin() + mid, fIdx.begin() + hi,
+                     [this, nDims, splitDim](std::size_t a, std::size_t b)
+                     {
+                       return fPoints[a * nDims + splitDim] < fPoints[b * nDims + splitDim];
+                     });
+    fSplitDim[mid] = splitDim;
+
+    BuildNode(lo, mid, depth + 1, maxDepth, deferred);
+    BuildNode(mid + 1, hi, depth + 1, maxDepth, deferred);
+  }
+
+  //----------------------------------------------------------------------
+  double KNNRegressor::Estimate(const std::vector<double> & point) const
+  {
+    assert(point.size() == NDims());
+
+    Heap_t heap;
+    heap.reserve(fK);
+    return Estimate(point.data(), heap);
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<double> KNNRegressor::Estimate(const std::vector<std::vector<double>> & points) const
+  {
+    std::vector<double> ret(points.size());
+
+    // blocks of points rather than individual ones, to keep the scheduling overhead down
+    WorkerPool pool;
+    const std::size_t nBlocks = std::min(points.size(), std::size_t(4 * pool.NThreads()));
+    pool.ParallelFor(nBlocks, [&](unsigned int block)
+    {
+      Heap_t heap;
+      heap.reserve(fK);
+      for (std::size_t ptIdx = block * points.size() / nBlocks; ptIdx < (block + 1) * points.size() / nBlocks; ptIdx++)
+      {
+        assert(points[ptIdx].size() == NDims());
+        ret[ptIdx] = Estimate(points[ptIdx].data(), heap);
+      }
+    });
+
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  double KNNRegressor::Estimate(const double * point, Heap_t & heap) const
+  {
+    std::vector<double> q(point, point + NDims());
+    for (std::size_t dim = 0; dim < q.size(); dim++)
+      q[dim] *= fScales[dim];
+
+    heap.clear();
+    Search(q.data(), 0, NPoints(), heap);
+
+    // plain average of the neighbours, as TMVA's kNN regression did
+    double sum = 0;
+    for (const auto & neighbour : heap)
+      sum += fTargets[neighbour.second];
+    return sum / heap.size();
+  }
+
+  //----------------------------------------------------------------------
+  void KNNRegressor::Search(const double * q, std::size_t lo, std::size_t hi, Heap_t & heap) const
+  {
+    const std::size_t nDims = NDims();
+
+    auto Consider = [&](std::size_t pos)
+    {
+      const double * p = &fPoints[pos * nDims];
+      double dist2 = 0;
+      for (std::size_t dim = 0; dim < nDims; dim++)
+        dist2 += (q[dim] - p[dim]) * (q[dim] - p[dim]);
+
+      if (heap.size() < fK)
+      {
+        heap.emplace_back(dist2, pos);
+        std::push_heap(heap.begin(), heap.end());
+      }
+      else if (dist2 < heap.front().first)
+      {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = {dist2, pos};
+        std::push_heap(heap.begin(), heap.end());
+      }
+    };
+
+    if (hi - lo <= kLeafSize)
+    {
+      for (std::size_t pos = lo; pos < hi; pos++)
+        Consider(pos);
+      return;
+    }
+
+    const std::size_t mid = lo + (hi - lo) / 2;
+    Consider(mid);
+
+    // search the side q is on first,
+    // then the other one only if it could hold anything closer
+    const double diff = q[fSplitDim[mid]] - fPoints[mid * nDims + fSplitDim[mid]];
+    const std::size_t nearLo = diff < 0 ? lo : mid + 1;
+    const std::size_t nearHi = diff < 0 ? mid : hi;
+    const std::size_t farLo = diff < 0 ? mid + 1 : lo;
+    const std::size_t farHi = diff < 0 ? hi : mid;
+
+    Search(q, nearLo, nearHi, heap);
+    if (heap.size() < fK || diff * diff < heap.front().first)
+      Search(q, farLo, farHi, heap);
+  }
+
+  //----------------------------------------------------------------------
+  void KNNRegressor::SaveTo(TDirectory * dir, const std::string & name) const
+  {
+    TDirectory * tmp = gDirectory;
+
+    dir = dir->mkdir(name.c_str()); // switch to subdir
+    dir->cd();
+
+    TObjString("KNNRegressor").Write("type");
+    TParameter<int>("k", fK).Write();
+
+    // the tree structure is saved too, so that it doesn't need rebuilding
+    TVectorD(fScales.size(), fScales.data()).Write("scales");
+    TVectorD(fPoints.size(), fPoints.data()).Write("points");
+    TVectorD(fTargets.size(), fTargets.data()).Write("targets");
+    const std::vector<double> splitDims(fSplitDim.begin(), fSplitDim.end());
+    TVectorD(splitDims.size(), splitDims.data()).Write("splitDims");
+
+    dir->Write();
+    delete dir;
+
+    tmp->cd();
+  }
+
+  //----------------------------------------------------------------------
+  std::unique_ptr<KNNRegressor> KNNRegressor::LoadFrom(TDirectory * dir, const std::string & name)
+  {
+    dir = dir->GetDirectory(name.c_str()); // switch to subdir
+    assert(dir);
+
+    TObjString * tag = (TObjString *) dir->Get("type");
+    assert(tag);
+    assert(tag->GetString() == "KNNRegressor");
+    delete tag;
+
+    auto ReadVector = [dir](const char * vecName)
+    {
+      std::unique_ptr<TVectorD> vec((TVectorD *) dir->Get(vecName));
+      assert(vec);
+      return std::vector<double>(vec->GetMatrixArray(), vec->GetMatrixArray() + vec->GetNrows());
+    };
+
+    // can't use make_unique<> because the default constructor is protected
+    std::unique_ptr<KNNRegressor> ret(new KNNRegressor);
+
+    std::unique_ptr<TParameter<int>> k((TParameter<int> *) dir->Get("k"));
+    assert(k);
+    ret->fK = k->GetVal();
+    ret->fScales = ReadVector("scales");
+    ret->fPoints = ReadVector("points");
+    ret->fTargets = ReadVector("targets");
+    const std::vector<double> splitDims = ReadVector("splitDims");
+    ret->fSplitDim.assign(splitDims.begin(), splitDims.end());
+
+    assert(ret->fPoints.size() == ret->fTargets.size() * ret->fScales.size());
+    assert(ret->fSplitDim.size() == ret->fTargets.size());
+
+    delete dir;
+
+    return ret;
+  }
+}
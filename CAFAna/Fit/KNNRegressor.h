@@ -0,0 +1,74 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class TDirectory;
+
+namespace ana
+{
+  /// \brief k-nearest-neighbour regression using a KD-tree
+  ///
+  /// Estimates a target value (eg the LL of a set of MCMC samples) at any point
+  /// as the mean target of the k training points nearest to it.
+  /// As with the TMVA kNN this replaces, each dimension is first scaled by
+  /// the width of its central 80% of training points, so that parameters
+  /// of very different sizes (say, dm^2 and theta) are treated evenly.
+  ///
+  /// The tree is built (and batches of points evaluated) using all
+  /// the threads of LocalThreadBudget().
+  class KNNRegressor
+  {
+    public:
+      /// \param columns   Training points: one column of values per dimension, all of equal length
+      /// \param targets   Value to regress at each training point
+      /// \param k         Number of neighbours to average over.  (Reduced if there aren't enough points.)
+      KNNRegressor(const std::vector<const std::vector<double>*> & columns,
+                   const std::vector<double> & targets,
+                   unsigned int k = 20);
+
+      /// Estimated target at \a point (which has one entry per dimension)
+      double Estimate(const std::vector<double> & point) const;
+
+      /// Estimated targets at many points at once, evaluated in parallel
+      std::vector<double> Estimate(const std::vector<std::vector<double>> & points) const;
+
+      unsigned int K() const { return fK; }
+      unsigned int NDims() const { return fScales.size(); }
+      std::size_t NPoints() const { return fTargets.size(); }
+
+      void SaveTo(TDirectory * dir, const std::string & name) const;
+      static std::unique_ptr<KNNRegressor> LoadFrom(TDirectory * dir, const std::string & name);
+
+    protected:
+      /// For LoadFrom()
+      KNNRegressor() = default;
+
+      /// Take over row-major (already scaled) points and their targets, and build the tree over them
+      void Build(std::vector<double> && points, std::vector<double> && targets);
+
+      /// Arrange fIdx[lo, hi) into a subtree.
+      /// If \a deferred is given, subtrees at depth \a maxDepth are left to be built later and listed there instead
+      void BuildNode(std::size_t lo, std::size_t hi,
+                     unsigned int depth = 0, unsigned int maxDepth = 0,
+                     std::vector<std::pair<std::size_t, std::size_t>> * deferred = nullptr);
+
+      /// (distance^2, index) pairs, kept as a max-heap
+      typedef std::vector<std::pair<double, std::size_t>> Heap_t;
+
+      /// Add the neighbours of \a q within subtree [lo, hi) to \a heap
+      void Search(const double * q, std::size_t lo, std::size_t hi, Heap_t & heap) const;
+
+      /// Estimate at \a point, reusing \a heap as scratch space
+      double Estimate(const double * point, Heap_t & heap) const;
+
+      unsigned int fK = 0;
+      std::vector<double> fScales;          ///< Per-dimension factor that the points are multiplied by
+      std::vector<double> fPoints;          ///< Scaled training points, row-major, in tree order
+      std::vector<double> fTargets;         ///< In tree order
+      std::vector<unsigned char> fSplitDim; ///< Dimension each interior node splits on, indexed like the points
+
+      std::vector<std::size_t> fIdx;        ///< Only used during Build()
+  };
+}
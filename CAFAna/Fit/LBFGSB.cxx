@@ -0,0 +1,333 @@
+#include "CAFAna/Fit/LBFGSB.h"
+
+#include "TDecompChol.h"
+#include "TMatrixDSym.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+namespace ana
+{
+  //----------------------------------------------------------------------
+  LBFGSB::LBFGSB(const ROOT::Math::IMultiGradFunction& func)
+    : fFunc(&func), fChi(0), fEdm(-1), fNCalls(0), fMemory(10)
+  {
+  }
+
+  //----------------------------------------------------------------------
+  LBFGSB::~LBFGSB()
+  {
+  }
+
+  //----------------------------------------------------------------------
+  bool LBFGSB::AddVariable(unsigned int ivar, const std::string& name,
+                           double val, double step, double lower, double upper)
+  {
+    if(ivar >= fVals.size()){
+      fNames.resize(ivar+1);
+      fVals.resize(ivar+1);
+      fErrs.resize(ivar+1);
+      fLower.resize(ivar+1, -std::numeric_limits<double>::infinity());
+      fUpper.resize(ivar+1, +std::numeric_limits<double>::infinity());
+    }
+    fNames[ivar] = name;
+    fVals[ivar] = val;
+    fErrs[ivar] = step;
+    fLower[ivar] = lower;
+    fUpper[ivar] = upper;
+    return true;
+  }
+
+  //----------------------------------------------------------------------
+  bool LBFGSB::SetVariable(unsigned int ivar, const std::string& name,
+                           double val, double step)
+  {
+    const double inf = std::numeric_limits<double>::infinity();
+    return AddVariable(ivar, name, val, step, -inf, +inf);
+  }
+
+  //----------------------------------------------------------------------
+  bool LBFGSB::SetLimitedVariable(unsigned int ivar, const std::string& name,
+                                  double val, double step,
+                                  double lower, double upper)
+  {
+    return AddVariable(ivar, name, val, step, lower, upper);
+  }
+
+  //----------------------------------------------------------------------
+  bool LBFGSB::SetLowerLimitedVariable(unsigned int ivar, const std::string& name,
+                                       double val, double step, double lower)
+  {
+    return AddVariable(ivar, name, val, step, lower, +std::numeric_limits<double>::infinity());
+  }
+
+  //----------------------------------------------------------------------
+  bool LBFGSB::SetUpperLimitedVariable(unsigned int ivar, const std::string& name,
+                                       double val, double step, double upper)
+  {
+    return AddVariable(ivar, name, val, step, -std::numeric_limits<double>::infinity(), upper);
+  }
+
+  //----------------------------------------------------------------------
+  std::string LBFGSB::VariableName(unsigned int ivar) const
+  {
+    return ivar < fNames.size() ? fNames[ivar] : "";
+  }
+
+  //----------------------------------------------------------------------
+  int LBFGSB::VariableIndex(const std::string& name) const
+  {
+    const auto it = std::find(fNames.begin(), fNames.end(), name);
+    return it == fNames.end() ? -1 : it - fNames.begin();
+  }
+
+  //----------------------------------------------------------------------
+  void LBFGSB::Project(std::vector<double>& x) const
+  {
+    for(unsigned int i = 0; i < x.size(); ++i)
+      x[i] = std::max(fLower[i], std::min(x[i], fUpper[i]));
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<double> LBFGSB::InvHessTimes(const std::vector<double>& v,
+                                           const std::vector<bool>& free) const
+  {
+    const unsigned int N = v.size();
+
+    auto dot = [&](const std::vector<double>& a, const std::vector<double>& b){
+      double ret = 0;
+      for(unsigned int i = 0; i < N; ++i) if(free[i]) ret += a[i]*b[i];
+      return ret;
+    };
+
+    std::vector<double> q = v;
+    for(unsigned int i = 0; i < N; ++i) if(!free[i]) q[i] = 0;
+
+    if(fHistory.empty()){
+      // No curvature information yet. Use the user's step sizes as the scale
+      for(unsigned int i = 0; i < N; ++i) q[i] *= fErrs[i]*fErrs[i];
+      return q;
+    }
+
+    // The standard two-loop recursion
+    std::vector<double> alpha(fHistory.size());
+    for(int k = fHistory.size()-1; k >= 0; --k){
+      const Pair& p = fHistory[k];
+      alpha[k] = p.rho * dot(p.s, q);
+      for(unsigned int i = 0; i < N; ++i) if(free[i]) q[i] -= alpha[k]*p.y[i];
+    }
+
+    const Pair& last = fHistory.back();
+    const double yy = dot(last.y, last.y);
+    const double gamma = yy > 0 ? dot(last.s, last.y)/yy : 1;
+    for(double& qi: q) qi *= gamma;
+
+    for(unsigned int k = 0; k < fHistory.size(); ++k){
+      const Pair& p = fHistory[k];
+      const double beta = p.rho * dot(p.y, q);
+      for(unsigned int i = 0; i < N; ++i) if(free[i]) q[i] += (alpha[k]-beta)*p.s[i];
+    }
+
+    return q;
+  }
+
+  //----------------------------------------------------------------------
+  bool LBFGSB::Minimize()
+  {
+    const unsigned int N = fVals.size();
+
+    fHistory.clear();
+    fCov.clear();
+    fNCalls = 0;
+    fEdm = -1;
+
+    std::vector<double>& x = fVals;
+    Project(x);
+
+    fChi = (*fFunc)(x.data());
+    std::vector<double> grad(N);
+    fFunc->Gradient(x.data(), grad.data());
+    fNCalls += 2;
+
+    // Same convention as MINUIT's migrad
+    const double edmMax = 0.002 * Tolerance() * ErrorDef();
+
+    bool converged = false;
+
+    for(unsigned int iter = 0; iter < MaxIterations() && fNCalls < MaxFunctionCalls(); ++iter){
+      // Parameters sitting on a bound with the gradient pushing them out are
+      // held there for this step
+      std::vector<bool> free(N);
+      for(unsigned int i = 0; i < N; ++i){
+        free[i] = !((x[i] <= fLower[i] && grad[i] > 0) ||
+                    (x[i] >= fUpper[i] && grad[i] < 0));
+      }
+
+      std::vector<double> dir = InvHessTimes(grad, free);
+      for(double& d: dir) d *= -1;
+
+      double slope = 0;
+      for(unsigned int i = 0; i < N; ++i) slope += grad[i]*dir[i];
+
+      if(slope >= 0){
+        // The curvature information has gone bad. Start again from scratch.
+        fHistory.clear();
+        dir = InvHessTimes(grad, free);
+        slope = 0;
+        for(unsigned int i = 0; i < N; ++i){
+          dir[i] *= -1;
+          slope += grad[i]*dir[i];
+        }
+      }
+
+      fEdm = -slope/2;
+      if(fEdm <= edmMax){
+        converged = true;
+        break;
+      }
+
+      // Backtracking line search along the projected path, with the Armijo
+      // condition
+      double step = 1;
+      std::vector<double> newx(N);
+      double newchi = 0;
+      bool accepted = false;
+      while(step > 1e-20){
+        for(unsigned int i = 0; i < N; ++i) newx[i] = x[i] + step*dir[i];
+        Project(newx);
+
+        double decrease = 0;
+        for(unsigned int i = 0; i < N; ++i) decrease += grad[i]*(newx[i]-x[i]);
+
+        newchi = (*fFunc)(newx.data());
+        ++fNCalls;
+
+        if(newchi <= fChi + 1e-4*decrease){
+          accepted = true;
+          break;
+        }
+        step /= 2;
+      }
+
+      if(!accepted){
+        // Can't make progress in a descent direction. Either we're already
+        // at the minimum to numerical precision, or the gradient is wrong.
+        converged = fHistory.empty();
+        if(!fHistory.empty()){
+          fHistory.clear();
+          continue;
+        }
+        break;
+      }
+
+      std::vector<double> newgrad(N);
+      fFunc->Gradient(newx.data(), newgrad.data());
+      ++fNCalls;
+
+      Pair p;
+      p.s.resize(N);
+      p.y.resize(N);
+      double sy = 0, ss = 0, yy = 0;
+      for(unsigned int i = 0; i < N; ++i){
+        p.s[i] = newx[i] - x[i];
+        p.y[i] = newgrad[i] - grad[i];
+        sy += p.s[i]*p.y[i];
+        ss += p.s[i]*p.s[i];
+        yy += p.y[i]*p.y[i];
+      }
+
+      // Only keep pairs that maintain a positive-definite approximation
+      if(sy > 1e-10*sqrt(ss*yy)){
+        p.rho = 1/sy;
+        fHistory.push_back(p);
+        if(fHistory.size() > fMemory) fHistory.pop_front();
+      }
+
+      const double oldchi = fChi;
+      x = newx;
+      grad = newgrad;
+      fChi = newchi;
+
+      // Stuck at the floating point limit
+      if(fabs(oldchi-fChi) <= Precision()*std::max(1., fabs(fChi))){
+        converged = true;
+        break;
+      }
+    }
+
+    // CovMatrix() may use the current errors, so don't overwrite them until
+    // all the new ones are known
+    std::vector<double> errs(N);
+    for(unsigned int i = 0; i < N; ++i) errs[i] = sqrt(CovMatrix(i, i));
+    fErrs = errs;
+
+    // Same convention as MINUIT, zero is success
+    fStatus = converged ? 0 : 1;
+
+    if(!converged && PrintLevel() > 0){
+      std::cout << "LBFGSB: not converged after " << fNCalls
+                << " calls, edm = " << fEdm << std::endl;
+    }
+
+    return converged;
+  }
+
+  //----------------------------------------------------------------------
+  bool LBFGSB::Hesse()
+  {
+    if(!fHessFunc){
+      std::cerr << "LBFGSB: no Hessian function set. Keeping the limited-memory errors" << std::endl;
+      fStatus += 100;
+      return false;
+    }
+
+    const unsigned int N = fVals.size();
+    std::vector<double> hess(N*N);
+    if(!fHessFunc(fVals, hess.data())){
+      fStatus += 100;
+      return false;
+    }
+
+    TMatrixDSym H(N);
+    for(unsigned int i = 0; i < N; ++i)
+      for(unsigned int j = 0; j < N; ++j) H(i, j) = hess[i*N+j];
+
+    TDecompChol chol(H);
+    bool ok = chol.Decompose();
+    const TMatrixDSym Hinv = ok ? chol.Invert(ok) : TMatrixDSym(N);
+    if(!ok){
+      std::cerr << "LBFGSB: Hessian isn't positive-definite at the minimum. "
+                << "Keeping the limited-memory errors" << std::endl;
+      fStatus += 100;
+      return false;
+    }
+
+    // The Hessian of chisq is twice the inverse covariance, for ErrorDef 1
+    fCov.resize(N*N);
+    for(unsigned int i = 0; i < N; ++i)
+      for(unsigned int j = 0; j < N; ++j) fCov[i*N+j] = 2 * ErrorDef() * Hinv(i, j);
+
+    for(unsigned int i = 0; i < N; ++i) fErrs[i] = sqrt(fCov[i*N+i]);
+
+    return true;
+  }
+
+  //----------------------------------------------------------------------
+  double LBFGSB::CovMatrix(unsigned int i, unsigned int j) const
+  {
+    const unsigned int N = fVals.size();
+    if(!fCov.empty()) return fCov[i*N+j];
+
+    // No curvature information, so the errors as given are all there is.
+    // Going via InvHessTimes() would double the variance every time.
+    if(fHistory.empty()) return i == j ? fErrs[i]*fErrs[i] : 0;
+
+    std::vector<double> e(N);
+    e[j] = 1;
+
+    // The Hessian of chisq is twice the inverse covariance, for ErrorDef 1
+    return 2 * ErrorDef() * InvHessTimes(e, std::vector<bool>(N, true))[i];
+  }
+}
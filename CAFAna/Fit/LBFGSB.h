@@ -0,0 +1,99 @@
+#pragma once
+
+#include "Math/Minimizer.h"
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace ana
+{
+  /// \brief Limited-memory BFGS minimizer respecting bounds on the
+  /// parameters
+  ///
+  /// Each step is a quasi-Newton step over the parameters that are not
+  /// pinned at a bound, followed by a backtracking line search along the path
+  /// projected back into the allowed box. This avoids MINUIT's dense
+  /// covariance bookkeeping, which dominates when gradients are cheap. The
+  /// errors are estimated from the limited-memory inverse Hessian, unless
+  /// \ref Hesse is run afterwards.
+  class LBFGSB: public ROOT::Math::Minimizer
+  {
+  public:
+    LBFGSB(const ROOT::Math::IMultiGradFunction& func);
+
+    virtual ~LBFGSB();
+
+    void SetFunction(const ROOT::Math::IMultiGradFunction& func) override {fFunc = &func;}
+    void SetFunction(const ROOT::Math::IMultiGenFunction& func) override {abort();}
+
+    virtual bool SetVariable(unsigned int ivar, const std::string& name, double val, double step) override;
+    virtual bool SetLimitedVariable(unsigned int ivar, const std::string& name, double val, double step, double lower, double upper) override;
+    virtual bool SetLowerLimitedVariable(unsigned int ivar, const std::string& name, double val, double step, double lower) override;
+    virtual bool SetUpperLimitedVariable(unsigned int ivar, const std::string& name, double val, double step, double upper) override;
+
+    virtual bool Minimize() override;
+
+    virtual double MinValue() const override {return fChi;}
+    virtual const double* X() const override {return fVals.data();}
+    virtual const double* Errors() const override {return fErrs.data();}
+    virtual unsigned int NDim() const override {return fVals.size();}
+    virtual unsigned int NFree() const override {return fVals.size();}
+    virtual double Edm() const override {return fEdm;}
+    virtual unsigned int NCalls() const override {return fNCalls;}
+    virtual bool ProvidesError() const override {return true;}
+    virtual double CovMatrix(unsigned int i, unsigned int j) const override;
+
+    virtual std::string VariableName(unsigned int ivar) const override;
+    virtual int VariableIndex(const std::string& name) const override;
+
+    /// Number of correction pairs to remember (default 10)
+    void SetMemory(unsigned int m) {fMemory = m;}
+
+    /// Function filling the Hessian at a point, row-major. Needed for \ref Hesse
+    void SetHessian(const std::function<bool(const std::vector<double>&, double*)>& hess) {fHessFunc = hess;}
+
+    /// Replace the limited-memory error estimates with the inverse of the
+    /// full Hessian at the minimum, from the function given to \ref SetHessian
+    ///
+    /// As for MINUIT, a failure adds 100 to \ref Status
+    virtual bool Hesse() override;
+
+  protected:
+    /// Apply the current inverse Hessian approximation to \a v, only in the
+    /// subspace where \a free is set
+    std::vector<double> InvHessTimes(const std::vector<double>& v,
+                                     const std::vector<bool>& free) const;
+
+    /// Clamp \a x into the allowed box
+    void Project(std::vector<double>& x) const;
+
+    bool AddVariable(unsigned int ivar, const std::string& name,
+                     double val, double step, double lower, double upper);
+
+    const ROOT::Math::IMultiGradFunction* fFunc;
+
+    std::vector<std::string> fNames;
+    std::vector<double> fVals;
+    std::vector<double> fErrs;
+    std::vector<double> fLower, fUpper;
+    double fChi;
+    double fEdm;
+    unsigned int fNCalls;
+
+    unsigned int fMemory;
+
+    std::function<bool(const std::vector<double>&, double*)> fHessFunc;
+    /// Row-major covariance from \ref Hesse, empty if it hasn't been run
+    std::vector<double> fCov;
+
+    /// Correction pairs, most recent last
+    struct Pair
+    {
+      std::vector<double> s, y;
+      double rho;
+    };
+    std::deque<Pair> fHistory;
+  };
+}
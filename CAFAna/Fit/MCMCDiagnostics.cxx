@@ -0,0 +1,328 @@
+#include "CAFAna/Fit/MCMCDiagnostics.h"
+
+#include "Math/QuantFuncMathCore.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <numeric>
+
+namespace ana
+{
+  namespace mcmcdiag
+  {
+    namespace
+    {
+      /// In-place radix-2 FFT.  \a a must have a power-of-two length
+      void FFT(std::vector<std::complex<double>> & a, bool inverse)
+      {
+        const std::size_t n = a.size();
+
+        // bit-reversal permutation
+        for (std::size_t i = 1, j = 0; i < n; i++)
+        {
+          std::size_t bit = n >> 1;
+          for (; j & bit; bit >>= 1)
+            j ^= bit;
+          j ^= bit;
+          if (i < j)
+            std::swap(a[i], a[j]);
+        }
+
+        for (std::size_t len = 2; len <= n; len <<= 1)
+        {
+          const double ang = 2 * M_PI / len * (inverse ? 1 : -1);
+          const std::complex<double> wlen(cos(ang), sin(ang));
+          for (std::size_t i = 0; i < n; i += len)
+          {
+            std::complex<double> w(1);
+            for (std::size_t j = 0; j < len / 2; j++)
+            {
+              const std::complex<double> u = a[i + j];
+              const std::complex<double> v = a[i + j + len / 2] * w;
+              a[i + j] = u + v;
+              a[i + j + len / 2] = u - v;
+              w *= wlen;
+            }
+          }
+        }
+      }
+
+      /// Shortest chain length
+      std::size_t MinLength(const std::vector<std::vector<double>> & chains)
+      {
+        std::size_t n = chains.empty() ? 0 : chains[0].size();
+        for (const auto & chain : chains)
+          n = std::min(n, chain.size());
+        return n;
+      }
+
+      /// Sample mean and (N-1) variance of the first \a n entries of \a x
+      std::pair<double, double> MeanVar(const std::vector<double> & x, std::size_t n)
+      {
+        const double mean = std::accumulate(x.begin(), x.begin() + n, 0.) / n;
+        double var = 0;
+        for (std::size_t i = 0; i < n; i++)
+          var += (x[i] - mean) * (x[i] - mean);
+        return {mean, var / (n - 1)};
+      }
+
+      /// All the draws of all the chains together
+      std::vector<double> Pool(const std::vector<std::vector<double>> & chains)
+      {
+        std::vector<double> pooled;
+        for (const auto & chain : chains)
+          pooled.insert(pooled.end(), chain.begin(), chain.end());
+        return pooled;
+      }
+
+      /// Quantile of \a sorted, interpolating linearly between entries
+      double Quantile(const std::vector<double> & sorted, double q)
+      {
+        const double pos = q * (sorted.size() - 1);
+        const std::size_t lo = std::size_t(pos);
+        if (lo + 1 >= sorted.size())
+          return sorted.back();
+        return sorted[lo] + (pos - lo) * (sorted[lo + 1] - sorted[lo]);
+      }
+    }
+
+    //----------------------------------------------------------------------
+    std::vector<double> Autocovariance(const std::vector<double> & x)
+    {
+      const std::size_t n = x.size();
+      if (n == 0)
+        return {};
+
+      // pad to at least twice the length so that the circular correlation doesn't wrap around
+      std::size_t nPad = 1;
+      while (nPad < 2 * n)
+        nPad <<= 1;
+
+      const double mean = std::accumulate(x.begin(), x.end(), 0.) / n;
+      std::vector<std::complex<double>> freq(nPad, 0.);
+      for (std::size_t i = 0; i < n; i++)
+        freq[i] = x[i] - mean;
+
+      FFT(freq, false);
+      for (auto & f : freq)
+        f = std::norm(f);
+      FFT(freq, true);
+
+      std::vector<double> acov(n);
+      for (std::size_t lag = 0; lag < n; lag++)
+        acov[lag] = freq[lag].real() / nPad / n;
+      return acov;
+    }
+
+    //----------------------------------------------------------------------
+    std::vector<double> Autocorrelation(const std::vector<double> & x)
+    {
+      std::vector<double> acor = Autocovariance(x);
+      if (acor.empty() || acor[0] == 0)
+        return acor;
+
+      const double var = acor[0];
+      for (auto & a : acor)
+        a /= var;
+      return acor;
+    }
+
+    //----------------------------------------------------------------------
+    double EffectiveSampleSize(const std::vector<std::vector<double>> & chains)
+    {
+      const std::size_t nChains = chains.size();
+      const std::size_t n = MinLength(chains);
+      if (nChains == 0 || n < 4)
+        return std::numeric_limits<double>::quiet_NaN();
+
+      std::vector<std::vector<double>> acovs;
+      std::vector<double> chainMeans, chainVars;
+      for (const auto & chain : chains)
+      {
+        const std::vector<double> draws(chain.begin(), chain.begin() + n);
+        acovs.push_back(Autocovariance(draws));
+        chainMeans.push_back(std::accumulate(draws.begin(), draws.end(), 0.) / n);
+        chainVars.push_back(acovs.back()[0] * n / (n - 1.));
+      }
+
+      const double meanVar = std::accumulate(chainVars.begin(), chainVars.end(), 0.) / nChains;
+      double varPlus = meanVar * (n - 1.) / n;
+      if (nChains > 1)
+        varPlus += MeanVar(chainMeans, nChains).second;
+      if (!(varPlus > 0))
+        return std::numeric_limits<double>::quiet_NaN();
+
+      // autocorrelation at lag t, combined over the chains
+      auto Rho = [&](std::size_t t)
+      {
+        double meanAcov = 0;
+        for (const auto & acov : acovs)
+          meanAcov += acov[t];
+        meanAcov /= nChains;
+        return 1 - (meanVar - meanAcov) / varPlus;
+      };
+
+      // Geyer's initial positive sequence: sum pairs of lags while the pair sums stay positive...
+      std::vector<double> rho(n, 0.);
+      rho[0] = 1;
+      double rhoEven = 1;
+      double rhoOdd = Rho(1);
+      rho[1] = rhoOdd;
+      std::size_t t = 1;
+      while (t + 5 < n && rhoEven + rhoOdd > 0)
+      {
+        rhoEven = Rho(t + 1);
+        rhoOdd = Rho(t + 2);
+        if (rhoEven + rhoOdd >= 0)
+        {
+          rho[t + 1] = rhoEven;
+          rho[t + 2] = rhoOdd;
+        }
+        t += 2;
+      }
+      const std::size_t maxT = t;
+      if (rhoEven > 0)
+        rho[maxT + 1] = rhoEven;
+
+      // ... and make them monotonically decreasing
+      for (t = 1; t + 3 <= maxT; t += 2)
+      {
+        if (rho[t + 1] + rho[t + 2] > rho[t - 1] + rho[t])
+        {
+          rho[t + 1] = (rho[t - 1] + rho[t]) / 2;
+          rho[t + 2] = rho[t + 1];
+        }
+      }
+
+      const double nTotal = double(nChains) * n;
+      double tau = -1 + 2 * std::accumulate(rho.begin(), rho.begin() + maxT, 0.) + rho[maxT + 1];
+      // the estimate can't go arbitrarily far beyond nTotal for antithetic chains
+      tau = std::max(tau, 1 / std::log10(nTotal));
+      return nTotal / tau;
+    }
+
+    //----------------------------------------------------------------------
+    double RHat(const std::vector<std::vector<double>> & chains)
+    {
+      const std::size_t nChains = chains.size();
+      const std::size_t n = MinLength(chains);
+      if (nChains < 2 || n < 2)
+        return std::numeric_limits<double>::quiet_NaN();
+
+      std::vector<double> chainMeans, chainVars;
+      for (const auto & chain : chains)
+      {
+        const auto meanVar = MeanVar(chain, n);
+        chainMeans.push_back(meanVar.first);
+        chainVars.push_back(meanVar.second);
+      }
+
+      const double betweenOverN = MeanVar(chainMeans, nChains).second;
+      const double within = std::accumulate(chainVars.begin(), chainVars.end(), 0.) / nChains;
+      const double varHat = (n - 1.) / n * within + betweenOverN;
+      return std::sqrt(varHat / within);
+    }
+
+    //----------------------------------------------------------------------
+    std::vector<std::vector<double>> SplitChains(const std::vector<std::vector<double>> & chains)
+    {
+      // (with an odd number of draws, the middle one is dropped)
+      const std::size_t half = MinLength(chains) / 2;
+      std::vector<std::vector<double>> split;
+      for (const auto & chain : chains)
+      {
+        split.emplace_back(chain.begin(), chain.begin() + half);
+        split.emplace_back(chain.end() - half, chain.end());
+      }
+      return split;
+    }
+
+    //----------------------------------------------------------------------
+    std::vector<std::vector<double>> RankNormalize(const std::vector<std::vector<double>> & chains)
+    {
+      const std::vector<double> pooled = Pool(chains);
+      const std::size_t nTotal = pooled.size();
+
+      std::vector<std::size_t> order(nTotal);
+      std::iota(order.begin(), order.end(), 0);
+      std::sort(order.begin(), order.end(),
+                [&pooled](std::size_t a, std::size_t b) { return pooled[a] < pooled[b]; });
+
+      // ties all get the average of their ranks
+      std::vector<double> z(nTotal);
+      for (std::size_t start = 0; start < nTotal;)
+      {
+        std::size_t end = start + 1;
+        while (end < nTotal && pooled[order[end]] == pooled[order[start]])
+          end++;
+        const double rank = (start + 1 + end) / 2.;
+        const double normal = ROOT::Math::normal_quantile((rank - 0.375) / (nTotal + 0.25), 1);
+        for (std::size_t i = start; i < end; i++)
+          z[order[i]] = normal;
+        start = end;
+      }
+
+      std::vector<std::vector<double>> ret;
+      std::size_t offset = 0;
+      for (const auto & chain : chains)
+      {
+        ret.emplace_back(z.begin() + offset, z.begin() + offset + chain.size());
+        offset += chain.size();
+      }
+      return ret;
+    }
+
+    //----------------------------------------------------------------------
+    double BulkESS(const std::vector<std::vector<double>> & chains)
+    {
+      return EffectiveSampleSize(RankNormalize(SplitChains(chains)));
+    }
+
+    //----------------------------------------------------------------------
+    double TailESS(const std::vector<std::vector<double>> & chains)
+    {
+      const auto split = SplitChains(chains);
+      std::vector<double> sorted = Pool(split);
+      if (sorted.empty())
+        return std::numeric_limits<double>::quiet_NaN();
+      std::sort(sorted.begin(), sorted.end());
+
+      auto QuantileESS = [&split](double cut)
+      {
+        std::vector<std::vector<double>> below;
+        for (const auto & chain : split)
+        {
+          below.emplace_back(chain.size());
+          std::transform(chain.begin(), chain.end(), below.back().begin(),
+                         [cut](double x) { return x <= cut ? 1. : 0.; });
+        }
+        return EffectiveSampleSize(below);
+      };
+
+      return std::min(QuantileESS(Quantile(sorted, 0.05)), QuantileESS(Quantile(sorted, 0.95)));
+    }
+
+    //----------------------------------------------------------------------
+    double RankNormalizedSplitRHat(const std::vector<std::vector<double>> & chains)
+    {
+      const auto split = SplitChains(chains);
+      std::vector<double> sorted = Pool(split);
+      if (sorted.empty())
+        return std::numeric_limits<double>::quiet_NaN();
+      std::sort(sorted.begin(), sorted.end());
+      const double median = Quantile(sorted, 0.5);
+
+      // folding about the median shows up chains that differ in their spread
+      auto folded = split;
+      for (auto & chain : folded)
+      {
+        for (auto & x : chain)
+          x = std::abs(x - median);
+      }
+
+      return std::max(RHat(RankNormalize(split)), RHat(RankNormalize(folded)));
+    }
+  }
+}
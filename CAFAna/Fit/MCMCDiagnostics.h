@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace ana
+{
+  /// Convergence diagnostics for one sampled parameter.  See MCMCSamples::ParamDiagnostics()
+  struct MCMCParamDiagnostics
+  {
+    std::string name;
+    double essBulk;       ///< Effective sample size of the rank-normalized draws (how well the bulk is explored)
+    double essTail;       ///< Lesser ESS of the 5% and 95% quantiles (how well the tails are explored)
+    double rHat;          ///< Rank-normalized split R-hat.  Should be close to 1
+    double autocorrTime;  ///< Integrated autocorrelation time of the raw draws, in samples
+  };
+
+  /// \brief MCMC convergence diagnostics
+  ///
+  /// These follow Vehtari et al., "Rank-normalization, folding, and localization:
+  /// An improved R-hat for assessing convergence of MCMC" (arXiv:1903.08008),
+  /// which is what Stan itself uses.  Every function takes one vector of draws per chain.
+  /// Chains of unequal lengths are truncated to the shortest.
+  namespace mcmcdiag
+  {
+    /// Autocovariance of \a x at every lag, computed with an FFT
+    std::vector<double> Autocovariance(const std::vector<double> & x);
+
+    /// Autocorrelation of \a x at every lag (Autocovariance() normalized to lag 0)
+    std::vector<double> Autocorrelation(const std::vector<double> & x);
+
+    /// Effective sample size, using Geyer's initial monotone sequence to truncate the autocorrelations.
+    /// NaN if there are fewer than 4 draws per chain or the draws are all the same
+    double EffectiveSampleSize(const std::vector<std::vector<double>> & chains);
+
+    /// Gelman-Rubin potential scale reduction of the chains as given (ie unsplit)
+    double RHat(const std::vector<std::vector<double>> & chains);
+
+    /// Each chain cut into its first and second halves, so that trends within a chain show up
+    std::vector<std::vector<double>> SplitChains(const std::vector<std::vector<double>> & chains);
+
+    /// Replace the draws by the normal quantiles of their ranks over all the chains
+    std::vector<std::vector<double>> RankNormalize(const std::vector<std::vector<double>> & chains);
+
+    /// EffectiveSampleSize() of the rank-normalized split chains
+    double BulkESS(const std::vector<std::vector<double>> & chains);
+
+    /// Lesser EffectiveSampleSize() of the indicators for being below the 5% and 95% quantiles
+    double TailESS(const std::vector<std::vector<double>> & chains);
+
+    /// Larger of the R-hats of the rank-normalized split chains and of their folded (|x - median|) versions
+    double RankNormalizedSplitRHat(const std::vector<std::vector<double>> & chains);
+  }
+}
@@ -0,0 +1,136 @@
+#include "CAFAna/Fit/MCMCSampleStreamer.h"
+
+#include "CAFAna/Fit/MCMCSamples.h"
+
+#include "TFile.h"
+#include "TROOT.h"
+#include "TTree.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace ana
+{
+  namespace
+  {
+    /// How many jobs may be waiting before WriteChunk() blocks
+    const std::size_t kMaxQueued = 4;
+  }
+
+  //----------------------------------------------------------------------
+  MCMCSampleStreamer::MCMCSampleStreamer(const std::string & fileName, std::size_t chunkSize)
+    : fChunkSize(std::max(chunkSize, std::size_t(1))), fBusy(false), fStop(false)
+  {
+    // the file is only touched by the writer thread from here on,
+    // but that's alongside whatever ROOT is doing in the others
+    ROOT::EnableThreadSafety();
+
+    fFile.reset(TFile::Open(fileName.c_str(), "RECREATE"));
+    if (!fFile || fFile->IsZombie())
+    {
+      std::cout << "MCMCSampleStreamer: couldn't open " << fileName << " for writing" << std::endl;
+      abort();
+    }
+
+    fThread = std::thread(&MCMCSampleStreamer::WriterLoop, this);
+  }
+
+  //----------------------------------------------------------------------
+  MCMCSampleStreamer::~MCMCSampleStreamer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fStop = true;
+    }
+    fWake.notify_all();
+    fThread.join();
+
+    fFile->Close();
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSampleStreamer::WriteChunk(const std::string & dirName, std::unique_ptr<MCMCSamples> chunk)
+  {
+    Enqueue(Job{dirName, std::move(chunk), false});
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSampleStreamer::WriteTrailer(const std::string & dirName, std::unique_ptr<MCMCSamples> trailer)
+  {
+    Enqueue(Job{dirName, std::move(trailer), true});
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSampleStreamer::Sync()
+  {
+    std::unique_lock<std::mutex> lock(fMutex);
+    fDone.wait(lock, [this]{return fQueue.empty() && !fBusy;});
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSampleStreamer::Enqueue(Job && job)
+  {
+    {
+      std::unique_lock<std::mutex> lock(fMutex);
+      fDone.wait(lock, [this]{return fQueue.size() < kMaxQueued;});
+      fQueue.push_back(std::move(job));
+    }
+    fWake.notify_one();
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSampleStreamer::WriterLoop()
+  {
+    while (true)
+    {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(fMutex);
+        fWake.wait(lock, [this]{return fStop || !fQueue.empty();});
+        // drain the queue before stopping
+        if (fQueue.empty())
+          return;
+        job = std::move(fQueue.front());
+        fQueue.pop_front();
+        fBusy = true;
+      }
+      fDone.notify_all();
+
+      Write(job);
+      job.samples.reset();
+
+      {
+        std::lock_guard<std::mutex> lock(fMutex);
+        fBusy = false;
+      }
+      fDone.notify_all();
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSampleStreamer::Write(Job & job)
+  {
+    TDirectory * dir = fFile->GetDirectory(job.dirName.c_str());
+    if (!dir)
+    {
+      // written up front so that even a file from a killed job can be loaded
+      dir = fFile->mkdir(job.dirName.c_str());
+      dir->cd();
+      job.samples->WriteNames(dir);
+    }
+    dir->cd();
+
+    if (job.trailer)
+      job.samples->WriteTrailer(dir);
+    else
+    {
+      auto tree = job.samples->BuildTree(dir);
+      tree->Write(("samples_" + std::to_string(fNChunks[job.dirName]++)).c_str());
+    }
+
+    // make sure the directory structure is on disk too, not just the data
+    dir->SaveSelf(true);
+    fFile->SaveSelf(true);
+    fFile->Flush();
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class TFile;
+
+namespace ana
+{
+  class MCMCSamples;
+
+  /// \brief Writes MCMC samples out to a file in chunks, from a background thread
+  ///
+  /// Attach to an MCMCSamples with MCMCSamples::StreamTo().  Every
+  /// \ref ChunkSize() samples, the MCMCSamples hands its parameter values over
+  /// to be written as a new TTree ("samples_0", "samples_1", ...) in its
+  /// directory of the output file.  The file is flushed after each one, so a
+  /// job that's killed keeps what it had sampled so far.
+  /// MCMCSamples::LoadFrom() reads the chunks back (in parallel).
+  ///
+  /// Several MCMCSamples (eg warmup and samples, or the chains of a
+  /// multi-chain fit) can share one streamer.
+  class MCMCSampleStreamer
+  {
+    public:
+      /// \param fileName   File to write to.  Will be overwritten
+      /// \param chunkSize  Number of samples per chunk
+      MCMCSampleStreamer(const std::string & fileName, std::size_t chunkSize = 1000);
+
+      /// Finishes writing anything that's queued, then closes the file
+      ~MCMCSampleStreamer();
+
+      MCMCSampleStreamer(const MCMCSampleStreamer&) = delete;
+      MCMCSampleStreamer& operator=(const MCMCSampleStreamer&) = delete;
+
+      std::size_t ChunkSize() const { return fChunkSize; }
+
+      /// Queue \a chunk to be written to directory \a dirName.
+      /// Blocks while too many chunks are already waiting, so that memory use stays bounded
+      void WriteChunk(const std::string & dirName, std::unique_ptr<MCMCSamples> chunk);
+
+      /// Queue the hyperparameters and sampling time of \a trailer to be written to directory \a dirName
+      void WriteTrailer(const std::string & dirName, std::unique_ptr<MCMCSamples> trailer);
+
+      /// Wait until everything queued so far is on disk
+      void Sync();
+
+    protected:
+      struct Job
+      {
+        std::string dirName;
+        std::unique_ptr<MCMCSamples> samples;
+        bool trailer;
+      };
+
+      void Enqueue(Job && job);
+      void WriterLoop();
+      void Write(Job & job);
+
+      std::unique_ptr<TFile> fFile;
+      std::size_t fChunkSize;
+      std::map<std::string, unsigned int> fNChunks; ///< Chunks written so far, by directory.  Writer thread only
+
+      std::mutex fMutex;
+      std::condition_variable fWake, fDone;
+
+      // protected by fMutex
+      std::deque<Job> fQueue;
+      bool fBusy;
+      bool fStop;
+
+      std::thread fThread;
+  };
+}
@@ -1,45 +1,59 @@
+#include <algorithm>
+#include <iomanip>
 #include <limits>
+#include <mutex>
+#include <numeric>
 #include <string>
 #include <vector>
 
+#include "TFile.h"
 #include "TH1D.h"
 #include "TKey.h"
 #include "TObjString.h"
 #include "TParameter.h"
+#include "TROOT.h"
 
 #include "CAFAna/Core/IFitVar.h"
 #include "CAFAna/Core/ISyst.h"
 #include "CAFAna/Core/Utilities.h"
+#include "CAFAna/Core/WorkerPool.h"
 
 #include "CAFAna/Fit/Bayesian1DMarginal.h"
 #include "CAFAna/Fit/BayesianSurface.h"
 #include "CAFAna/Fit/MCMCSamples.h"
+#include "CAFAna/Fit/MCMCSampleStreamer.h"
 
 #include "CAFAna/Core/MathUtil.h"
 
-// an internal tool only
-namespace
+namespace ana
 {
-  class BranchStatusResetter
+  namespace
   {
-    public:
-      BranchStatusResetter(TTree * tree)
-        : fTree(tree)
-      {}
+    /// Position of \a quantile in the samples sorted by ascending LL.
+    /// (size - 1 so that we don't fall off the edge at Q=0)
+    std::size_t QuantileRank(double quantile, std::size_t nSamples)
+    {
+      assert(nSamples > 0 && quantile >= 0 && quantile <= 1);
+      return std::size_t((1 - quantile) * (nSamples - 1));
+    }
 
-      ~BranchStatusResetter()
+    /// Orders sample indices by ascending LL (ties by index, so that selecting and sorting agree)
+    auto LLOrder(const std::vector<double> & LLs)
+    {
+      return [&LLs](std::size_t a, std::size_t b)
       {
-        if (fTree)
-          fTree->SetBranchStatus("*", false);
-      }
-    private:
-      TTree * fTree;
-  };
-}
+        return LLs[a] < LLs[b] || (LLs[a] == LLs[b] && a < b);
+      };
+    }
+
+    /// Guards what MCMCSamples builds lazily in its const methods (the best-fit
+    /// index and the sorted LLs), which may be called from several threads
+    /// at once.  Shared by all of them so that MCMCSamples stays movable.
+    std::mutex gLazyMutex;
+  }
 
-namespace ana
-{
   const std::string MCMCSamples::LOGLIKELIHOOD_BRANCH_NAME = "logprob";
+  const std::string MCMCSamples::CHAIN_BRANCH_NAME = "chain__";
 
   //----------------------------------------------------------------------
   MCMCSamples::MCMCSamples(const std::vector<const IFitVar *> &vars,
@@ -47,118 +61,78 @@ namespace ana
     : fOffset(0),
       fVars(vars),
       fSysts(systs),
-      fBestFitFound(false),
-      fSamples(std::make_unique<TTree>("samples", "MCMC samples"))
+      fBestFitFound(false)
   {}
 
   //----------------------------------------------------------------------
   MCMCSamples::MCMCSamples(std::size_t offset, const std::vector<std::string> &diagBranchNames,
                            const std::vector<const IFitVar *> &vars, const std::vector<const ana::ISyst *> &systs,
-                           std::unique_ptr<TTree> &tree, const Hyperparameters &hyperParams, double samplingTime)
+                           TTree &tree, const Hyperparameters &hyperParams, double samplingTime)
     : fOffset(offset),
       fDiagBranches(diagBranchNames),
       fVars(vars),
       fSysts(systs),
       fBestFitFound(false),
-      fSamples(std::move(tree)),
       fHyperparams(hyperParams),
       fSamplingTime(samplingTime)
   {
-    // note: SetupTree() takes care of fDiagnosticVals and fEntryVals
-    SetupTree();
+    SetupColumns();
+    FillFromTree(tree);
   }
 
   //----------------------------------------------------------------------
-  MCMCSamples::MCMCSamples(MCMCSamples &&other)
-      : fOffset(std::move(other.fOffset)),
-        fDiagBranches(std::move(other.fDiagBranches)),
-        fVars(std::move(other.fVars)),
-        fSysts(std::move(other.fSysts)),
-        fBestFitSampleIdx(std::move(other.fBestFitSampleIdx)),
-        fBestFitFound(std::move(other.fBestFitFound)),
-        fSamples(std::move(other.fSamples)),
-        fEntryLL(std::move(other.fEntryLL)),
-        fEntryVals(std::move(other.fEntryVals)),
-        fDiagnosticVals(std::move(other.fDiagnosticVals)),
-        fHyperparams(std::move(other.fHyperparams)),
-        fSamplingTime(std::move(other.fSamplingTime))
+  MCMCSamples::~MCMCSamples()
   {
-    // note: SetupTree() takes care of fDiagnosticVals and fEntryVals
-    SetupTree();
-
-    // almost certainly we don't want to be writing back to whatever file this may have come from ...
-    fSamples->SetDirectory(nullptr);
+    CloseStream();
   }
 
   //----------------------------------------------------------------------
-  MCMCSamples &MCMCSamples::operator=(MCMCSamples &&other)
+  void MCMCSamples::AddSample(const std::vector<double> &sample)
   {
-    fOffset = std::move(other.fOffset);
-
-    fVars = std::move(other.fVars);
-    fSysts = std::move(other.fSysts);
-
-    fBestFitSampleIdx = std::move(other.fBestFitSampleIdx);
-    fBestFitFound = std::move(other.fBestFitFound);
-
-    fSamples = std::move(other.fSamples);
-
-    fEntryLL = std::move(other.fEntryLL);
-    fDiagBranches = std::move(other.fDiagBranches);
-
-    fDiagnosticVals = std::move(other.fDiagnosticVals);
-    fEntryVals = std::move(other.fEntryVals);
+    assert(sample.size() == fOffset + fEntryVals.size());
 
-    fHyperparams = std::move(other.fHyperparams);
-    fSamplingTime = std::move(other.fSamplingTime);
-
-    // note: SetupTree() takes care of fDiagnosticVals and fEntryVals
-    SetupTree();
+    fLLs.push_back(sample[0]);
+    for (std::size_t idx = 1; idx < fOffset; idx++)
+      fDiagnosticVals[idx - 1].push_back(sample[idx]);
+    for (std::size_t targetIdx = 0, sourceIdx = fOffset; sourceIdx < sample.size(); targetIdx++, sourceIdx++)
+      fEntryVals[targetIdx].push_back(sample[sourceIdx]);
 
-    return *this;
-  }
+    fBestFitFound = false;
+    fSortedLLIdx.clear();
+    fTree.reset();
 
-  //----------------------------------------------------------------------
-  void MCMCSamples::AddSample(const std::vector<double> &sample)
-  {
-//    std::cout << "\nGot sample: ";
-//    for (const auto & s: sample)
-//      std::cout << s << " ";
-//    std::cout << std::endl;
-//    std::cout << "sample size: " << sample.size() << std::endl;
-//    std::cout << " target size = LL (1) + diagVals (" << fDiagnosticVals.size() << ") + entryVals (" << fEntryVals.size() << ")" << std::endl;
-    fEntryLL = sample[0];
-    for (std::size_t idx = 1; idx < fOffset && idx < sample.size(); idx++)
-    {
-      assert(idx-1 < fDiagnosticVals.size());
-      fDiagnosticVals[idx - 1] = sample[idx];
-    }
-    for (std::size_t targetIdx = 0, sourceIdx = fOffset; sourceIdx < sample.size(); targetIdx++, sourceIdx++)
-    {
-      assert(targetIdx < fEntryVals.size());
-      fEntryVals[targetIdx] = sample[sourceIdx];
-    }
-    fSamples->Fill();
-//    fSamples->Scan("*");
+    if (fStreamer && fLLs.size() - fNStreamed >= fStreamer->ChunkSize())
+      fStreamer->WriteChunk(fStreamName, TakeChunk());
   }
 
   //----------------------------------------------------------------------
   void MCMCSamples::AdoptSamples(MCMCSamples && other)
   {
-    // if we don't have any samples at all, then just swap
-    if (!fSamples || (fDiagBranches.size() + fVars.size() + fSysts.size()) == 0)
+    // if we don't have any samples (or even the names of the diagnostics) yet, then just take over
+    if (fOffset == 0 && NumSamples() == 0)
     {
-      this->fSamples.reset(other.fSamples->CloneTree());
-      this->fDiagBranches = other.fDiagBranches;
-      this->fVars = other.fVars;
-      this->fSysts = other.fSysts;
-      //SetupTree();
-
-      // make sure we extract this guy out of his old directory, if any,
-      // otherwise he wants to write back to that file
-      this->fSamples->LoadBaskets();
-      this->fSamples->SetDirectory(nullptr);
-
+      fOffset = other.fOffset;
+      fDiagBranches = std::move(other.fDiagBranches);
+      fVars = std::move(other.fVars);
+      fSysts = std::move(other.fSysts);
+      fLLs = std::move(other.fLLs);
+      fDiagnosticVals = std::move(other.fDiagnosticVals);
+      fEntryVals = std::move(other.fEntryVals);
+
+      // a streaming MCMCSamples hands its stream over too
+      fStreamer = std::move(other.fStreamer);
+      fStreamName = std::move(other.fStreamName);
+      fNStreamed = other.fNStreamed;
+      fBestStreamed = std::move(other.fBestStreamed);
+      fBestStreamedIdx = other.fBestStreamedIdx;
+      fLastStreamed = std::move(other.fLastStreamed);
+
+      other.fOffset = 0;
+      other.Clear();
+
+      fBestFitFound = false;
+      fSortedLLIdx.clear();
+      fTree.reset();
       return;
     }
 
@@ -171,55 +145,141 @@ namespace ana
     if (!branchesSame)
       throw std::runtime_error("MCMCSamples::AdoptSamples(): branches are not the same!");
 
+    // samples that have been streamed out have to stay at the front.
+    // so if the other one has any, everything of ours has to go out first
+    // (and then the other's stream is finished with, since its samples will be written by ours)
+    if (other.fStreamer || other.fNStreamed > 0)
+    {
+      if (!fStreamer)
+        throw std::runtime_error("MCMCSamples::AdoptSamples(): can't adopt streamed samples without streaming too");
+      FlushStream();
+      other.FlushStream();
+      other.fStreamer.reset();
+
+      if (other.fBestStreamed && (!fBestStreamed || other.fBestStreamed->LL() > fBestStreamed->LL()))
+      {
+        fBestStreamed = std::move(other.fBestStreamed);
+        fBestStreamedIdx = fLLs.size() + other.fBestStreamedIdx;
+      }
+      if (other.fLastStreamed)
+        fLastStreamed = std::move(other.fLastStreamed);
+      fNStreamed += other.fNStreamed;
+    }
+
+    // then append its columns to ours
+    auto Append = [](std::vector<double> & to, const std::vector<double> & from)
+    {
+      to.insert(to.end(), from.begin(), from.end());
+    };
+    Append(fLLs, other.fLLs);
+    for (std::size_t idx = 0; idx < fDiagnosticVals.size(); idx++)
+      Append(fDiagnosticVals[idx], other.fDiagnosticVals[idx]);
+    for (std::size_t idx = 0; idx < fEntryVals.size(); idx++)
+      Append(fEntryVals[idx], other.fEntryVals[idx]);
 
-    // then, take the entries from its TTree and and them to ours using TTree::Merge().
-    // clear the other tree once done.
-    BranchStatusResetter bsr(fSamples.get());  // turn all branches off when done
-    fSamples->SetBranchStatus("*", true);
-    other.fSamples->SetBranchStatus("*", true);
-    TList otherTreeList;
-    otherTreeList.SetOwner(false);
-    otherTreeList.Add(other.fSamples.get());
-    fSamples->Merge(&otherTreeList);
-
-    otherTreeList.Clear();
-    other.fSamples.reset(nullptr);
-
-    // clear the rest of the other MCMCSamples so it isn't left in an intermediate state
-    other.fDiagBranches.clear();
-    other.fVars.clear();
-    other.fSysts.clear();
-    other.fOffset = 0;
-    other.fBestFitSampleIdx = 0;
-    other.fBestFitFound = false;
-    other.fEntryLL = 0;
-    other.fDiagnosticVals.clear();
-    other.fEntryVals.clear();
+    // clear the other MCMCSamples so it isn't left in an intermediate state
+    other.Clear();
 
     // finally, the best fit point isn't necessarily the same any more, so force recalculation the next time it's needed
     fBestFitFound = false;
+    fSortedLLIdx.clear();
+    fTree.reset();
   }
 
   //----------------------------------------------------------------------
   std::size_t MCMCSamples::BestFitSampleIdx() const
   {
+    std::lock_guard<std::mutex> lock(gLazyMutex);
+
     if (fBestFitFound)
       return fBestFitSampleIdx;
 
-    double maxLL = -std::numeric_limits<double>::infinity();
-    auto branch = fSamples->GetBranch(MCMCSamples::LOGLIKELIHOOD_BRANCH_NAME.c_str());
-    branch->SetStatus(true);
-    for (int idx = 0; idx < fSamples->GetEntries(); idx++)
+    if (fLLs.empty())
+      return 0;
+
+    fBestFitSampleIdx = std::distance(fLLs.begin(), std::max_element(fLLs.begin(), fLLs.end()));
+    fBestFitFound = true;
+    return fBestFitSampleIdx;
+  }
+
+  //----------------------------------------------------------------------
+  std::unique_ptr<TTree> MCMCSamples::BuildTree(TDirectory * dir) const
+  {
+    assert(fNStreamed == 0 && "Samples have been streamed out.  Use LoadFrom() on the stream file instead");
+
+    auto tree = std::make_unique<TTree>("samples", "MCMC samples");
+    tree->SetDirectory(dir);
+    if (!dir)
     {
-      branch->GetEntry(idx);
-      if (fEntryLL > maxLL)
-      {
-        fBestFitSampleIdx = idx;
-        maxLL = fEntryLL;
-        fBestFitFound = true;
-      }
+      // disable the 'autosave' and 'autoflush' mechanisms
+      // since there's nowhere to write to anyway
+      tree->SetAutoFlush(0);
+      tree->SetAutoSave(0);
     }
-    return fBestFitSampleIdx;
+
+    double LL;
+    std::vector<double> diagVals(fDiagnosticVals.size());
+    std::vector<double> entryVals(fEntryVals.size());
+    tree->Branch(MCMCSamples::LOGLIKELIHOOD_BRANCH_NAME.c_str(), &LL);
+    for (std::size_t valIdx = 0; valIdx < fDiagBranches.size(); valIdx++)
+      tree->Branch(fDiagBranches[valIdx].c_str(), &diagVals[valIdx]);
+    std::size_t valIdx = 0;
+    for (const auto &var : fVars)
+      tree->Branch(var->ShortName().c_str(), &entryVals[valIdx++]);
+    for (const auto &syst : fSysts)
+      tree->Branch(syst->ShortName().c_str(), &entryVals[valIdx++]);
+
+    for (std::size_t sampleIdx = 0; sampleIdx < NumSamples(); sampleIdx++)
+    {
+      LL = fLLs[sampleIdx];
+      for (std::size_t idx = 0; idx < diagVals.size(); idx++)
+        diagVals[idx] = fDiagnosticVals[idx][sampleIdx];
+      for (std::size_t idx = 0; idx < entryVals.size(); idx++)
+        entryVals[idx] = fEntryVals[idx][sampleIdx];
+      tree->Fill();
+    }
+
+    // the buffers are about to go away
+    tree->ResetBranchAddresses();
+
+    return tree;
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSamples::Clear()
+  {
+    fLLs.clear();
+    for (auto & col : fDiagnosticVals)
+      col.clear();
+    for (auto & col : fEntryVals)
+      col.clear();
+
+    fNStreamed = 0;
+    fBestStreamed.reset();
+    fLastStreamed.reset();
+
+    fBestFitFound = false;
+    fSortedLLIdx.clear();
+    fTree.reset();
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSamples::CloseStream()
+  {
+    if (!fStreamer)
+      return;
+
+    FlushStream();
+
+    // the trailer just needs the layout and the hyperparameters
+    auto trailer = std::make_unique<MCMCSamples>(fVars, fSysts);
+    trailer->fDiagBranches = fDiagBranches;
+    trailer->SetupColumns();
+    trailer->fHyperparams = Hyperparameters(fHyperparams);
+    trailer->fSamplingTime = fSamplingTime;
+    fStreamer->WriteTrailer(fStreamName, std::move(trailer));
+
+    fStreamer.reset();
   }
 
   //----------------------------------------------------------------------
@@ -230,6 +290,100 @@ namespace ana
     return std::distance(fDiagBranches.begin(), itr);
   }
 
+  //----------------------------------------------------------------------
+  void MCMCSamples::FillFromTree(TTree &tree)
+  {
+    double LL;
+    std::vector<double> diagVals(fDiagBranches.size());
+    std::vector<double> entryVals(fVars.size() + fSysts.size());
+
+    tree.SetBranchStatus("*", true);
+    tree.SetBranchAddress(MCMCSamples::LOGLIKELIHOOD_BRANCH_NAME.c_str(), &LL);
+    for (std::size_t valIdx = 0; valIdx < fDiagBranches.size(); valIdx++)
+      tree.SetBranchAddress(fDiagBranches[valIdx].c_str(), &diagVals[valIdx]);
+    std::size_t valIdx = 0;
+    for (const auto &var : fVars)
+      tree.SetBranchAddress(var->ShortName().c_str(), &entryVals[valIdx++]);
+    for (const auto &syst : fSysts)
+      tree.SetBranchAddress(syst->ShortName().c_str(), &entryVals[valIdx++]);
+
+    const std::size_t nEntries = tree.GetEntries();
+    fLLs.reserve(nEntries);
+    for (auto & col : fDiagnosticVals)
+      col.reserve(nEntries);
+    for (auto & col : fEntryVals)
+      col.reserve(nEntries);
+
+    for (std::size_t entry = 0; entry < nEntries; entry++)
+    {
+      tree.GetEntry(entry);
+      fLLs.push_back(LL);
+      for (std::size_t idx = 0; idx < diagVals.size(); idx++)
+        fDiagnosticVals[idx].push_back(diagVals[idx]);
+      for (std::size_t idx = 0; idx < entryVals.size(); idx++)
+        fEntryVals[idx].push_back(entryVals[idx]);
+    }
+
+    tree.ResetBranchAddresses();
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSamples::FlushStream()
+  {
+    if (fStreamer && fLLs.size() > fNStreamed)
+      fStreamer->WriteChunk(fStreamName, TakeChunk());
+  }
+
+  //----------------------------------------------------------------------
+  std::unique_ptr<MCMCSamples> MCMCSamples::LoadChunks(TDirectory * dir,
+                                                       const std::vector<std::string> & chunkNames,
+                                                       std::size_t offset,
+                                                       const std::vector<std::string> &diagBranchNames,
+                                                       const std::vector<const IFitVar *> &vars,
+                                                       const std::vector<const ana::ISyst *> &systs)
+  {
+    std::vector<std::unique_ptr<MCMCSamples>> chunks(chunkNames.size());
+    auto ReadChunk = [&](TDirectory * from, std::size_t chunkIdx)
+    {
+      std::unique_ptr<TTree> tree(dynamic_cast<TTree*>(from->Get(chunkNames[chunkIdx].c_str())));
+      assert(tree);
+      chunks[chunkIdx] = std::unique_ptr<MCMCSamples>(new MCMCSamples(offset, diagBranchNames, vars, systs, *tree,
+                                                                      Hyperparameters(),
+                                                                      std::numeric_limits<double>::signaling_NaN()));
+    };
+
+    TFile * file = dir->GetFile();
+    if (!file || chunks.size() < 2)
+    {
+      for (std::size_t chunkIdx = 0; chunkIdx < chunks.size(); chunkIdx++)
+        ReadChunk(dir, chunkIdx);
+    }
+    else
+    {
+      // decompressing the chunks is the slow part, so do it in parallel.
+      // every thread needs its own handle on the file to do so
+      ROOT::EnableThreadSafety();
+      const std::string fileName = file->GetName();
+      std::string path = dir->GetPath();
+      path = path.substr(path.find(":/") + 2);
+
+      WorkerPool pool;
+      pool.ParallelFor(chunks.size(), [&](unsigned int chunkIdx)
+      {
+        std::unique_ptr<TFile> f(TFile::Open(fileName.c_str(), "READ"));
+        assert(f && !f->IsZombie());
+        ReadChunk(path.empty() ? f.get() : f->GetDirectory(path.c_str()), chunkIdx);
+      });
+    }
+
+    auto ret = std::make_unique<MCMCSamples>(vars, systs);
+    ret->fDiagBranches = diagBranchNames;
+    ret->SetupColumns();
+    for (auto & chunk : chunks)
+      ret->AdoptSamples(std::move(*chunk));
+
+    return ret;
+  }
 
   //----------------------------------------------------------------------
   std::unique_ptr<MCMCSamples> MCMCSamples::LoadFrom(TDirectory *dir,
@@ -273,15 +427,6 @@ namespace ana
         systs.emplace_back(Registry<ISyst>::ShortNameToPtr(str->GetName()));
     }
 
-    auto samplesPtr = dynamic_cast<TTree*>(dir->Get("samples"));
-    std::unique_ptr<TTree> samples(samplesPtr);
-    if (samples->GetCurrentFile())
-    {
-      samples->SetBranchStatus("*", true);
-      samples->LoadBaskets();   // read the entire TTree into memory
-      samples->SetDirectory(nullptr);  // disassociate it from the file it came from so that when the file is closed it persists
-    }
-
     // these may not exist (hyperparameters are not merged when hadd'ing samples)
     double stepSize = std::numeric_limits<double>::signaling_NaN();
     std::unique_ptr<TMatrixD> invMetric;
@@ -303,15 +448,43 @@ namespace ana
     if (auto key = samplingTimeDir->FindKey("samplingTime"))
       samplingTime = key->ReadObject<TParameter<double>>()->GetVal();
 
+    std::unique_ptr<MCMCSamples> ret;
+    if (dir->FindKey("samples"))
+    {
+      // the samples are read out into memory by the constructor, so we don't hang onto the tree
+      std::unique_ptr<TTree> samples(dynamic_cast<TTree*>(dir->Get("samples")));
+      ret = std::unique_ptr<MCMCSamples>(new MCMCSamples(offset->GetVal(),
+                                                         diagBranches,
+                                                         fitVars,
+                                                         systs,
+                                                         *samples,
+                                                         hyperparams,
+                                                         samplingTime));
+      samples.reset();  // before the directory that owns it goes away
+    }
+    else
+    {
+      // written by an MCMCSampleStreamer instead: "samples_0", "samples_1", ...
+      std::map<unsigned int, std::string> chunkNames;  // (the map also takes care of any repeated cycles)
+      const std::string prefix = "samples_";
+      for (const TObject * key : *dir->GetListOfKeys())
+      {
+        const std::string keyName = key->GetName();
+        if (keyName.compare(0, prefix.size(), prefix) == 0)
+          chunkNames[std::stoul(keyName.substr(prefix.size()))] = keyName;
+      }
+      std::vector<std::string> orderedNames;
+      for (const auto & chunkPair : chunkNames)
+        orderedNames.push_back(chunkPair.second);
+
+      ret = LoadChunks(dir, orderedNames, offset->GetVal(), diagBranches, fitVars, systs);
+      ret->fHyperparams = std::move(hyperparams);
+      ret->fSamplingTime = samplingTime;
+    }
+
     delete dir;
 
-    return std::unique_ptr<MCMCSamples>(new MCMCSamples(offset->GetVal(),
-                                                        diagBranches,
-                                                        fitVars,
-                                                        systs,
-                                                        samples,
-                                                        hyperparams,
-                                                        samplingTime));
+    return ret;
   }
 
   //----------------------------------------------------------------------
@@ -371,15 +544,10 @@ namespace ana
   {
     static_assert(std::is_same<IFitVar, T>::value || std::is_same<IConstrainedFitVar, T>::value || std::is_same<ISyst, T>::value,
                   "MCMCSamples::MaxValue() can only be used with IFitVars and ISysts");
-    double max = -std::numeric_limits<double>::infinity();
-    std::size_t offset = VarOffset(var);
-    for (int idx = 0; idx < fSamples->GetEntries(); idx++)
-    {
-      double val = SampleValue(idx, var->ShortName(), offset);
-      if (val > max)
-        max = val;
-    }
-    return max;
+    const auto & vals = fEntryVals[VarOffset(var)];
+    if (vals.empty())
+      return -std::numeric_limits<double>::infinity();
+    return *std::max_element(vals.begin(), vals.end());
   }
   // explicit instantiation of the correct types
   template double MCMCSamples::MaxValue(const IConstrainedFitVar *) const;
@@ -392,26 +560,87 @@ namespace ana
   {
     static_assert(std::is_same<IFitVar, T>::value || std::is_same<IConstrainedFitVar, T>::value || std::is_same<ISyst, T>::value,
                   "MCMCSamples::MinValue() can only be used with IFitVars and ISysts");
-    double min = std::numeric_limits<double>::infinity();
-    std::size_t offset = VarOffset(var);
-    for (int idx = 0; idx < fSamples->GetEntries(); idx++)
-    {
-      double val = SampleValue(idx, var->ShortName(), offset);
-      if (val < min)
-        min = val;
-    }
-    return min;
+    const auto & vals = fEntryVals[VarOffset(var)];
+    if (vals.empty())
+      return std::numeric_limits<double>::infinity();
+    return *std::min_element(vals.begin(), vals.end());
   }
   // explicit instantiation of the correct types
   template double MCMCSamples::MinValue(const IConstrainedFitVar *) const;
   template double MCMCSamples::MinValue(const IFitVar *) const;
   template double MCMCSamples::MinValue(const ISyst *) const;
 
+  //----------------------------------------------------------------------
+  unsigned int MCMCSamples::NumChains() const
+  {
+    if (std::find(fDiagBranches.begin(), fDiagBranches.end(), CHAIN_BRANCH_NAME) == fDiagBranches.end())
+      return 1;
+
+    const auto & chains = DiagnosticValues(CHAIN_BRANCH_NAME);
+    if (chains.empty())
+      return 1;
+    return static_cast<unsigned int>(*std::max_element(chains.begin(), chains.end())) + 1;
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<MCMCParamDiagnostics> MCMCSamples::ParamDiagnostics() const
+  {
+    if (fNStreamed > 0)
+      std::cerr << "MCMCSamples::ParamDiagnostics(): WARNING: " << fNStreamed << " of the "
+                << NumSamples() << " samples have been streamed out of memory, so only the remaining "
+                << NumSamples() - fNStreamed << " are included.  LoadFrom() the streamed file"
+                << " and call ParamDiagnostics() on that to cover them all." << std::endl;
+
+    // sort the in-memory samples out by chain.
+    // (with streaming, each chain's tail is what's left, which is still a contiguous run)
+    std::vector<std::vector<std::size_t>> chainIdxs(NumChains());
+    for (std::size_t idx = fNStreamed; idx < NumSamples(); idx++)
+      chainIdxs[SampleChain(idx)].push_back(idx - fNStreamed);
+    chainIdxs.erase(std::remove_if(chainIdxs.begin(), chainIdxs.end(),
+                                   [](const std::vector<std::size_t> & idxs) { return idxs.empty(); }),
+                    chainIdxs.end());
+    if (chainIdxs.empty())
+      return {};
+
+    std::vector<std::string> names;
+    for (const auto & var : fVars)
+      names.push_back(var->ShortName());
+    for (const auto & syst : fSysts)
+      names.push_back(syst->ShortName());
+
+    std::vector<MCMCParamDiagnostics> ret(names.size());
+
+    // each parameter is independent, and the FFTs and sorts are the slow part
+    WorkerPool pool;
+    pool.ParallelFor(ret.size(), [&](unsigned int col)
+    {
+      std::vector<std::vector<double>> chains;
+      std::size_t minLength = std::numeric_limits<std::size_t>::max();
+      for (const auto & idxs : chainIdxs)
+      {
+        chains.emplace_back();
+        chains.back().reserve(idxs.size());
+        for (const auto & idx : idxs)
+          chains.back().push_back(fEntryVals[col][idx]);
+        minLength = std::min(minLength, idxs.size());
+      }
+      // the diagnostics truncate the chains to the shortest
+      const std::size_t nDraws = chains.empty() ? 0 : chains.size() * minLength;
+
+      ret[col].name = names[col];
+      ret[col].essBulk = mcmcdiag::BulkESS(chains);
+      ret[col].essTail = mcmcdiag::TailESS(chains);
+      ret[col].rHat = mcmcdiag::RankNormalizedSplitRHat(chains);
+      ret[col].autocorrTime = nDraws / mcmcdiag::EffectiveSampleSize(chains);
+    });
+
+    return ret;
+  }
+
   //----------------------------------------------------------------------
   void MCMCSamples::ParseDiagnosticBranches(const std::vector<std::string>& names)
   {
     std::size_t idx = 1;
-    fDiagnosticVals.resize(names.size() - (fVars.size() + fSysts.size() + 1));
     auto firstFitVar = fVars.empty() ? fSysts[0]->ShortName() : fVars[0]->ShortName();
     for (; idx < names.size(); idx++)
     {
@@ -426,8 +655,18 @@ namespace ana
   //----------------------------------------------------------------------
   std::pair<std::size_t, double> MCMCSamples::QuantileLL(double quantile) const
   {
-    auto LLs = SortedLLs();
-    return LLs[std::size_t((1 - quantile) * LLs.size())];
+    const std::size_t rank = QuantileRank(quantile, fLLs.size());
+    {
+      std::lock_guard<std::mutex> lock(gLazyMutex);
+      if (fSortedLLIdx.size() == fLLs.size())
+        return {fSortedLLIdx[rank], fLLs[fSortedLLIdx[rank]]};
+    }
+
+    // only one of them wanted, so no need to sort the whole lot
+    std::vector<std::size_t> idxs(fLLs.size());
+    std::iota(idxs.begin(), idxs.end(), 0);
+    std::nth_element(idxs.begin(), idxs.begin() + rank, idxs.end(), LLOrder(fLLs));
+    return {idxs[rank], fLLs[idxs[rank]]};
   }
 
   //----------------------------------------------------------------------
@@ -435,18 +674,22 @@ namespace ana
       std::vector<std::pair<std::size_t, double>> &LLs) const
   {
     if (LLs.empty())
-      LLs = SortedLLs();  // I think this should be efficient since std::vector has a move assignment operator
+      LLs = SortedLLs();
 
-    return LLs[std::size_t((1 - quantile) * (LLs.size()-1))];  // -1 so that we don't fall off the edge at Q=1.0
+    return LLs[QuantileRank(quantile, LLs.size())];
   }
 
   //----------------------------------------------------------------------
   std::map<double, std::pair<std::size_t, double>> MCMCSamples::QuantileLL(const std::vector<double> &quantiles) const
   {
+    const auto & sorted = SortedLLIndices();
+
     std::map<double, std::pair<std::size_t, double> > ret;
-    std::vector<std::pair<std::size_t, double> > LLs;
     for (const auto & quantile : quantiles)
-      ret[quantile] = QuantileLL(quantile, LLs);
+    {
+      const std::size_t idx = sorted[QuantileRank(quantile, sorted.size())];
+      ret[quantile] = {idx, fLLs[idx]};
+    }
 
     return ret;
   }
@@ -454,26 +697,17 @@ namespace ana
   //----------------------------------------------------------------------
   void MCMCSamples::RunDiagnostics(const StanConfig & cfg) const
   {
-    BranchStatusResetter bsr(fSamples.get());  // turn branches off when done
-
     // these diagnostics adapted from CmdStan's diagnose.cpp
-    auto treeDepthBr = fSamples->GetBranch("treedepth__");
-    if (treeDepthBr)
+    if (std::find(fDiagBranches.begin(), fDiagBranches.end(), "treedepth__") != fDiagBranches.end())
     {
-      treeDepthBr->SetStatus(true);
-      unsigned int numMax = 0;
-      auto brOffset = DiagOffset(treeDepthBr->GetName());
-      for (int idx = 0; idx < treeDepthBr->GetEntries(); idx++)
-      {
-        treeDepthBr->GetEntry(idx);
-        if (fDiagnosticVals[brOffset] >= cfg.max_depth)
-          numMax++;
-      }
+      const auto & treeDepths = DiagnosticValues("treedepth__");
+      auto numMax = std::count_if(treeDepths.begin(), treeDepths.end(),
+                                  [&cfg](double depth) { return depth >= cfg.max_depth; });
       if (numMax > 0)
       {
-        std::cout << numMax << " of " << treeDepthBr->GetEntries() << " ("
+        std::cout << numMax << " of " << treeDepths.size() << " ("
                   << std::setprecision(2)
-                  << 100 * static_cast<double>(numMax) / treeDepthBr->GetEntries()
+                  << 100 * static_cast<double>(numMax) / treeDepths.size()
                   << "%) transitions hit the maximum treedepth limit of "
                   << cfg.max_depth << ", or 2^" << cfg.max_depth << " leapfrog steps."
                   << " Trajectories that are prematurely terminated due to this"
@@ -484,22 +718,15 @@ namespace ana
       }
     }
 
-    auto divergentBr = fSamples->GetBranch("divergent__");
-    if (divergentBr)
+    if (std::find(fDiagBranches.begin(), fDiagBranches.end(), "divergent__") != fDiagBranches.end())
     {
-      divergentBr->SetStatus(true);
-      unsigned int numDiv = 0;
-      auto brOffset = DiagOffset(divergentBr->GetName());
-      for (int idx = 0; idx < divergentBr->GetEntries(); idx++)
-      {
-        divergentBr->GetEntry(idx);
-        if (fDiagnosticVals[brOffset] >0)
-          numDiv++;
-      }
+      const auto & divergents = DiagnosticValues("divergent__");
+      auto numDiv = std::count_if(divergents.begin(), divergents.end(),
+                                  [](double div) { return div > 0; });
       if (numDiv > 0)
-        std::cout << numDiv << " of " << divergentBr->GetEntries() << " ("
+        std::cout << numDiv << " of " << divergents.size() << " ("
                   << std::setprecision(2)
-                  << 100 * static_cast<double>(numDiv) / divergentBr->GetEntries()
+                  << 100 * static_cast<double>(numDiv) / divergents.size()
                   << "%) transitions ended with a divergence.  These divergent"
                   << " transitions indicate that HMC is not fully able to"
                   << " explore the posterior distribution.  Try rerunning with"
@@ -510,9 +737,10 @@ namespace ana
                   << std::endl << std::endl;
     }
 
-    auto energyBr = fSamples->GetBranch("energy__");
-    if (energyBr)
+    if (std::find(fDiagBranches.begin(), fDiagBranches.end(), "energy__") != fDiagBranches.end())
     {
+      const auto & energies = DiagnosticValues("energy__");
+
       double delta_e_sq_mean = 0;
       double e_mean = 0;
       double e_var = 0;
@@ -520,12 +748,9 @@ namespace ana
       double e_sample = 0;
       double e_sample_prev = 0;
 
-      auto brOffset = DiagOffset(energyBr->GetName());
-      for (int idx = 0; idx < energyBr->GetEntries(); idx++)
+      for (std::size_t idx = 0; idx < energies.size(); idx++)
       {
-        energyBr->SetStatus(true);
-        energyBr->GetEntry(idx);
-        e_sample = fDiagnosticVals[brOffset];
+        e_sample = energies[idx];
 
         double delta_e_sq = util::sqr(e_sample - e_sample_prev);
         double d = delta_e_sq - delta_e_sq_mean;
@@ -538,7 +763,7 @@ namespace ana
         e_sample_prev = e_sample;
       }
 
-      e_var /= static_cast<double>(energyBr->GetEntries() - 1);
+      e_var /= static_cast<double>(energies.size() - 1);
 
       double e_bfmi = delta_e_sq_mean / e_var;
 
@@ -552,31 +777,47 @@ namespace ana
                   << std::endl << std::endl;
     }
 
-    // unfortunately the remaining diagnostics really require a stan::mcmc::chains<> object.
-    // this presents an annoying issue: the TTree storage is necessary for use with RooNDKeysPDF,
-    // and is much more convenient for persistence.
-    // even more unfortunately, these are the most important diagnostics.
-    // Should we build a stan::mcmc::chains from it?
-    // todo: decide how to implement remaining diagnostics
-/*
-  else if (chains.param_name(i).find("__") == std::string::npos) {
-
-        double n_eff = chains.effective_sample_size(i);
-        if (n_eff / num_samples < 0.001)
-          bad_n_eff_names.push_back(chains.param_name(i));
-
-        double split_rhat = chains.split_potential_scale_reduction(i);
-        if (split_rhat > 1.1)
-          bad_rhat_names.push_back(chains.param_name(i));
-      }
+    // the remaining ones are per-parameter, and computed by ParamDiagnostics()
+    const auto paramDiags = ParamDiagnostics();
+    const std::size_t numSamples = NumSamples() - fNStreamed;
+
+    std::vector<std::string> bad_n_eff_names;
+    std::vector<std::string> bad_rhat_names;
+    for (const auto & diag : paramDiags)
+    {
+      // NaN (too few samples, or a parameter that never moved) doesn't get reported either way
+      if (diag.essBulk / numSamples < 0.001 || diag.essTail / numSamples < 0.001)
+        bad_n_eff_names.push_back(diag.name);
+
+      if (diag.rHat > 1.1)
+        bad_rhat_names.push_back(diag.name);
     }
 
-    if (bad_n_eff_names.size() > 0) {
+    if (!(cfg.verbosity < StanConfig::Verbosity::kVerbose) && !paramDiags.empty())
+    {
+      std::cout << "Convergence diagnostics from " << numSamples << " samples in "
+                << NumChains() << " chain(s):" << std::endl;
+      std::cout << "  " << std::left << std::setw(20) << "parameter" << std::right
+                << std::setw(12) << "bulk ESS" << std::setw(12) << "tail ESS"
+                << std::setw(12) << "split R-hat" << std::setw(12) << "autocorr."
+                << std::endl;
+      for (const auto & diag : paramDiags)
+        std::cout << "  " << std::left << std::setw(20) << diag.name << std::right
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(12) << diag.essBulk << std::setw(12) << diag.essTail
+                  << std::setprecision(3) << std::setw(12) << diag.rHat
+                  << std::setprecision(1) << std::setw(12) << diag.autocorrTime
+                  << std::defaultfloat << std::endl;
+      std::cout << std::endl;
+    }
+
+    if (!bad_n_eff_names.empty())
+    {
       std::cout << "The following parameters had fewer than 0.001 effective"
                 << " samples per transition:" << std::endl;
       std::cout << "  ";
-      for (size_t n = 0; n < bad_n_eff_names.size() - 1; ++n)
-        std::cout << bad_n_eff_names.at(n) << ", ";
+      for (std::size_t n = 0; n < bad_n_eff_names.size() - 1; ++n)
+        std::cout << bad_n_eff_names[n] << ", ";
       std::cout << bad_n_eff_names.back() << std::endl;
 
       std::cout << "Such low values indicate that the effective sample size"
@@ -585,45 +826,49 @@ namespace ana
                 << std::endl << std::endl;
     }
 
-    if (bad_rhat_names.size() > 0) {
-      std::cout << "The following parameters had split R-hat less than 1.1:"
+    if (!bad_rhat_names.empty())
+    {
+      std::cout << "The following parameters had split R-hat greater than 1.1:"
                 << std::endl;
       std::cout << "  ";
-      for (size_t n = 0; n < bad_rhat_names.size() - 1; ++n)
-        std::cout << bad_rhat_names.at(n) << ", ";
+      for (std::size_t n = 0; n < bad_rhat_names.size() - 1; ++n)
+        std::cout << bad_rhat_names[n] << ", ";
       std::cout << bad_rhat_names.back() << std::endl;
 
       std::cout << "Such high values indicate incomplete mixing and biased"
-                << "estimation.  You should consider regularization your model"
+                << " estimation.  You should consider regularizing your model"
                 << " with additional prior information or looking for a more"
                 << " effective parameterization."
                 << std::endl << std::endl;
     }
-*/
-
   }
 
   //----------------------------------------------------------------------
   MCMCSample MCMCSamples::Sample(std::size_t idx) const
   {
-    BranchStatusResetter bsr(fSamples.get());  // turn branches off when done
+    if (idx < fNStreamed)
+      return StreamedSample(idx);
 
-    fSamples->SetBranchStatus("*", true);
-    fSamples->GetEntry(idx);
-    return MCMCSample(SampleLL(idx), fDiagnosticVals, fEntryVals, fDiagBranches, fVars, fSysts);
-  }
+    std::vector<double> diagVals;
+    diagVals.reserve(fDiagnosticVals.size());
+    for (const auto & col : fDiagnosticVals)
+      diagVals.push_back(col[idx]);
 
+    std::vector<double> entryVals;
+    entryVals.reserve(fEntryVals.size());
+    for (const auto & col : fEntryVals)
+      entryVals.push_back(col[idx - fNStreamed]);
+
+    return MCMCSample(SampleLL(idx), diagVals, entryVals, fDiagBranches, fVars, fSysts);
+  }
 
   //----------------------------------------------------------------------
-  double MCMCSamples::SampleValue(std::size_t rowIdx, const std::string & branchName, std::size_t varIdx) const
+  unsigned int MCMCSamples::SampleChain(std::size_t idx) const
   {
-    BranchStatusResetter bsr(fSamples.get());  // turn branches off when done
+    if (std::find(fDiagBranches.begin(), fDiagBranches.end(), CHAIN_BRANCH_NAME) == fDiagBranches.end())
+      return 0;
 
-    fSamples->SetBranchStatus(branchName.c_str(), true);
-    auto branch = fSamples->GetBranch(branchName.c_str());
-    branch->SetStatus(true);
-    branch->GetEntry(rowIdx);
-    return fEntryVals[varIdx];
+    return static_cast<unsigned int>(DiagnosticValues(CHAIN_BRANCH_NAME)[idx]);
   }
 
   //----------------------------------------------------------------------
@@ -656,53 +901,15 @@ namespace ana
     dir = dir->mkdir(name.c_str()); // switch to subdir
     dir->cd();
 
-    TObjString("MCMCSamples").Write("type");
-
-    TParameter<int> offset("offset", fOffset);
-    offset.Write();
-
-    TList diagBranchNames;
-    diagBranchNames.SetOwner();
-    for (const auto & brName : fDiagBranches)
-      diagBranchNames.AddLast(new TObjString(brName.c_str()));
-    diagBranchNames.Write("diagBranchNames", TObject::kSingleKey);
-
-    TList fitVarNames;
-    fitVarNames.SetOwner();
-    for (const auto & var : fVars)
-      fitVarNames.AddLast(new TObjString(var->ShortName().c_str()));
-    fitVarNames.Write("fitVarNames", TObject::kSingleKey);
-
-    TList systNames;
-    systNames.SetOwner();
-    for (const auto & syst : fSysts)
-      systNames.AddLast(new TObjString(syst->ShortName().c_str()));
-    systNames.Write("systNames", TObject::kSingleKey);
+    WriteNames(dir);
 
-    // re-enable all the branches before writing...
-    fSamples->SetBranchStatus("*", true);
-    fSamples->Write("samples");
-    // don't let it get attached to the file that's about to be closed
-    fSamples->LoadBaskets();
-    fSamples->SetDirectory(nullptr);
+    // built attached to the output so that it's written out as it's filled
+    // rather than all being held in memory first
+    auto tree = BuildTree(dir);
+    tree->Write("samples");
+    tree.reset();
 
-    auto hyperdir = dir->mkdir("hyperparams");
-    hyperdir->cd();
-    TParameter<double> stepSize("stepsize", fHyperparams.stepSize);
-    stepSize.Write();
-    if (fHyperparams.invMetric)
-      fHyperparams.invMetric->Write("inv_metric");
-    TObjString("Hyperparameters").Write("type");  // so that hadd_cafana can be taught to skip over them
-    dir->cd();
-    hyperdir->Write();
-
-    dir->cd();
-    auto timedir = dir->mkdir("samplingTime");
-    timedir->cd();
-    TObjString("SamplingTime").Write("type");  // so that hadd_cafana can be taught to skip over them
-    TParameter<double>("samplingTime", fSamplingTime).Write();
-    dir->cd();
-    timedir->Write();
+    WriteTrailer(dir);
 
     dir->Write();
     delete dir;
@@ -717,79 +924,122 @@ namespace ana
     assert (fOffset == 0 && "MCMCSamples::SetNames() was called after tree was already set up!");
 
     ParseDiagnosticBranches(names);
-    SetupTree();
+    SetupColumns();
   }
 
   //----------------------------------------------------------------------
-  void MCMCSamples::SetupTree()
+  void MCMCSamples::SetupColumns()
   {
-    auto CreateOrSetAddress = [](TTree * tree, const std::string& brName, double* address)
-    {
-      auto name = brName.c_str();
-      TBranch * br = tree->GetBranch(name);
-      if (br)
-        br->SetAddress(address);
-      else
-        tree->Branch(name, address);
-      return br;
-    };
-
-    CreateOrSetAddress(fSamples.get(), MCMCSamples::LOGLIKELIHOOD_BRANCH_NAME, &fEntryLL);
-
-    fDiagnosticVals.clear();
-    fDiagnosticVals.resize(fDiagBranches.size(), std::numeric_limits<double>::signaling_NaN());
     assert(!fVars.empty() || !fSysts.empty());
-    auto firstFitVar = fVars.empty() ? fSysts[0]->ShortName() : fVars[0]->ShortName();
-    for (std::size_t valIdx = 0; valIdx < fDiagBranches.size(); valIdx++)
-      CreateOrSetAddress(fSamples.get(), fDiagBranches[valIdx], &fDiagnosticVals[valIdx]);
 
     fOffset = 1 + fDiagBranches.size(); //  + 1 for the LL at the beginning
 
+    fLLs.clear();
+    fDiagnosticVals.clear();
+    fDiagnosticVals.resize(fDiagBranches.size());
     fEntryVals.clear();
-    fEntryVals.resize(fVars.size() + fSysts.size(), std::numeric_limits<double>::signaling_NaN());
-    std::size_t valIdx = 0;
-    for (const auto &var : fVars)
-      CreateOrSetAddress(fSamples.get(), var->ShortName(), &fEntryVals[valIdx++]);
-    for (const auto &syst : fSysts)
-      CreateOrSetAddress(fSamples.get(), syst->ShortName(), &fEntryVals[valIdx++]);
+    fEntryVals.resize(fVars.size() + fSysts.size());
 
-    // disable the 'autosave' and 'autoflush' mechanisms
-    // since there's nowhere to write to anyway
-    // (this tree is memory-only unless SaveTo()'d).
-    fSamples->SetAutoFlush(0);
-    fSamples->SetAutoSave(0);
+    fBestFitFound = false;
+    fSortedLLIdx.clear();
+    fTree.reset();
+  }
+
+  //----------------------------------------------------------------------
+  const std::vector<std::size_t> & MCMCSamples::SortedLLIndices() const
+  {
+    // once built it's only changed by the non-const methods, so the reference
+    // stays good after the lock is released
+    std::lock_guard<std::mutex> lock(gLazyMutex);
+
+    if (fSortedLLIdx.size() == fLLs.size())
+      return fSortedLLIdx;
+
+    fSortedLLIdx.resize(fLLs.size());
+    std::iota(fSortedLLIdx.begin(), fSortedLLIdx.end(), 0);
+    std::sort(fSortedLLIdx.begin(), fSortedLLIdx.end(), LLOrder(fLLs));
+
+    return fSortedLLIdx;
   }
 
   //----------------------------------------------------------------------
   std::vector<std::pair<std::size_t, double>> MCMCSamples::SortedLLs() const
   {
+    const auto & sorted = SortedLLIndices();
+
     std::vector<std::pair<std::size_t, double>> LLs;
-    LLs.reserve(fSamples->GetEntries());
-    auto branch = fSamples->GetBranch(MCMCSamples::LOGLIKELIHOOD_BRANCH_NAME.c_str());
-    fSamples->SetBranchStatus("*", false);
-    fSamples->SetBranchStatus(MCMCSamples::LOGLIKELIHOOD_BRANCH_NAME.c_str(), true);
-    for (int idx = 0; idx < fSamples->GetEntries(); idx++)
+    LLs.reserve(sorted.size());
+    for (const auto & idx : sorted)
+      LLs.emplace_back(idx, fLLs[idx]);
+
+    return LLs;
+  }
+
+  //----------------------------------------------------------------------
+  const MCMCSample & MCMCSamples::StreamedSample(std::size_t idx) const
+  {
+    if (fBestStreamed && idx == fBestStreamedIdx)
+      return *fBestStreamed;
+    if (fLastStreamed && idx + 1 == fNStreamed)
+      return *fLastStreamed;
+
+    std::cout << "MCMCSamples: sample " << idx << " has been streamed out to file."
+              << "  Use MCMCSamples::LoadFrom() on that file to get at it." << std::endl;
+    abort();
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSamples::StreamTo(std::shared_ptr<MCMCSampleStreamer> streamer, const std::string & name)
+  {
+    assert(streamer);
+    assert(!fStreamer && "MCMCSamples::StreamTo() called while already streaming");
+
+    // any samples we have already will go out with the first chunk
+    fStreamer = std::move(streamer);
+    fStreamName = name;
+  }
+
+  //----------------------------------------------------------------------
+  std::unique_ptr<MCMCSamples> MCMCSamples::TakeChunk()
+  {
+    auto chunk = std::make_unique<MCMCSamples>(fVars, fSysts);
+    chunk->fDiagBranches = fDiagBranches;
+    chunk->SetupColumns();
+
+    // the LLs and diagnostics are small and are needed for the best fit
+    // and RunDiagnostics(), so they stay here as well...
+    chunk->fLLs.assign(fLLs.begin() + fNStreamed, fLLs.end());
+    for (std::size_t idx = 0; idx < fDiagnosticVals.size(); idx++)
+      chunk->fDiagnosticVals[idx].assign(fDiagnosticVals[idx].begin() + fNStreamed, fDiagnosticVals[idx].end());
+
+    // ... but the parameter values go
+    chunk->fEntryVals.swap(fEntryVals);
+    fEntryVals.resize(chunk->fEntryVals.size());
+    for (auto & col : fEntryVals)
+      col.reserve(fStreamer->ChunkSize());
+
+    // except for the ones we'll still be asked about
+    const auto & LLs = chunk->fLLs;
+    const std::size_t chunkBestIdx = std::distance(LLs.begin(), std::max_element(LLs.begin(), LLs.end()));
+    if (!fBestStreamed || LLs[chunkBestIdx] > fBestStreamed->LL())
     {
-      branch->GetEntry(idx);
-      LLs.push_back(std::make_pair(idx, fEntryLL));
+      fBestStreamed = std::make_unique<MCMCSample>(chunk->Sample(chunkBestIdx));
+      fBestStreamedIdx = fNStreamed + chunkBestIdx;
     }
+    fLastStreamed = std::make_unique<MCMCSample>(chunk->Sample(LLs.size() - 1));
 
-    std::sort(LLs.begin(), LLs.end(),
-        [](const std::pair<std::size_t, double> & a, const std::pair<std::size_t, double> & b)
-        {
-          return a.second < b.second;
-        }
-    );
+    fNStreamed = fLLs.size();
+    fTree.reset();
 
-    return LLs;
+    return chunk;
   }
 
   //----------------------------------------------------------------------
   const TTree *MCMCSamples::ToTTree() const
   {
-    // presumably user doesn't want the tree with some branches missing...
-    fSamples->SetBranchStatus("*", true);
-    return fSamples.get();
+    if (!fTree)
+      fTree = BuildTree();
+    return fTree.get();
   }
 
   //----------------------------------------------------------------------
@@ -808,6 +1058,57 @@ namespace ana
     return fVars.size() + std::distance(fSysts.begin(), itr);
   }
 
+  //----------------------------------------------------------------------
+  void MCMCSamples::WriteNames(TDirectory * dir) const
+  {
+    dir->cd();
+
+    TObjString("MCMCSamples").Write("type");
+
+    TParameter<int> offset("offset", fOffset);
+    offset.Write();
+
+    TList diagBranchNames;
+    diagBranchNames.SetOwner();
+    for (const auto & brName : fDiagBranches)
+      diagBranchNames.AddLast(new TObjString(brName.c_str()));
+    diagBranchNames.Write("diagBranchNames", TObject::kSingleKey);
+
+    TList fitVarNames;
+    fitVarNames.SetOwner();
+    for (const auto & var : fVars)
+      fitVarNames.AddLast(new TObjString(var->ShortName().c_str()));
+    fitVarNames.Write("fitVarNames", TObject::kSingleKey);
+
+    TList systNames;
+    systNames.SetOwner();
+    for (const auto & syst : fSysts)
+      systNames.AddLast(new TObjString(syst->ShortName().c_str()));
+    systNames.Write("systNames", TObject::kSingleKey);
+  }
+
+  //----------------------------------------------------------------------
+  void MCMCSamples::WriteTrailer(TDirectory * dir) const
+  {
+    auto hyperdir = dir->mkdir("hyperparams");
+    hyperdir->cd();
+    TParameter<double> stepSize("stepsize", fHyperparams.stepSize);
+    stepSize.Write();
+    if (fHyperparams.invMetric)
+      fHyperparams.invMetric->Write("inv_metric");
+    TObjString("Hyperparameters").Write("type");  // so that hadd_cafana can be taught to skip over them
+    dir->cd();
+    hyperdir->Write();
+
+    dir->cd();
+    auto timedir = dir->mkdir("samplingTime");
+    timedir->cd();
+    TObjString("SamplingTime").Write("type");  // so that hadd_cafana can be taught to skip over them
+    TParameter<double>("samplingTime", fSamplingTime).Write();
+    dir->cd();
+    timedir->Write();
+  }
+
 
 
 }
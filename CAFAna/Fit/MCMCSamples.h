@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <vector>
 
 #include "TMatrixD.h"
@@ -9,6 +10,7 @@
 #include "CAFAna/Core/ISyst.h"
 #include "CAFAna/Core/StanTypedefs.h"
 #include "CAFAna/Fit/BayesianMarginal.h"   // for MarginalMode enum
+#include "CAFAna/Fit/MCMCDiagnostics.h"
 #include "CAFAna/Fit/MCMCSample.h"
 #include "CAFAna/Fit/StanConfig.h"
 
@@ -17,14 +19,23 @@ namespace ana
   // forward declaration
   class Bayesian1DMarginal;
   class BayesianSurface;
+  class MCMCSampleStreamer;
 
   /// Storage for a list of MCMC samples.
   ///
-  /// The internal storage is as a TTree (which simplifies persistence);
-  /// for efficiency and simplicity reasons the tree branches are simply doubles
-  /// (rather than MCMCSample objects), but MCMCSample objects can be obtained
+  /// The samples are held in memory column-wise: one contiguous array
+  /// for the LL, for each diagnostic, and for each fitted parameter,
+  /// so that marginalizing etc. over millions of samples is cheap.
+  /// They're only converted to a TTree (of doubles, one branch per column)
+  /// when persisted with SaveTo(), or on request with ToTTree().
+  /// MCMCSample objects for individual samples can be obtained
   /// using the Sample() method.
   ///
+  /// Alternatively the samples can be streamed out to a file as they're added
+  /// (see StreamTo()) so that memory use stays bounded.  In that case only the
+  /// LLs and diagnostics of the streamed samples (and the values of the best-fit one)
+  /// are kept in memory; LoadFrom() the file to get at everything else.
+  ///
   /// \param varOffset  The offset to the first Var value.  (Previous values are the LL and internal fitter vars.)
   /// \param vars       The ana::Vars passed to the fitter
   /// \param systs      The ana::ISysts passed to the fitter
@@ -35,6 +46,10 @@ namespace ana
       /// Used in several places, so centralized here.
       static const std::string LOGLIKELIHOOD_BRANCH_NAME;
 
+      /// Name of the diagnostic branch recording which Markov chain each sample came from.
+      /// Only present when several chains were run together (see StanConfig::chain).
+      static const std::string CHAIN_BRANCH_NAME;
+
       struct Hyperparameters
       {
         double stepSize;
@@ -66,17 +81,20 @@ namespace ana
                   const std::vector<const ana::ISyst *> &systs = {});
 
       /// Move constructor
-      MCMCSamples(MCMCSamples&& other);
+      MCMCSamples(MCMCSamples&& other) = default;
 
       /// No copying for now (not interested in getting the memory semantics right)
       MCMCSamples(const MCMCSamples&) = delete;
 
-      /// Move assignment: need to call SetupTree(), so the default move assignment operator won't work
-      MCMCSamples &operator=(MCMCSamples &&other);
+      /// Move assignment
+      MCMCSamples &operator=(MCMCSamples &&other) = default;
 
       /// Copying still forbidden
       MCMCSamples & operator=(const MCMCSamples&) = delete;
 
+      /// Finishes any streaming (see StreamTo())
+      ~MCMCSamples();
+
       void AddSample(const std::vector<double> &sample);
 
       /// Add the samples from \ref other into this MCMCSamples.  Warning: \ref other will be cleared!
@@ -86,11 +104,24 @@ namespace ana
       std::size_t BestFitSampleIdx() const;
 
       /// Discard any samples
-      void Clear() { fSamples->Clear(); }
+      void Clear();
+
+      /// Write out anything still pending in streaming mode, along with the hyperparameters,
+      /// and stop streaming.  (See StreamTo().)
+      void CloseStream();
+
+      /// All the values of the diagnostic \a diagName (one of Stan's "xxx__" outputs), in sample order
+      const std::vector<double> & DiagnosticValues(const std::string & diagName) const
+      {
+        return fDiagnosticVals[DiagOffset(diagName)];
+      }
 
       const Hyperparameters & Hyperparams() const   { return fHyperparams; }
 
 
+      /// The LLs of all the samples, in sample order
+      const std::vector<double> & LLs() const { return fLLs; }
+
       /// Marginalize over all other variables to obtain a 1D profile in \a var
       Bayesian1DMarginal MarginalizeTo(const IFitVar * var,
                                        BayesianMarginal::MarginalMode marginalMode=BayesianMarginal::MarginalMode::kHistogram) const;
@@ -113,26 +144,41 @@ namespace ana
       template <typename T>
       double MinValue(const T *var) const;
 
+      /// How many independent Markov chains were these samples drawn from?
+      unsigned int NumChains() const;
+
       /// How many samples do we have?
-      std::size_t NumSamples() const { return fSamples->GetEntries(); };
+      std::size_t NumSamples() const { return fLLs.size(); };
+
+      /// How many of the samples have been streamed out, and so no longer have their values available?
+      /// (These are always the first NumStreamed() samples.  The best-fit and the last one are kept.
+      /// See StreamTo().)
+      std::size_t NumStreamed() const { return fNStreamed; }
 
       /// Determine the LL at given quantile
       ///
       /// \param quantile e.g. 90% smallest LL of set of samples --> 0.9
-      /// \return the LL at given quantile
+      /// \return the index of the sample at the given quantile, and its LL
       ///
-      /// Note that the necessary ordered list is constructed and destroyed each time this method is called,
-      /// so if you know you need multiple quantiles, use one of the other signatures.
+      /// Uses SortedLLIndices() if it's already been built, and otherwise just selects
+      /// the one sample (which is much cheaper than sorting them all).
+      /// So if you know you need multiple quantiles, use one of the other signatures.
       std::pair<std::size_t, double> QuantileLL(double quantile) const;
 
       /// Like QuantileLL(double) except that the LL vector is returned to you.
       /// If you pass a non-empty vector, that vector is assumed to already contain
       /// the sorted LL list (facilitating re-use).
+      /// (Prefer the other signatures, which share SortedLLIndices() instead.)
       std::pair<std::size_t, double> QuantileLL(double quantile, std::vector<std::pair<std::size_t, double>>& LLs) const;
 
-      /// Like QuantileLL(double) except requesting multiple LLs at once
+      /// Like QuantileLL(double) except requesting multiple LLs at once.  Only sorts the samples once
       std::map<double, std::pair<std::size_t, double>> QuantileLL(const std::vector<double>& quantiles) const;
 
+      /// Effective sample sizes, split R-hat and autocorrelation time of each fitted parameter,
+      /// computed in parallel over the parameters.  Only the samples still in memory
+      /// (ie from NumStreamed() on) are included, with a warning if any were streamed out.
+      std::vector<MCMCParamDiagnostics> ParamDiagnostics() const;
+
       /// Do some checks on the post-fit samples
       void RunDiagnostics(const StanConfig & cfg) const;
 
@@ -140,23 +186,29 @@ namespace ana
       /// If you just want one value prefer SampleLL() or SampleValue() (less overhead).
       MCMCSample Sample(std::size_t idx) const;
 
+      /// Which chain did sample number \idx come from?  (Always 0 if only one chain was run.)
+      unsigned int SampleChain(std::size_t idx) const;
+
       /// Get the LL for sample number \idx
       double SampleLL(std::size_t idx) const
       {
-        fSamples->GetEntry(idx);
-        return fEntryLL;
+        return fLLs[idx];
       }
 
       /// Get the value of Var \a var for sample number \idx
       double SampleValue(const IFitVar *var, std::size_t idx) const
       {
-        return SampleValue(idx, var->ShortName(), VarOffset(var));
+        if (idx < fNStreamed)
+          return StreamedSample(idx).Val(var);
+        return fEntryVals[VarOffset(var)][idx - fNStreamed];
       }
 
       /// Get the value of Syst \a syst for sample number \idx
       double SampleValue(const ana::ISyst *syst, std::size_t idx) const
       {
-        return SampleValue(idx, syst->ShortName(), VarOffset(syst));
+        if (idx < fNStreamed)
+          return StreamedSample(idx).Val(syst);
+        return fEntryVals[VarOffset(syst)][idx - fNStreamed];
       }
 
       /// Get the values of FitVars \a vars for sample number \a idx
@@ -186,9 +238,29 @@ namespace ana
 
       void SetSamplingTime(double s)  { fSamplingTime = s; }
 
-      /// Get a TTree with the MCMC samples in it
+      /// Indices of the samples ordered by LL, lowest to highest (ties by index).
+      /// Built the first time it's needed, then kept until the samples change.
+      /// Safe to call from several threads at once.
+      const std::vector<std::size_t> & SortedLLIndices() const;
+
+      /// \brief Stream the samples out to directory \a name of \a streamer's file as they're added.
+      ///
+      /// Every MCMCSampleStreamer::ChunkSize() samples, the values of the fitted parameters
+      /// are handed over to be written and dropped from memory.  Call CloseStream()
+      /// (or let this object be destroyed) when done.  The result can be read with LoadFrom().
+      void StreamTo(std::shared_ptr<MCMCSampleStreamer> streamer, const std::string & name);
+
+      /// Get a TTree with the MCMC samples in it.
+      /// It's built from the in-memory columns when first requested,
+      /// so prefer the column accessors (LLs(), Values()) where possible.
       const TTree *ToTTree() const;
 
+      /// All the values of Var \a var, in sample order.  (Starting from sample NumStreamed().)
+      const std::vector<double> & Values(const IFitVar *var) const { return fEntryVals[VarOffset(var)]; }
+
+      /// All the values of Syst \a syst, in sample order.  (Starting from sample NumStreamed().)
+      const std::vector<double> & Values(const ana::ISyst *syst) const { return fEntryVals[VarOffset(syst)]; }
+
       /// Which Systs are sampled in these samples?
       const std::vector<const ana::ISyst *> &Systs() const { return fSysts; }
 
@@ -202,28 +274,51 @@ namespace ana
       static std::unique_ptr<MCMCSamples> LoadFrom(TDirectory * dir, const std::string& name);
 
     private:
+      friend class MCMCSampleStreamer;
+
       /// Internal-use constructor needed for LoadFrom()
       MCMCSamples(std::size_t offset, const std::vector<std::string> &diagBranchNames,
                   const std::vector<const IFitVar *> &vars, const std::vector<const ana::ISyst *> &systs,
-                  std::unique_ptr<TTree> &tree, const Hyperparameters &hyperParams, double samplingTime);
+                  TTree &tree, const Hyperparameters &hyperParams, double samplingTime);
+
+      /// Build a TTree (one branch per column) from the samples.
+      /// If \a dir is given the tree is attached to it, so that its baskets are flushed there as it fills.
+      std::unique_ptr<TTree> BuildTree(TDirectory * dir = nullptr) const;
 
       /// Where in fDiagnosticVals is the given diagnostic?
       std::size_t DiagOffset(const std::string& diagName) const;
 
-      /// Internal method for getting the value of a var when you know where it is in fEntryVals
-      double SampleValue(std::size_t rowIdx, const std::string & branchName, std::size_t varIdx) const;
+      /// Read the samples out of a TTree in the format written by SaveTo()
+      void FillFromTree(TTree & tree);
+
+      /// Hand any samples not yet streamed out over to fStreamer
+      void FlushStream();
+
+      /// One of the streamed-out samples that we've kept (see NumStreamed()).  Aborts for any other
+      const MCMCSample & StreamedSample(std::size_t idx) const;
+
+      /// Read the chunks written by an MCMCSampleStreamer into \a dir
+      static std::unique_ptr<MCMCSamples> LoadChunks(TDirectory * dir,
+                                                     const std::vector<std::string> & chunkNames,
+                                                     std::size_t offset,
+                                                     const std::vector<std::string> &diagBranchNames,
+                                                     const std::vector<const IFitVar *> &vars,
+                                                     const std::vector<const ana::ISyst *> &systs);
 
       /// Set up the storage tree based on the branch names given us by Stan
       void ParseDiagnosticBranches(const std::vector<std::string>& names);
 
-      /// Hook up the storage tree to our internal variables
-      void SetupTree();
+      /// Size the storage columns according to the branches we've been given
+      void SetupColumns();
 
       /// Construct a sorted vector of the LLs of all the samples (ordered lowest to highest)
       ///
       /// \return The ordered vector
       std::vector<std::pair<std::size_t, double>> SortedLLs() const;
 
+      /// Move the samples not yet streamed out into a new MCMCSamples (LLs and diagnostics are copied)
+      std::unique_ptr<MCMCSamples> TakeChunk();
+
       /// Where in fEntryVals is the given var?
       std::size_t VarOffset(const IFitVar *var) const;
       /// Where in fEntryVals is the given syst?
@@ -236,12 +331,25 @@ namespace ana
 
       mutable std::size_t fBestFitSampleIdx;
       mutable bool fBestFitFound;
+      mutable std::vector<std::size_t> fSortedLLIdx;     ///< See SortedLLIndices().  Empty until needed.  Built under a lock
+
+      std::vector<double> fLLs;                          ///< LL of each sample
+      std::vector<std::vector<double>> fDiagnosticVals;  ///< One column per entry in fDiagBranches
+      std::vector<std::vector<double>> fEntryVals;       ///< One column per fitted Var, then one per Syst
+
+      mutable std::unique_ptr<TTree> fTree;  ///< Built on demand by ToTTree()
+
+      /// Write the type tag and branch names into \a dir
+      void WriteNames(TDirectory * dir) const;
+      /// Write the hyperparameters and sampling time into \a dir
+      void WriteTrailer(TDirectory * dir) const;
 
-      // would prefer to keep this on the stack, but no move assignment...
-      std::unique_ptr<TTree> fSamples;
-      double fEntryLL;  // for use reading the TTree
-      std::vector<double> fEntryVals;  // ditto
-      std::vector<double> fDiagnosticVals;
+      std::shared_ptr<MCMCSampleStreamer> fStreamer;  ///< Only set when streaming
+      std::string fStreamName;                       ///< Directory we're streaming into
+      std::size_t fNStreamed = 0;                    ///< Samples whose values have been streamed out of fEntryVals
+      std::unique_ptr<MCMCSample> fBestStreamed;     ///< The best of those, since it's needed after fitting
+      std::size_t fBestStreamedIdx = 0;
+      std::unique_ptr<MCMCSample> fLastStreamed;     ///< The last of those, since it's used to seed further sampling
 
       mutable Hyperparameters fHyperparams; ///< Hyperparameters deduced after adaptation, or manually set
       double fSamplingTime;                 ///< how long did we spend sampling?
@@ -1,11 +1,13 @@
 #include "CAFAna/Fit/MinuitFitter.h"
 
 #include "CAFAna/Fit/GradientDescent.h"
+#include "CAFAna/Fit/LBFGSB.h"
 #include "CAFAna/Analysis/common_fit_definitions.h"
 
 #include "CAFAna/Core/IFitVar.h"
 #include "CAFAna/Core/Progress.h"
 #include "CAFAna/Core/Utilities.h"
+#include "CAFAna/Core/WorkerPool.h"
 #include "CAFAna/Experiment/IExperiment.h"
 
 #include "OscLib/IOscCalc.h"
@@ -15,6 +17,7 @@
 #include "TGraph.h"
 #include "TH1.h"
 #include "TMatrixDSym.h"
+#include "RVersion.h"
 
 // ROOT fitter interface
 #include "Fit/Fitter.h"
@@ -25,6 +28,7 @@
 
 #include <cassert>
 #include <iostream>
+#include <mutex>
 
 namespace ana
 {
@@ -50,6 +54,20 @@ namespace ana
   {
   }
 
+  //----------------------------------------------------------------------
+  MinuitFitter::MinuitFitter(const MinuitFitter& rhs)
+    : IFitter(rhs),
+      fCalc(0),
+      fExpt(rhs.fExpt),
+      fFitOpts(rhs.fFitOpts),
+      fSupportsDerivatives(rhs.fSupportsDerivatives),
+      fCovar(0),
+      fCovarStatus(-1),
+      fParallelDerivs(rhs.fParallelDerivs),
+      fVerb(rhs.fVerb)
+  {
+  }
+
   //----------------------------------------------------------------------
   MinuitFitter::~MinuitFitter()
   {
@@ -71,14 +89,16 @@ namespace ana
   {
     fVerb = verb;
     if (fFitOpts & kIncludeSimplex)
-      std::cout << "Simplex option specified but not implemented. Ignored."
-                << std::endl;
+      Out(std::cout) << "Simplex option specified but not implemented. Ignored."
+                     << std::endl;
 
     if((fFitOpts & kPrefitSysts) && !fVars.empty()){
       // Update systSeed to the best syst values, while holding the oscillation
       // parameters fixed
       MinuitFitter prefit(fExpt, {}, fSysts, fFitOpts);
-      prefit.Fit(seed, systSeed, verb);
+      prefit.SetParallelDerivatives(fParallelDerivs);
+      // Its printout couldn't go in fSeedLog
+      prefit.Fit(seed, systSeed, fSeedLog ? kQuiet : verb);
       // Then continue with the full fit as usual
     }
 
@@ -86,11 +106,27 @@ namespace ana
     fCalc = seed;
     *fShifts = systSeed;
 
+    // Any copies for parallel derivatives are of the previous seed
+    fDerivSlots.clear();
+
     std::unique_ptr<ROOT::Math::Minimizer> mnMin;
 
-    if ((fFitOpts & kPrecisionMask) == kGradDesc)
+    if (fFitOpts & kLBFGS){
+      auto lbfgs = std::make_unique<LBFGSB>(*this);
+      // For Hesse. The parallel finite differences work whether or not the
+      // gradients are being evaluated in parallel
+      lbfgs->SetHessian([this](const std::vector<double>& x, double* hess){
+        return Hessian(x, hess);
+      });
+      mnMin = std::move(lbfgs);
+    }
+    else if ((fFitOpts & kPrecisionMask) == kGradDesc)
       mnMin = std::make_unique<GradientDescent>(*this);
     else{
+      // The plugin manager behind the factory isn't safe to use from
+      // multiple threads at once
+      static std::mutex factoryMutex;
+      std::lock_guard<std::mutex> lock(factoryMutex);
       mnMin = std::unique_ptr<ROOT::Math::Minimizer>(
         ROOT::Math::Factory::CreateMinimizer("Minuit2", "Combined"));
       // ROOT::Math::Factory::CreateMinimizer("GSLMultiMin", "BFGS2"));
@@ -113,12 +149,22 @@ namespace ana
     fLastPreFitErrors.clear();
     fLastCentralValues.clear();
 
+    // MINUIT gets penalties outside the bounds rather than hard limits, but
+    // L-BFGS-B can make good use of them
+    const bool bounded = fFitOpts & kLBFGS;
+
     for (const IFitVar *v: fVars)
     {
       const double val = v->GetValue(seed);
+      const IConstrainedFitVar* cv = dynamic_cast<const IConstrainedFitVar*>(v);
       // name, value, error
-      mnMin->SetVariable(mnMin->NFree(), v->ShortName(), val,
-                         val ? fabs(val / 2) : .1);
+      if (bounded && cv)
+        mnMin->SetLimitedVariable(mnMin->NFree(), v->ShortName(), val,
+                                  val ? fabs(val / 2) : .1,
+                                  cv->LowLimit(), cv->HighLimit());
+      else
+        mnMin->SetVariable(mnMin->NFree(), v->ShortName(), val,
+                           val ? fabs(val / 2) : .1);
       fLastParamNames.push_back(v->ShortName());
       fLastPreFitValues.push_back(val);
       fLastPreFitErrors.push_back(val ? val / 2 : .1);
@@ -130,7 +176,11 @@ namespace ana
     {
       const double val = systSeed.GetShift(s);
       // name, value, error
-      mnMin->SetVariable(mnMin->NFree(), s->ShortName(), val, 1);
+      if (bounded)
+        mnMin->SetLimitedVariable(mnMin->NFree(), s->ShortName(), val, 1,
+                                  s->Min(), s->Max());
+      else
+        mnMin->SetVariable(mnMin->NFree(), s->ShortName(), val, 1);
       fLastParamNames.push_back(s->ShortName());
       fLastPreFitValues.push_back(val);
       fLastPreFitErrors.push_back(1);
@@ -139,41 +189,78 @@ namespace ana
     // One way this can go wrong is if two variables have the same ShortName
     assert(mnMin->NFree() == fVars.size() + fSysts.size());
 
-    if (fSupportsDerivatives) {
+    if (fSupportsDerivatives || FiniteDiffGradient()) {
       mnMin->SetFunction(*this);
     } else {
       mnMin->SetFunction((ROOT::Math::IBaseFunctionMultiDim &)*this);
     }
 
-    if (fVerb <= Verbosity::kQuiet) {
+    // For Hesse, as for LBFGSB above. Minuit only takes a Hessian from ROOT
+    // 6.24 onwards, and only alongside a gradient
+    if ((fFitOpts & kIncludeHesse) && !(fFitOpts & kLBFGS)) {
+      bool externalHessian = false;
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,24,0)
+      externalHessian = mnMin->SetHessianFunction(
+        [this](const std::vector<double>& x, double* hess){
+          return Hessian(x, hess);
+        });
+#endif
+      if (!externalHessian) {
+        static std::once_flag warnOnce;
+        std::call_once(warnOnce, []()
+          {
+            std::cerr << "MinuitFitter: the minimizer won't take the parallel "
+                      << "finite-difference Hessian (that needs ROOT 6.24 or "
+                      << "later, and SetParallelDerivatives()). HESSE will "
+                      << "evaluate it itself, serially" << std::endl;
+          });
+      }
+    }
+
+    // Minuit's own printout can't be redirected into fSeedLog, so a seed fit
+    // running alongside others stays quiet and logs a summary afterwards
+    if (fVerb <= Verbosity::kQuiet || fSeedLog) {
       mnMin->SetPrintLevel(0);
     }
 
     if (!mnMin->Minimize()) {
-      std::cout << "*** ERROR: minimum is not valid ***" << std::endl;
-      std::cout << "*** Precision: " << mnMin->Precision() << std::endl;
+      Out(std::cout) << "*** ERROR: minimum is not valid ***" << std::endl;
+      Out(std::cout) << "*** Precision: " << mnMin->Precision() << std::endl;
 
-      std::cout << "-- Stopped at: \n";
+      Out(std::cout) << "-- Stopped at: \n";
       for (uint i = 0; i < mnMin->NFree(); ++i) {
-        std::cout << "\t" << mnMin->VariableName(i) << " = " << mnMin->X()[i]
+        Out(std::cout) << "\t" << mnMin->VariableName(i) << " = " << mnMin->X()[i]
+                       << "\n";
+      }
+    }
+    else if (fSeedLog && fVerb >= Verbosity::kVerbose) {
+      *fSeedLog << "[FIT]: Minimum " << mnMin->MinValue() << ", edm "
+                << mnMin->Edm() << ", " << mnMin->NCalls() << " calls, at:\n";
+      for (uint i = 0; i < mnMin->NFree(); ++i) {
+        *fSeedLog << "\t" << mnMin->VariableName(i) << " = " << mnMin->X()[i]
                   << "\n";
       }
     }
 
     if (fFitOpts & kIncludeHesse) {
-      std::cout << "[FIT]: It's Hesse o'clock" << std::endl;
+      Out(std::cout) << "[FIT]: It's Hesse o'clock" << std::endl;
       mnMin->Hesse();
     }
 
-    if (fFitOpts & kIncludeMinos) {
+    if ((fFitOpts & kIncludeMinos) && (fFitOpts & kLBFGS)) {
+      Out(std::cerr) << "MinuitFitter: kIncludeMinos isn't supported with kLBFGS. "
+                     << "Only Hesse errors are available" << std::endl;
+      fTempMinosErrors.clear();
+    }
+    else if (fFitOpts & kIncludeMinos) {
       // std::cout << "It's minos time" << std::endl;
       fTempMinosErrors.clear();
       for (uint i = 0; i < mnMin->NDim(); ++i) {
         double errLow = 0, errHigh = 0;
         mnMin->GetMinosError(i, errLow, errHigh);
-        std::cout << i << "/" << mnMin->NDim() << " " << fParamNames[i] << ": "
-                  << errLow << ", +" << errHigh << " (" << mnMin->Errors()[i]
-                  << ")" << std::endl;
+        Out(std::cout) << i << "/" << mnMin->NDim() << " " << fLastParamNames[i] << ": "
+                       << errLow << ", +" << errHigh << " (" << mnMin->Errors()[i]
+                       << ")" << std::endl;
         fTempMinosErrors.push_back(std::make_pair(errLow, errHigh));
       }
     }
@@ -192,6 +279,42 @@ namespace ana
     return std::make_unique<MinuitFitSummary>(std::move(mnMin));
   }
 
+  //----------------------------------------------------------------------
+  std::unique_ptr<IFitter> MinuitFitter::CloneForSeed() const
+  {
+    std::unique_ptr<MinuitFitter> ret(new MinuitFitter(*this));
+    ret->fSeedLog = std::make_unique<std::ostringstream>();
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  void MinuitFitter::MergeSeedFit(const IFitter& seedFitter, bool best) const
+  {
+    const MinuitFitter& f = dynamic_cast<const MinuitFitter&>(seedFitter);
+
+    fNEval += f.fNEval;
+    fNEvalGrad += f.fNEvalGrad;
+    fNEvalFiniteDiff += f.fNEvalFiniteDiff;
+
+    if(f.fSeedLog) Out(std::cout) << f.fSeedLog->str() << std::flush;
+
+    if(best){
+      // What UpdatePostFit() expects to find from the last seed fit
+      fLastParamNames = f.fLastParamNames;
+      fLastPreFitValues = f.fLastPreFitValues;
+      fLastPreFitErrors = f.fLastPreFitErrors;
+      fLastCentralValues = f.fLastCentralValues;
+      fTempMinosErrors = f.fTempMinosErrors;
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void MinuitFitter::PrimeCaches(osc::IOscCalcAdjustable* seed,
+                                 const SystShifts& shift) const
+  {
+    fExpt->ChiSq(seed, shift);
+  }
+
   //----------------------------------------------------------------------
   void MinuitFitter::SetFitOpts(FitOpts opts)
   {
@@ -233,41 +356,174 @@ namespace ana
 
       std::time_t now_time = std::chrono::system_clock::to_time_t(now);
 
-      std::cerr << "[FIT]: NEval: " << fNEval
-                << ", LH: {samp: " << fExpt->ChiSq(fCalc, *fShifts)
-                << ", pen: " << penalty << "}\n\tT += "
-                << std::chrono::duration_cast<std::chrono::seconds>(now - fLastTP)
-                       .count()
-                << " s, = ";
+      Out(std::cerr) << "[FIT]: NEval: " << fNEval
+                     << ", LH: {samp: " << fExpt->ChiSq(fCalc, *fShifts)
+                     << ", pen: " << penalty << "}\n\tT += "
+                     << std::chrono::duration_cast<std::chrono::seconds>(now - fLastTP)
+                            .count()
+                     << " s, = ";
 
       if (std::chrono::duration_cast<std::chrono::seconds>(now - fBeginTP)
               .count() > 60) {
-        std::cout << std::chrono::duration_cast<std::chrono::minutes>(now -
-                                                                      fBeginTP)
-                         .count()
-                  << " m. ";
+        Out(std::cout) << std::chrono::duration_cast<std::chrono::minutes>(now -
+                                                                           fBeginTP)
+                              .count()
+                       << " m. ";
       } else {
-        std::cout << std::chrono::duration_cast<std::chrono::seconds>(now -
-                                                                      fBeginTP)
-                         .count()
-                  << " s. ";
+        Out(std::cout) << std::chrono::duration_cast<std::chrono::seconds>(now -
+                                                                           fBeginTP)
+                              .count()
+                       << " s. ";
       }
 
-      std::cout << BuildLogInfoString();
+      Out(std::cout) << BuildLogInfoString();
       fLastTP = now;
     }
 
     return fExpt->ChiSq(fCalc, *fShifts) + penalty;
   }
 
+  //----------------------------------------------------------------------
+  double MinuitFitter::EvalAt(const double* pars,
+                              osc::IOscCalcAdjustable* calc,
+                              SystShifts& shifts) const
+  {
+    double penalty = 0;
+    for(unsigned int i = 0; i < fVars.size(); ++i){
+      fVars[i]->SetValue(calc, pars[i]);
+      penalty += fVars[i]->Penalty(pars[i], calc);
+    }
+    for(unsigned int j = 0; j < fSysts.size(); ++j){
+      shifts.SetShift(fSysts[j], pars[fVars.size()+j]);
+      penalty += fSysts[j]->Penalty(pars[fVars.size()+j]);
+    }
+
+    return fExpt->ChiSq(calc, shifts) + penalty;
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<double> MinuitFitter::
+  ParallelEval(const std::vector<std::vector<double>>& pts) const
+  {
+    if(!fDerivPool) fDerivPool = std::make_shared<WorkerPool>();
+
+    const unsigned int K = fDerivPool->NThreads();
+
+    // One set of copies per thread, made from the current fit's state. The
+    // parameters not being fit never change, and the rest are set on every
+    // evaluation.
+    if(fDerivSlots.size() != K){
+      fDerivSlots.clear();
+      fDerivSlots.resize(K);
+      for(DerivSlot& slot: fDerivSlots){
+        if(fCalc) slot.calc.reset(fCalc->Copy());
+        slot.shifts = fShifts->Copy();
+      }
+
+      // Once per fit, evaluate serially before the tasks share the
+      // experiment, so that any lazy initialization in it and its
+      // predictions doesn't race
+      EvalAt(pts[0].data(), fDerivSlots[0].calc.get(), *fDerivSlots[0].shifts);
+      ++fNEvalFiniteDiff;
+    }
+
+    std::vector<double> ret(pts.size());
+
+    // Each task has its own slot and a fixed set of points, so the results
+    // don't depend on the scheduling
+    fDerivPool->ParallelFor(K, [&](unsigned int k){
+      for(unsigned int i = k; i < pts.size(); i += K){
+        ret[i] = EvalAt(pts[i].data(), fDerivSlots[k].calc.get(), *fDerivSlots[k].shifts);
+      }
+    });
+
+    fNEvalFiniteDiff += pts.size();
+
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<double> MinuitFitter::DerivSteps(const double* x) const
+  {
+    static const double relStep =
+      getenv("CAFANA_FIT_DERIV_STEP") ? atof(getenv("CAFANA_FIT_DERIV_STEP")) : 1e-4;
+
+    std::vector<double> ret(NDim());
+    for(unsigned int i = 0; i < NDim(); ++i){
+      const double scale = i < fLastPreFitErrors.size() ? fabs(fLastPreFitErrors[i]) : 1;
+      ret[i] = relStep * std::max(fabs(x[i]), scale);
+    }
+    return ret;
+  }
+
   //----------------------------------------------------------------------
   void MinuitFitter::Gradient(const double *pars, double *ret) const
   {
     ++fNEvalGrad;
 
-    // All this logic was torn out, but this is where you would reimplement it
-    // in terms of stan.
-    abort();
+    if(!FiniteDiffGradient()){
+      // All this logic was torn out, but this is where you would reimplement
+      // it in terms of stan.
+      abort();
+    }
+
+    const unsigned int N = NDim();
+    const std::vector<double> h = DerivSteps(pars);
+
+    // Central differences
+    std::vector<std::vector<double>> pts(2*N, std::vector<double>(pars, pars+N));
+    for(unsigned int i = 0; i < N; ++i){
+      pts[2*i  ][i] += h[i];
+      pts[2*i+1][i] -= h[i];
+    }
+
+    const std::vector<double> f = ParallelEval(pts);
+
+    for(unsigned int i = 0; i < N; ++i) ret[i] = (f[2*i] - f[2*i+1]) / (2*h[i]);
+  }
+
+  //----------------------------------------------------------------------
+  bool MinuitFitter::Hessian(const std::vector<double>& x, double* hess) const
+  {
+    const unsigned int N = NDim();
+    assert(x.size() == N);
+
+    const std::vector<double> h = DerivSteps(x.data());
+
+    // The central point, then +/- steps in each parameter, then a step
+    // forwards in each pair of parameters
+    std::vector<std::vector<double>> pts(1 + 2*N + N*(N-1)/2, x);
+    for(unsigned int i = 0; i < N; ++i){
+      pts[1+2*i  ][i] += h[i];
+      pts[1+2*i+1][i] -= h[i];
+    }
+    unsigned int idx = 1 + 2*N;
+    for(unsigned int i = 0; i < N; ++i){
+      for(unsigned int j = 0; j < i; ++j){
+        pts[idx][i] += h[i];
+        pts[idx][j] += h[j];
+        ++idx;
+      }
+    }
+
+    const std::vector<double> f = ParallelEval(pts);
+
+    const double f0 = f[0];
+    auto fPlus  = [&](unsigned int i){return f[1+2*i];};
+    auto fMinus = [&](unsigned int i){return f[1+2*i+1];};
+
+    idx = 1 + 2*N;
+    for(unsigned int i = 0; i < N; ++i){
+      hess[i*N+i] = (fPlus(i) - 2*f0 + fMinus(i)) / util::sqr(h[i]);
+
+      for(unsigned int j = 0; j < i; ++j){
+        const double hij = (f[idx] - fPlus(i) - fPlus(j) + f0) / (h[i]*h[j]);
+        hess[i*N+j] = hess[j*N+i] = hij;
+        ++idx;
+      }
+    }
+
+    return true;
   }
 
   //----------------------------------------------------------------------
@@ -11,9 +11,11 @@
 
 #include <chrono>
 #include <memory>
+#include <sstream>
 
 namespace ana
 {
+  class WorkerPool;
 
 /// Perform MINUIT fits in one or two dimensions
   class MinuitFitter
@@ -42,7 +44,12 @@ namespace ana
         kIncludeMinos = 16,
 
         // try fitting the systs before the oscillation parameters.  might speed up your fit
-        kPrefitSysts = 32
+        kPrefitSysts = 32,
+
+        // Minimize with bounded L-BFGS (see LBFGSB.h) instead, ignoring the
+        // precision setting. Uses finite-difference gradients unless analytic
+        // ones are available. Hesse is supported, Minos is not
+        kLBFGS = 64
       };
 
       void SetFitOpts(FitOpts opts);
@@ -99,6 +106,22 @@ namespace ana
 
       void Gradient(const double *x, double *grad) const override;
 
+      /// \brief Give MINUIT gradients evaluated by finite differences in
+      /// parallel
+      ///
+      /// The Hessian for HESSE (kIncludeHesse) is always evaluated this way
+      /// where the minimizer accepts one. For MINUIT that needs ROOT 6.24 or
+      /// later, and the gradients from this option.
+      ///
+      /// The points are farmed out to a pool of threads, each with its own
+      /// copy of the calculator and SystShifts. The step for each parameter is
+      /// CAFANA_FIT_DERIV_STEP (default 1e-4) times the larger of its value
+      /// and its initial error.
+      void SetParallelDerivatives(bool parallel = true) {fParallelDerivs = parallel;}
+
+      /// Finite-difference Hessian at \a x, filled row-major into \a hess
+      bool Hessian(const std::vector<double>& x, double* hess) const;
+
       virtual double DoDerivative(const double *x,
                                   unsigned int icoord) const override
       {
@@ -116,9 +139,32 @@ namespace ana
       bool CheckGradient() const { return (fFitOpts & kPrecisionMask) != kFast; }
 
     protected:
+      /// \brief Same configuration as \a rhs, but none of its per-fit state,
+      /// for \ref CloneForSeed
+      MinuitFitter(const MinuitFitter& rhs);
+
       /// Stuff the parameters into the calculator and/or syst shifts object
       void DecodePars(double const *pars) const;
 
+      /// \brief The function MINUIT minimizes, evaluated using the given
+      /// calculator and shifts rather than fCalc and fShifts
+      double EvalAt(const double* pars,
+                    osc::IOscCalcAdjustable* calc,
+                    SystShifts& shifts) const;
+
+      /// Evaluate at each of \a pts in parallel
+      std::vector<double>
+      ParallelEval(const std::vector<std::vector<double>>& pts) const;
+
+      /// Finite-difference step sizes for the current fit
+      std::vector<double> DerivSteps(const double* x) const;
+
+      /// Should \ref Gradient use finite differences?
+      bool FiniteDiffGradient() const
+      {
+        return fParallelDerivs || (fFitOpts & kLBFGS);
+      }
+
       /// Concrete instance of IFitSummary for use in MinuitFitter
       class MinuitFitSummary : public IFitSummary
       {
@@ -161,10 +207,32 @@ namespace ana
 
       void UpdatePostFit(const IFitSummary * fitSummary) const override;
 
+      std::unique_ptr<IFitter> CloneForSeed() const override;
+
+      void MergeSeedFit(const IFitter& seedFitter, bool best) const override;
+
+      /// \brief Evaluate the experiment's ChiSq() at the first seed
+      ///
+      /// Builds what the experiment and its predictions make on first use and
+      /// share afterwards (eg MultiExperiment's worker pool,
+      /// PredictionExtrap's fused oscillator).
+      void PrimeCaches(osc::IOscCalcAdjustable* seed,
+                       const SystShifts& shift) const override;
+
+      /// \brief Where this fitter's printout goes
+      ///
+      /// \a os, except for the clones from \ref CloneForSeed, which write to
+      /// fSeedLog. MergeSeedFit() prints that out, in seed order.
+      std::ostream& Out(std::ostream& os) const {return fSeedLog ? *fSeedLog : os;}
+
       /// Intended to be called only once (from constructor) to initialize
       /// fSupportsDerivatives
       bool SupportsDerivatives() const;
 
+      // Everything mutable below is per-fit state, written by
+      // FitHelperSeeded() and DoEval(). So a single MinuitFitter can only run
+      // one fit at a time. Parallel seed fits each get their own instance
+      // from CloneForSeed(), and MergeSeedFit() brings the results back.
       mutable osc::IOscCalcAdjustable *fCalc;
       const IExperiment *fExpt;
 
@@ -195,10 +263,24 @@ namespace ana
       mutable std::vector<std::pair<double, double>>
           fTempMinosErrors; // Bit of a hack
 
+      bool fParallelDerivs = false;
+
+      /// Thread-private copies for \ref ParallelEval
+      struct DerivSlot
+      {
+        std::unique_ptr<osc::IOscCalcAdjustable> calc;
+        std::unique_ptr<SystShifts> shifts;
+      };
+      mutable std::vector<DerivSlot> fDerivSlots;
+      mutable std::shared_ptr<WorkerPool> fDerivPool;
+
       mutable std::chrono::time_point<std::chrono::system_clock> fLastTP;
       mutable std::chrono::time_point<std::chrono::system_clock> fBeginTP;
 
       mutable Verbosity fVerb;
+
+      /// Printout of a seed fit running concurrently with others, see \ref Out
+      std::unique_ptr<std::ostringstream> fSeedLog;
   };
 
   // Modern C++ thinks that enum | enum == int. Make things work like we expect
@@ -58,8 +58,8 @@ namespace ana
       {}
 
     unsigned int random_seed;  ///< Random seed used by Stan internally
-    unsigned int chain;        ///< Number of Markov chains to run (1 per core)
-    double init_radius;        ///< Size of the range in *unconstrained* parameter space where the initial point for un-specified parameters is randomly seeded
+    unsigned int chain;        ///< Number of Markov chains to run concurrently (1 per core).  Their samples are merged, tagged with the chain id
+    double init_radius;        ///< Size of the range in *unconstrained* parameter space where the initial point for un-specified parameters is randomly seeded.  With several chains, each also starts this far (at most) from the seed point.  0 starts them all at the seed
     int num_warmup;            ///< Number of initial steps in the Markov chain (used to enter the typical set).  These are usually discarded because they may not be sampled proportionally to the likelihood.
     int num_samples;           ///< Number of steps in the Markov chain retained for analysis (after warmup).
     int num_thin;              ///< Number of Markov chain steps between saved samples when sampling.
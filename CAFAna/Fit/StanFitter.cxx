@@ -1,6 +1,11 @@
+#include <algorithm>
+#include <mutex>
 #include <string>
+#include <type_traits>
 #include <vector>
 
+#include "TROOT.h"
+
 // Stan's dependencies trigger some warnings...
 #pragma GCC diagnostic push
 #if __GNUC__ >= 6
@@ -13,6 +18,7 @@
 #include "stan/callbacks/stream_writer.hpp"
 #include "stan/io/reader.hpp"
 #include "stan/io/writer.hpp"
+#include "stan/model/log_prob_grad.hpp"
 #include "stan/services/sample/hmc_nuts_dense_e_adapt.hpp"
 #include "stan/services/sample/hmc_nuts_diag_e_adapt.hpp"
 #include "stan/services/util/create_unit_e_diag_inv_metric.hpp"
@@ -20,8 +26,10 @@
 #pragma GCC diagnostic pop
 
 #include "CAFAna/Fit/StanFitter.h"
+#include "CAFAna/Fit/MCMCSampleStreamer.h"
 
 #include "CAFAna/Core/Utilities.h"
+#include "CAFAna/Core/WorkerPool.h"
 
 #include "CAFAna/Experiment/IExperiment.h"
 
@@ -151,10 +159,35 @@ namespace ana
       abort();
     }
 
+    // look for a warmup to start from in the library.
+    // (unless there's to be no warmup at all, or we were handed one with ReuseWarmup())
+    fWarmupLibraryEntry.reset();
+    fAddWarmupToLibrary = false;
+    if (fWarmupLibrary && fStanConfig.num_warmup > 0 && fMCMCWarmup.NumSamples() == 0)
+    {
+      std::vector<std::string> paramNames;
+      get_param_names(paramNames);
+      fWarmupLibraryReport = fWarmupLibrary->FindClosest(fWarmupLibraryKey, paramNames, fStanConfig);
+      if (fStanConfig.verbosity > StanConfig::Verbosity::kSilent)
+        fWarmupLibraryReport.Print();
+
+      fWarmupLibraryEntry = fWarmupLibraryReport.entry;
+      fAddWarmupToLibrary = !fWarmupLibraryEntry;
+    }
+
     // const-casts here because we need to initialize the writer interface, which requires a non-const pointer,
     // but this method is const.  prefer not to make the members mutable for this one instance
     fValueWriter = std::make_unique<MemoryTupleWriter>(fStanConfig.num_samples > 0 ? const_cast<MCMCSamples*>(&fMCMCSamples) : nullptr,
-                                                       fStanConfig.num_warmup > 0 ? const_cast<MCMCSamples*>(&fMCMCWarmup) : nullptr);
+                                                       NumWarmup() > 0 ? const_cast<MCMCSamples*>(&fMCMCWarmup) : nullptr);
+
+    // with several chains, each one streams its own (see RunChains())
+    if (fStreamer && fStanConfig.chain <= 1)
+    {
+      if (fStanConfig.num_samples > 0)
+        const_cast<MCMCSamples&>(fMCMCSamples).StreamTo(fStreamer, "samples");
+      if (NumWarmup() > 0)
+        const_cast<MCMCSamples&>(fMCMCWarmup).StreamTo(fStreamer, "warmup");
+    }
 
     return IFitter::Fit(seed, bestSysts, seedPts, systSeedPts, verb);
   }
@@ -165,6 +198,91 @@ namespace ana
   StanFitter::FitHelperSeeded(osc::IOscCalcAdjustable *seed,
                               SystShifts &systSeed,
                               Verbosity verb) const
+  {
+    // id: only needed when running multiple chains to combine.
+    // if the grid var $PROCESS is defined, use that
+    unsigned int procId = 0;
+    const char* process = getenv("PROCESS");
+    if(process)
+      procId = std::stoul(process);
+
+    int return_code;
+    if (fStanConfig.chain > 1)
+      return_code = RunChains(seed, systSeed, procId);
+    else
+    {
+      samplecounter_callback interrupt(std::size_t(NumWarmup()),
+                                       std::size_t(fStanConfig.num_samples));  // creates a nice CAFAna-style Progress bar
+      return_code = RunChain(seed, systSeed, interrupt, procId);
+    }
+
+    // Use Stan's wrapper function instead of the above.  Can be used for diagnostics as needed.
+//    auto return_code = stan::services::sample::hmc_nuts_diag_e_adapt(*this,
+//                                                                     init_context,
+//                                                                     fStanConfig.random_seed,
+//                                                                     procId,
+//                                                                     fStanConfig.init_radius,
+//                                                                     fStanConfig.num_warmup,
+//                                                                     fStanConfig.num_samples,
+//                                                                     fStanConfig.num_thin,
+//                                                                     fStanConfig.save_warmup,
+//                                                                     fStanConfig.refresh,
+//                                                                     fStanConfig.stepsize,
+//                                                                     fStanConfig.stepsize_jitter,
+//                                                                     fStanConfig.max_depth,
+//                                                                     fStanConfig.delta,
+//                                                                     fStanConfig.gamma,
+//                                                                     fStanConfig.kappa,
+//                                                                     fStanConfig.t0,
+//                                                                     fStanConfig.init_buffer,
+//                                                                     fStanConfig.term_buffer,
+//                                                                     fStanConfig.window,
+//                                                                     interrupt,
+//                                                                     *logger,
+//                                                                     init_writer,
+//                                                                     *fValueWriter,
+//                                                                     diagnostic_writer);
+
+
+    // todo: something smarter here?  or just more output?
+    // also todo: need to check the Stan diagnostics for divergences, autocorrelation, etc.
+    if (return_code != stan::services::error_codes::OK)
+      std::cerr << "warning: Stan fit did not converge..." << std::endl;
+    else if (fAddWarmupToLibrary)
+    {
+      AddWarmupToLibrary();
+      fAddWarmupToLibrary = false;  // once is enough if there are several seeds
+    }
+
+    auto bestSampleIdx = fMCMCSamples.BestFitSampleIdx();
+
+    // Store results back to the "seed" variable
+    for (auto & var : fVars)
+      var->SetValue(seed, fMCMCSamples.SampleValue(var, bestSampleIdx));
+
+    // Store systematic results back into "systSeed".
+    // cast to stan-var so that we don't lose the value here
+    for (const auto & syst : fSysts)
+      systSeed.SetShift(syst, stan::math::var(fMCMCSamples.SampleValue(syst, bestSampleIdx)));
+
+    fMCMCSamples.RunDiagnostics(fStanConfig);
+
+    if (fStreamer)
+    {
+      // const-casts for the same reason as in Fit()
+      const_cast<MCMCSamples&>(fMCMCSamples).CloseStream();
+      const_cast<MCMCSamples&>(fMCMCWarmup).CloseStream();
+      fStreamer->Sync();
+    }
+
+    return std::make_unique<StanFitSummary>(fMCMCSamples.SampleLL(bestSampleIdx));
+  } // StanFitter::FitHelperSeeded()
+
+  //----------------------------------------------------------------------
+  int StanFitter::RunChain(osc::IOscCalcAdjustable *seed,
+                           const SystShifts &systSeed,
+                           stan::callbacks::interrupt &interrupt,
+                           unsigned int chainId) const
   {
     CreateCalculator(seed);
 
@@ -172,8 +290,6 @@ namespace ana
 
     // status and other stuff that get passed back & forth between us and Stan
     stan::callbacks::writer init_writer;
-    samplecounter_callback interrupt(std::size_t(fStanConfig.num_warmup),
-                                     std::size_t(fStanConfig.num_samples));  // creates a nice CAFAna-style Progress bar
 
     std::ostream nullStream(nullptr);
     std::ostream & diagStream = (fStanConfig.verbosity < StanConfig::Verbosity::kQuiet) ? std::cout : nullStream;
@@ -209,26 +325,33 @@ namespace ana
     // (the pointer is because array_var_context does not have a copy constructor,
     //  so it needs to only be initialized once.)
     std::unique_ptr<stan::io::array_var_context> init_context;
-    if (fMCMCWarmup.NumSamples() < 1)
+    const MCMCSamples & warmup = PriorWarmup();
+    if (warmup.NumSamples() < 1)
       init_context = std::make_unique<stan::io::array_var_context>(BuildInitContext(seed, systSeed));
     // however if we're reusing MCMC samples from a previous run we take the last point from them
-    if (fMCMCWarmup.NumSamples() > 0)
+    if (warmup.NumSamples() > 0)
     {
       std::unique_ptr<osc::IOscCalcAdjustable> calc(seed->Copy());
-      for (const auto & v : fMCMCWarmup.Vars())
-        v->SetValue(calc.get(), fMCMCWarmup.SampleValue(v, fMCMCWarmup.NumSamples()-1));
+      for (const auto & v : warmup.Vars())
+        v->SetValue(calc.get(), warmup.SampleValue(v, warmup.NumSamples()-1));
       auto shifts = systSeed.Copy();
-      for (const auto & s : fMCMCWarmup.Systs())
-        shifts->SetShift(s, fMCMCWarmup.SampleValue(s, fMCMCWarmup.NumSamples()-1));
+      for (const auto & s : warmup.Systs())
+        shifts->SetShift(s, warmup.SampleValue(s, warmup.NumSamples()-1));
+      init_context = std::make_unique<stan::io::array_var_context>(BuildInitContext(calc.get(), *shifts));
+    }
+    // and if starting from a library entry, one of the points its chains finished warmup at
+    else if (fWarmupLibraryEntry && fWarmupLibraryEntry->points.rows() > 0)
+    {
+      const auto & points = fWarmupLibraryEntry->points;
+      const Eigen::VectorXd point = points.row(chainId % points.rows());
+      std::unique_ptr<osc::IOscCalcAdjustable> calc(seed ? seed->Copy() : nullptr);
+      for (std::size_t varIdx = 0; varIdx < fVars.size(); varIdx++)
+        fVars[varIdx]->SetValue(calc.get(), point[varIdx]);
+      auto shifts = systSeed.Copy();
+      for (std::size_t systIdx = 0; systIdx < fSysts.size(); systIdx++)
+        shifts->SetShift(fSysts[systIdx], point[fVars.size() + systIdx]);
       init_context = std::make_unique<stan::io::array_var_context>(BuildInitContext(calc.get(), *shifts));
     }
-
-    // id: only needed when running multiple chains to combine.
-    // if the grid var $PROCESS is defined, use that
-    unsigned int procId = 0;
-    const char* process = getenv("PROCESS");
-    if(process)
-      procId = std::stoul(process);
 
     // n.b. there are _lots_ more options for ways to call Stan but let's start here.
     //      this is an exploration using the "no-u-turn sampler" (NUTS)
@@ -238,58 +361,144 @@ namespace ana
     // but we've customized it in order to be able to save the state after warmup and restore it.
     int return_code;
     if (fStanConfig.denseMassMx)
-      return_code = RunHMC<stan_dense_t>(init_writer, interrupt, diagStream, logger, *init_context, procId);
+      return_code = RunHMC<stan_dense_t>(init_writer, interrupt, diagStream, logger, *init_context, chainId);
     else
-      return_code = RunHMC<stan_diag_t>(init_writer, interrupt, diagStream, logger, *init_context, procId);
+      return_code = RunHMC<stan_diag_t>(init_writer, interrupt, diagStream, logger, *init_context, chainId);
 
-    // Use Stan's wrapper function instead of the above.  Can be used for diagnostics as needed.
-//    auto return_code = stan::services::sample::hmc_nuts_diag_e_adapt(*this,
-//                                                                     init_context,
-//                                                                     fStanConfig.random_seed,
-//                                                                     procId,
-//                                                                     fStanConfig.init_radius,
-//                                                                     fStanConfig.num_warmup,
-//                                                                     fStanConfig.num_samples,
-//                                                                     fStanConfig.num_thin,
-//                                                                     fStanConfig.save_warmup,
-//                                                                     fStanConfig.refresh,
-//                                                                     fStanConfig.stepsize,
-//                                                                     fStanConfig.stepsize_jitter,
-//                                                                     fStanConfig.max_depth,
-//                                                                     fStanConfig.delta,
-//                                                                     fStanConfig.gamma,
-//                                                                     fStanConfig.kappa,
-//                                                                     fStanConfig.t0,
-//                                                                     fStanConfig.init_buffer,
-//                                                                     fStanConfig.term_buffer,
-//                                                                     fStanConfig.window,
-//                                                                     interrupt,
-//                                                                     *logger,
-//                                                                     init_writer,
-//                                                                     *fValueWriter,
-//                                                                     diagnostic_writer);
+    return return_code;
+  } // StanFitter::RunChain()
 
+  //----------------------------------------------------------------------
+  int StanFitter::RunChains(osc::IOscCalcAdjustable *seed,
+                            const SystShifts &systSeed,
+                            unsigned int procId) const
+  {
+    const unsigned int nChains = fStanConfig.chain;
 
-    // todo: something smarter here?  or just more output?
-    // also todo: need to check the Stan diagnostics for divergences, autocorrelation, etc.
-    if (return_code != stan::services::error_codes::OK)
-      std::cerr << "warning: Stan fit did not converge..." << std::endl;
+    // the chains each fill their own TTrees
+    ROOT::EnableThreadSafety();
 
-    auto bestSampleIdx = fMCMCSamples.BestFitSampleIdx();
+    // log_prob() writes into the calculator and shifts of the model it's called on,
+    // so each chain needs its own fitter.  (The prediction caches are already per-thread.)
+    std::vector<std::unique_ptr<StanFitter>> chains;
+    for (unsigned int chainIdx = 0; chainIdx < nChains; chainIdx++)
+    {
+      auto chain = std::make_unique<StanFitter>(fExpt, fVars, fSysts);
+      chain->fStanConfig = fStanConfig;
+      chain->fStanConfig.chain = 1;
+      chain->fPriorWarmup = &PriorWarmup();
+      chain->fWarmupLibraryEntry = fWarmupLibraryEntry;
+      chain->fReadaptWarmup = fReadaptWarmup;
+      chain->fJitterInit = true;
+      if (fOscCalcCache)
+        chain->fOscCalcCache.reset(fOscCalcCache->Copy());
+      chain->fValueWriter = std::make_unique<MemoryTupleWriter>(fStanConfig.num_samples > 0 ? &chain->fMCMCSamples : nullptr,
+                                                                NumWarmup() > 0 ? &chain->fMCMCWarmup : nullptr,
+                                                                chainIdx,
+                                                                fVars.size() + fSysts.size());
+      // the chains all write into the same directories.  the chain__ branch tells them apart
+      if (fStreamer)
+      {
+        if (fStanConfig.num_samples > 0)
+          chain->fMCMCSamples.StreamTo(fStreamer, "samples");
+        if (NumWarmup() > 0)
+          chain->fMCMCWarmup.StreamTo(fStreamer, "warmup");
+      }
+      chains.push_back(std::move(chain));
+    }
 
-    // Store results back to the "seed" variable
-    for (auto & var : fVars)
-      var->SetValue(seed, fMCMCSamples.SampleValue(var, bestSampleIdx));
+    // only the first chain gets to draw a progress bar
+    samplecounter_callback progress(std::size_t(NumWarmup()),
+                                    std::size_t(fStanConfig.num_samples));
+    stan::callbacks::interrupt noProgress;
 
-    // Store systematic results back into "systSeed".
-    // cast to stan-var so that we don't lose the value here
-    for (const auto & syst : fSysts)
-      systSeed.SetShift(syst, stan::math::var(fMCMCSamples.SampleValue(syst, bestSampleIdx)));
+    // the first evaluation of the likelihood can build lazily-made state that's
+    // shared between the chains (the prediction's fits, for instance).
+    // do it here, serially, rather than have the chains race each other to it
+    {
+      const StanFitter & first = *chains[0];
+      first.CreateCalculator(seed);
+      first.fShifts = systSeed.Copy();
+      auto init_context = first.BuildInitContext(seed, systSeed);
+      std::vector<int> params_i;
+      std::vector<double> params_r;
+      first.transform_inits(init_context, params_i, params_r, nullptr);
+      std::vector<double> gradient;
+      try
+      {
+        stan::model::log_prob_grad<true, true>(first, params_r, params_i, gradient);
+      }
+      catch (const std::exception &)
+      {
+        // RunChain() will report it properly
+      }
+    }
 
-    fMCMCSamples.RunDiagnostics(fStanConfig);
+#ifdef STAN_THREADS
+    const unsigned int nThreads = nChains;
+#else
+    // without STAN_THREADS, Stan's autodiff stack is one global shared by all threads
+    static std::once_flag warnOnce;
+    std::call_once(warnOnce, []()
+    {
+      std::cerr << "StanFitter: WARNING: CAFAna was built without STAN_THREADS, so several chains "
+                << "(StanConfig::chain > 1) are run one after another, not in parallel. "
+                << "Rebuild with -DUSE_STAN_THREADS=ON to run them concurrently" << std::endl;
+    });
+    const unsigned int nThreads = 1;
+#endif
 
-    return std::make_unique<StanFitSummary>(fMCMCSamples.SampleLL(bestSampleIdx));
-  } // StanFitter::FitHelperSeeded()
+    std::vector<int> codes(nChains, stan::services::error_codes::OK);
+    WorkerPool pool(nThreads);
+    pool.ParallelFor(nChains, [&](unsigned int chainIdx)
+    {
+      // with STAN_THREADS the autodiff stack is thread-local, but has to be set up in each new thread
+      stan::math::ChainableStack autodiffStack;
+
+      // distinct random number streams for every chain in every job
+      codes[chainIdx] = chains[chainIdx]->RunChain(seed, systSeed,
+                                                   chainIdx == 0 ? static_cast<stan::callbacks::interrupt&>(progress) : noProgress,
+                                                   procId * nChains + chainIdx);
+    });
+
+    // now merge.  the hyperparameters are those of the first chain
+    // and the sampling time is that of the slowest.
+    // const-casts for the same reason as in Fit()
+    auto & samples = const_cast<MCMCSamples&>(fMCMCSamples);
+    auto & warmup = const_cast<MCMCSamples&>(fMCMCWarmup);
+    double samplingTime = 0;
+    double warmupTime = 0;
+    for (unsigned int chainIdx = 0; chainIdx < nChains; chainIdx++)
+    {
+      if (fStanConfig.num_samples > 0)
+      {
+        samplingTime = std::max(samplingTime, chains[chainIdx]->fMCMCSamples.SamplingTime());
+        if (chainIdx == 0)
+          samples = std::move(chains[chainIdx]->fMCMCSamples);
+        else
+          samples.AdoptSamples(std::move(chains[chainIdx]->fMCMCSamples));
+      }
+      if (NumWarmup() > 0)
+      {
+        warmupTime = std::max(warmupTime, chains[chainIdx]->fMCMCWarmup.SamplingTime());
+        if (chainIdx == 0)
+          warmup = std::move(chains[chainIdx]->fMCMCWarmup);
+        else
+          warmup.AdoptSamples(std::move(chains[chainIdx]->fMCMCWarmup));
+      }
+    }
+    if (fStanConfig.num_samples > 0)
+      samples.SetSamplingTime(samplingTime);
+    if (NumWarmup() > 0)
+      warmup.SetSamplingTime(warmupTime);
+
+    for (const auto & code : codes)
+    {
+      if (code != stan::services::error_codes::OK)
+        return code;
+    }
+    return stan::services::error_codes::OK;
+  } // StanFitter::RunChains()
 
   //----------------------------------------------------------------------
   void StanFitter::get_param_names(std::vector<std::string>& names) const
@@ -403,6 +612,11 @@ namespace ana
       logprob += util::GetValAs<T>(ll);
 
     }
+    catch (const std::domain_error&)
+    {
+      // the sampler rejects the point and reports it itself
+      throw;
+    }
     catch (const std::exception& e)
     {
       // just catch to add a bit more info to make it easier to find
@@ -473,10 +687,68 @@ namespace ana
     fMCMCWarmup = std::move(warmup);
   }
 
+  //----------------------------------------------------------------------
+  void StanFitter::UseWarmupLibrary(std::shared_ptr<const StanWarmupLibrary> library,
+                                    const std::string & key,
+                                    unsigned int readaptWarmup)
+  {
+    if (readaptWarmup == 0)
+    {
+      std::cerr << "StanFitter::UseWarmupLibrary(): the step size needs some warmup iterations to re-adapt in." << std::endl;
+      abort();
+    }
+
+    fWarmupLibrary = library;
+    fWarmupLibraryKey = key;
+    fReadaptWarmup = readaptWarmup;
+  }
+
+  //----------------------------------------------------------------------
+  void StanFitter::AddWarmupToLibrary() const
+  {
+    const MCMCSamples & warmup = fMCMCWarmup;
+    if (!warmup.Hyperparams().invMetric || std::isnan(warmup.Hyperparams().stepSize))
+      return;
+
+    StanWarmupLibrary::Entry entry;
+    entry.key = fWarmupLibraryKey;
+    get_param_names(entry.paramNames);
+    entry.denseMassMx = fStanConfig.denseMassMx;
+    entry.delta = fStanConfig.delta;
+    entry.numWarmup = fStanConfig.num_warmup;
+    // (with several chains, these are the first chain's.  see RunChains())
+    entry.stepSize = warmup.Hyperparams().stepSize;
+    entry.invMetric = EigenMatrixXdFromTMatrixD(warmup.Hyperparams().invMetric.get());
+
+    // the last warmup point of each chain, for later fits to start their chains from.
+    // (only the last of any streamed-out samples is still around)
+    std::map<unsigned int, std::size_t> lastIdx;
+    for (std::size_t idx = warmup.NumSamples(); idx-- > 0 && lastIdx.size() < warmup.NumChains();)
+    {
+      if (idx < warmup.NumStreamed() && idx + 1 != warmup.NumSamples())
+        break;
+      lastIdx.emplace(warmup.SampleChain(idx), idx);
+    }
+    entry.points.resize(lastIdx.size(), fVars.size() + fSysts.size());
+    int row = 0;
+    for (const auto & chainIdx : lastIdx)
+    {
+      for (std::size_t varIdx = 0; varIdx < fVars.size(); varIdx++)
+        entry.points(row, varIdx) = warmup.SampleValue(fVars[varIdx], chainIdx.second);
+      for (std::size_t systIdx = 0; systIdx < fSysts.size(); systIdx++)
+        entry.points(row, fVars.size() + systIdx) = warmup.SampleValue(fSysts[systIdx], chainIdx.second);
+      row++;
+    }
+
+    const std::string fileName = fWarmupLibrary->Add(entry);
+    if (!fileName.empty() && fStanConfig.verbosity > StanConfig::Verbosity::kSilent)
+      std::cout << "StanWarmupLibrary: added the warmup for '" << fWarmupLibraryKey << "' as " << fileName << std::endl;
+  }
+
   //----------------------------------------------------------------------
   template <typename Sampler>
   int StanFitter::RunHMC(stan::callbacks::writer &init_writer,
-                         StanFitter::samplecounter_callback &interrupt,
+                         stan::callbacks::interrupt &interrupt,
                          std::ostream &diagStream,
                          const std::unique_ptr<stan::callbacks::stream_logger> &logger,
                          stan::io::array_var_context &init_context,
@@ -506,49 +778,115 @@ namespace ana
                                                                        *logger,
                                                                        init_writer);
 
-    Eigen::VectorXd inv_metric;
-    if (!fMCMCWarmup.Hyperparams().invMetric)
+    // the chains run by RunChains() would otherwise all start from the same seed point.
+    // scatter them uniformly by up to init_radius in the unconstrained space,
+    // using each chain's own random stream.  (a warmup library entry already
+    // gives each chain one of its own final points, see RunChain().)
+    if (fJitterInit && fStanConfig.init_radius > 0 && !fWarmupLibraryEntry)
+    {
+      boost::random::uniform_real_distribution<double> jitter(-fStanConfig.init_radius, fStanConfig.init_radius);
+      std::vector<double> jittered(cont_vector.size());
+      std::vector<int> disc_vector;
+      std::vector<double> gradient;
+      const unsigned int maxTries = 100;
+      unsigned int nTries = 0;
+      for ( ; nTries < maxTries; nTries++)
+      {
+        for (std::size_t i = 0; i < cont_vector.size(); i++)
+          jittered[i] = cont_vector[i] + jitter(rng);
+        try
+        {
+          const double lp = stan::model::log_prob_grad<true, true>(*this, jittered, disc_vector, gradient);
+          if (std::isfinite(lp) && std::all_of(gradient.begin(), gradient.end(), [](double g) { return std::isfinite(g); }))
+            break;
+        }
+        catch (const std::exception &)
+        {
+          // try another point
+        }
+      }
+      if (nTries < maxTries)
+        cont_vector = jittered;
+      else
+        logger->warn("Found no point with finite log-probability within init_radius of the seed; starting this chain at the seed itself");
+    }
+
+    // the full matrix for a dense metric, one column for a diagonal one
+    constexpr bool dense = std::is_same_v<Sampler, stan_dense_t>;
+    Eigen::MatrixXd inv_metric;
+    const MCMCSamples & warmup = PriorWarmup();
+    // from a library entry, only the step size is re-adapted (see below)
+    const bool fromLibrary = fWarmupLibraryEntry && !warmup.Hyperparams().invMetric;
+    if (warmup.Hyperparams().invMetric)
+    {
+      inv_metric = EigenMatrixXdFromTMatrixD(warmup.Hyperparams().invMetric.get());
+    }
+    else if (fromLibrary)
+    {
+      inv_metric = fWarmupLibraryEntry->invMetric;
+    }
+    else
     {
       try
       {
         stan::io::dump dmp = stan::services::util::create_unit_e_diag_inv_metric(num_params_r());
         stan::io::var_context &unit_e_metric = dmp;
-        inv_metric = stan::services::util::read_diag_inv_metric(unit_e_metric, num_params_r(), *logger);
-        stan::services::util::validate_diag_inv_metric(inv_metric, *logger);
+        Eigen::VectorXd unit = stan::services::util::read_diag_inv_metric(unit_e_metric, num_params_r(), *logger);
+        stan::services::util::validate_diag_inv_metric(unit, *logger);
+        if (dense)
+          inv_metric = unit.asDiagonal();
+        else
+          inv_metric = unit;
       }
       catch (const std::domain_error &e)
       {
         return_code = stan::services::error_codes::CONFIG;
       }
     }
-    else
-    {
-      inv_metric = EigenMatrixXdFromTMatrixD(fMCMCWarmup.Hyperparams().invMetric.get());
-    }
 
     if (return_code == stan::services::error_codes::OK)
     {
       Sampler sampler(*this, rng);
 
-      sampler.set_metric(inv_metric);
-      if (std::isnan(fMCMCWarmup.Hyperparams().stepSize))
-        sampler.set_nominal_stepsize(fStanConfig.stepsize);
+      // a prior warmup may have been run with the other kind of mass matrix
+      if constexpr (dense)
+      {
+        if (inv_metric.cols() == 1)
+          sampler.set_metric(Eigen::MatrixXd(inv_metric.col(0).asDiagonal()));
+        else
+          sampler.set_metric(inv_metric);
+      }
       else
-        sampler.set_nominal_stepsize(fMCMCWarmup.Hyperparams().stepSize);
+      {
+        if (inv_metric.cols() == 1)
+          sampler.set_metric(Eigen::VectorXd(inv_metric.col(0)));
+        else
+          sampler.set_metric(Eigen::VectorXd(inv_metric.diagonal()));
+      }
+      if (!std::isnan(warmup.Hyperparams().stepSize))
+        sampler.set_nominal_stepsize(warmup.Hyperparams().stepSize);
+      else if (fromLibrary)
+        sampler.set_nominal_stepsize(fWarmupLibraryEntry->stepSize);
+      else
+        sampler.set_nominal_stepsize(fStanConfig.stepsize);
       sampler.set_stepsize_jitter(fStanConfig.stepsize_jitter);
       sampler.set_max_depth(fStanConfig.max_depth);
 
-      sampler.get_stepsize_adaptation().set_mu(log(10 * fStanConfig.stepsize));
+      sampler.get_stepsize_adaptation().set_mu(log(10 * (fromLibrary ? fWarmupLibraryEntry->stepSize : fStanConfig.stepsize)));
       sampler.get_stepsize_adaptation().set_delta(fStanConfig.delta);
       sampler.get_stepsize_adaptation().set_gamma(fStanConfig.gamma);
       sampler.get_stepsize_adaptation().set_kappa(fStanConfig.kappa);
       sampler.get_stepsize_adaptation().set_t0(fStanConfig.t0);
 
-      sampler.set_window_params(fStanConfig.num_warmup,
-                                fStanConfig.init_buffer,
-                                fStanConfig.term_buffer,
-                                fStanConfig.window,
-                                *logger);
+      // Without any window parameters Stan's metric adaptation never opens a window
+      // (as it does for num_warmup < 20), so a library entry's metric is kept,
+      // rather than re-estimated from the few samples of the short re-adaptation
+      if (!fromLibrary)
+        sampler.set_window_params(NumWarmup(),
+                                  fStanConfig.init_buffer,
+                                  fStanConfig.term_buffer,
+                                  fStanConfig.window,
+                                  *logger);
 
       RunSampler(sampler, cont_vector, rng, interrupt, *logger, diagnostic_writer);
 
@@ -575,13 +913,13 @@ namespace ana
 
   // see at the top of this file for the type aliases
   template int StanFitter::RunHMC<stan_diag_t>(stan::callbacks::writer &init_writer,
-                                               StanFitter::samplecounter_callback &interrupt,
+                                               stan::callbacks::interrupt &interrupt,
                                                std::ostream &diagStream,
                                                const std::unique_ptr<stan::callbacks::stream_logger> &logger,
                                                stan::io::array_var_context &init_context,
                                                unsigned int procId) const;
   template int StanFitter::RunHMC<stan_dense_t>(stan::callbacks::writer &init_writer,
-                                                StanFitter::samplecounter_callback &interrupt,
+                                                stan::callbacks::interrupt &interrupt,
                                                 std::ostream &diagStream,
                                                 const std::unique_ptr<stan::callbacks::stream_logger> &logger,
                                                 stan::io::array_var_context &init_context,
@@ -613,7 +951,7 @@ namespace ana
     clock_t start, end;
     double warm_delta_t = 0;
 
-    if (fMCMCWarmup.NumSamples() < 1)
+    if (PriorWarmup().NumSamples() < 1)
     {
       sampler.engage_adaptation();
       try
@@ -639,9 +977,9 @@ namespace ana
 
       start = clock();
       stan::services::util::generate_transitions(sampler,
-                                                 fStanConfig.num_warmup,
+                                                 NumWarmup(),
                                                  0,
-                                                 fStanConfig.num_warmup + fStanConfig.num_samples,
+                                                 NumWarmup() + fStanConfig.num_samples,
                                                  fStanConfig.num_thin,
                                                  fStanConfig.refresh,
                                                  fStanConfig.save_warmup,
@@ -674,8 +1012,8 @@ namespace ana
     start = clock();
     stan::services::util::generate_transitions(sampler,
                                                fStanConfig.num_samples,
-                                               fStanConfig.num_warmup,
-                                               fStanConfig.num_warmup + fStanConfig.num_samples,
+                                               NumWarmup(),
+                                               NumWarmup() + fStanConfig.num_samples,
                                                fStanConfig.num_thin,
                                                fStanConfig.refresh,
                                                true,
@@ -712,6 +1050,12 @@ namespace ana
                                                     stan::callbacks::writer& diagnostic_writer) const;
 
 
+  //----------------------------------------------------------------------
+  void StanFitter::StreamSamplesTo(const std::string& fileName, std::size_t chunkSize)
+  {
+    fStreamer = std::make_shared<MCMCSampleStreamer>(fileName, chunkSize);
+  }
+
   //----------------------------------------------------------------------
   void StanFitter::TestGradients(osc::IOscCalcAdjustable *seed,
                                  SystShifts &systSeed) const
@@ -12,6 +12,7 @@
 #include "CAFAna/Fit/IFitter.h"
 #include "CAFAna/Fit/MCMCSamples.h"
 #include "CAFAna/Fit/StanConfig.h"
+#include "CAFAna/Fit/StanWarmupLibrary.h"
 #include "CAFAna/Core/StanTypedefs.h"
 #include "CAFAna/Core/Utilities.h"
 
@@ -74,8 +75,15 @@ namespace ana
           kPostWarmup,
       };
 
-      MemoryTupleWriter(MCMCSamples * samples, MCMCSamples * warmup = nullptr)
-        : fSamples(samples), fWarmup(warmup), fWhichSamples(warmup ? WhichSamples::kWarmup : WhichSamples::kPostWarmup)
+      /// \param samples  Where to put the post-warmup samples
+      /// \param warmup   Where to put the warmup samples
+      /// \param chainId  If non-negative, tag every sample with this chain id
+      ///                 (in the MCMCSamples::CHAIN_BRANCH_NAME column)
+      /// \param nParams  Number of fitted parameters, which come last in each sample.  Only needed when tagging
+      MemoryTupleWriter(MCMCSamples * samples, MCMCSamples * warmup = nullptr,
+                        int chainId = -1, std::size_t nParams = 0)
+        : fSamples(samples), fWarmup(warmup), fWhichSamples(warmup ? WhichSamples::kWarmup : WhichSamples::kPostWarmup),
+          fChainId(chainId), fNParams(nParams)
       {
         if (!samples && !warmup)
         {
@@ -91,11 +99,30 @@ namespace ana
 
       void operator()(const std::vector<double>& state) override
       {
-        (fWhichSamples == WhichSamples::kWarmup ? fWarmup : fSamples)->AddSample(state);
+        auto mcmcsamples = fWhichSamples == WhichSamples::kWarmup ? fWarmup : fSamples;
+        if (fChainId < 0)
+        {
+          mcmcsamples->AddSample(state);
+          return;
+        }
+
+        // the chain id goes in as the last diagnostic, just before the parameters
+        std::vector<double> tagged(state);
+        tagged.insert(tagged.end() - fNParams, fChainId);
+        mcmcsamples->AddSample(tagged);
       }
       void operator()(const std::vector<std::string>& names) override
       {
-        (fWhichSamples == WhichSamples::kWarmup ? fWarmup : fSamples)->SetNames(names);
+        auto mcmcsamples = fWhichSamples == WhichSamples::kWarmup ? fWarmup : fSamples;
+        if (fChainId < 0)
+        {
+          mcmcsamples->SetNames(names);
+          return;
+        }
+
+        std::vector<std::string> tagged(names);
+        tagged.insert(tagged.end() - fNParams, MCMCSamples::CHAIN_BRANCH_NAME);
+        mcmcsamples->SetNames(tagged);
       }
 
       template <typename Sampler>
@@ -120,6 +147,8 @@ namespace ana
 
       enum WhichSamples fWhichSamples;
 
+      int fChainId;
+      std::size_t fNParams;
   };
 
   /// \brief Fitter type that bolts the Stan fitting tools onto CAFAna.
@@ -223,9 +252,32 @@ namespace ana
       /// (Call this prior to calling Fit() in order to use it.)
       void ReuseWarmup(MCMCSamples && warmup);
 
+      /// \brief Start from the closest compatible warmup in \a library rather than running a full one.
+      ///
+      /// \a key names the samples being fitted (see StanWarmupLibrary).  If the library has a compatible
+      /// entry, only \a readaptWarmup warmup iterations are run, starting from the entry's last
+      /// warmup points, in which the step size is re-adapted but the entry's inverse metric is kept.
+      /// Otherwise the full StanConfig::num_warmup is run and its result added to the library.
+      /// Either way the compatibility report is printed unless the verbosity is kSilent,
+      /// and is available from WarmupLibraryReport().  (Not consulted if ReuseWarmup() was used.)
+      void UseWarmupLibrary(std::shared_ptr<const StanWarmupLibrary> library,
+                            const std::string & key,
+                            unsigned int readaptWarmup = 150);
+
+      /// How the warmup library matched up in the most recent Fit().  See UseWarmupLibrary()
+      const StanWarmupLibrary::CompatibilityReport & WarmupLibraryReport() const { return fWarmupLibraryReport; }
+
       /// Change the config used for Stan.  See the StanConfig struct documentation for ideas
       void SetStanConfig(const StanConfig& cfg) { fStanConfig = cfg; }
 
+      /// \brief Write the samples (and warmup) to \a fileName while fitting, rather than keeping them all in memory.
+      ///
+      /// The parameter values are written out every \a chunkSize samples and then dropped;
+      /// only the LLs, the diagnostics and the best-fit sample stay in GetSamples().
+      /// Read them back with MCMCSamples::LoadFrom(file, "samples") (or "warmup").
+      /// See MCMCSampleStreamer.
+      void StreamSamplesTo(const std::string& fileName, std::size_t chunkSize = 1000);
+
       /// Run Stan's test of its auto-differentiation (comparing to a finite-differences calculation)
       void TestGradients(osc::IOscCalcAdjustable *seed,
                          SystShifts &systSeed) const;
@@ -370,6 +422,37 @@ namespace ana
                                                    SystShifts &systSeed,
                                                    Verbosity verb) const override;
 
+      /// Number of warmup iterations actually run: fewer when starting from a warmup library entry
+      unsigned int NumWarmup() const { return fWarmupLibraryEntry ? fReadaptWarmup : fStanConfig.num_warmup; }
+
+      /// Add the hyperparameters and final points of the warmup just run to fWarmupLibrary
+      void AddWarmupToLibrary() const;
+
+      /// The warmup we continue from, if any.  For the per-chain copies made by RunChains()
+      /// this is the parent fitter's.
+      const MCMCSamples & PriorWarmup() const { return fPriorWarmup ? *fPriorWarmup : fMCMCWarmup; }
+
+      /// Run a single Markov chain, storing the samples via fValueWriter
+      ///
+      /// \param seed       Starting values of the oscillation parameters
+      /// \param systSeed   Starting values of the systematics
+      /// \param interrupt  Object whose operator()() will be called after every sample
+      /// \param chainId    Which stream of the random number generator to use
+      /// \return           Stan return code
+      int RunChain(osc::IOscCalcAdjustable *seed,
+                   const SystShifts &systSeed,
+                   stan::callbacks::interrupt &interrupt,
+                   unsigned int chainId) const;
+
+      /// Run fStanConfig.chain Markov chains concurrently, each in its own copy of this fitter
+      /// (and so with its own calculator, shifts and random number stream),
+      /// then merge their samples, tagged with the chain id, into ours.
+      ///
+      /// \return  The first non-OK Stan return code among the chains, if any
+      int RunChains(osc::IOscCalcAdjustable *seed,
+                    const SystShifts &systSeed,
+                    unsigned int procId) const;
+
       /// Run Stan with HMC.
       /// Lots of copy-paste from stan::services::sample::hmc_nuts_diag_e_adapt()
       /// (in stan/services/sample/hmc_nuts_diag_e_adapt.hpp)
@@ -384,7 +467,7 @@ namespace ana
       /// \return               Stan return code
       template <typename Sampler>
       int RunHMC(stan::callbacks::writer &init_writer,
-                 StanFitter::samplecounter_callback &interrupt,
+                 stan::callbacks::interrupt &interrupt,
                  std::ostream &diagStream,
                  const std::unique_ptr<stan::callbacks::stream_logger> &logger,
                  stan::io::array_var_context &init_context,
@@ -423,11 +506,23 @@ namespace ana
       StanConfig  fStanConfig;                           ///< Configuration passed to Stan for fitting.   See the StanConfig struct documentation for ideas
       MCMCSamples fMCMCSamples;
       MCMCSamples fMCMCWarmup;
+      const MCMCSamples * fPriorWarmup = nullptr;        ///< See PriorWarmup()
 
       /// See MemoryTupleWriter class documentation for more info.
       /// Pointer so it can be initialized lazily
       mutable std::unique_ptr<MemoryTupleWriter> fValueWriter;
 
+      std::shared_ptr<MCMCSampleStreamer> fStreamer;      ///< Only set if StreamSamplesTo() was called
+
+      std::shared_ptr<const StanWarmupLibrary> fWarmupLibrary;  ///< Only set if UseWarmupLibrary() was called
+      std::string fWarmupLibraryKey;
+      unsigned int fReadaptWarmup = 150;
+      mutable StanWarmupLibrary::CompatibilityReport fWarmupLibraryReport;
+      /// The library entry the current fit starts from, if any.  (Shared with the per-chain copies made by RunChains())
+      mutable std::shared_ptr<const StanWarmupLibrary::Entry> fWarmupLibraryEntry;
+      mutable bool fAddWarmupToLibrary = false;           ///< Did the library have nothing compatible for the current fit?
+      bool fJitterInit = false;                           ///< Scatter the starting point by init_radius?  (Set for the per-chain copies made by RunChains())
+
       /// stan::math::var objects have one 'gotcha' associated with them:
       /// after the gradient of the log-prob is calculated, Stan internally
       /// 'recovers' the memory associated with every stan::math::var's value
@@ -0,0 +1,363 @@
+#include "CAFAna/Fit/StanWarmupLibrary.h"
+
+#include "CAFAna/Core/Utilities.h"
+#include "CAFAna/Fit/StanConfig.h"
+
+#include "TFile.h"
+#include "TList.h"
+#include "TMatrixD.h"
+#include "TObjString.h"
+#include "TParameter.h"
+#include "TSystem.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+
+namespace ana
+{
+  namespace
+  {
+    /// Start of the file names of the entries for \a key.
+    /// (FNV-1a rather than std::hash, which isn't guaranteed to be the same from one build to the next)
+    std::string FilePrefix(const std::string & key)
+    {
+      std::uint64_t hash = 14695981039346656037ULL;
+      for (const unsigned char c : key)
+      {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+      }
+      std::stringstream ss;
+      ss << "warmup_" << std::hex << std::setw(16) << std::setfill('0') << hash << "_";
+      return ss.str();
+    }
+
+    std::string JoinNames(const std::vector<std::string> & names)
+    {
+      std::string ret;
+      for (const auto & name : names)
+        ret += (ret.empty() ? "" : ", ") + name;
+      return ret;
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void StanWarmupLibrary::CompatibilityReport::Print(std::ostream & os) const
+  {
+    if (Compatible())
+      os << "StanWarmupLibrary: reusing the warmup for '" << key << "' from " << entry->fileName << std::endl;
+    else
+    {
+      os << "StanWarmupLibrary: a fresh warmup is needed for '" << key << "'";
+      if (!closestFile.empty())
+        os << " (closest of " << nEntries << " entries: " << closestFile << ")";
+      os << std::endl;
+    }
+
+    for (const auto & problem : problems)
+      os << "  incompatible: " << problem << std::endl;
+    for (const auto & note : notes)
+      os << "  note: " << note << std::endl;
+  }
+
+  //----------------------------------------------------------------------
+  StanWarmupLibrary::StanWarmupLibrary(const std::string & dirName)
+    : fDirName(dirName)
+  {}
+
+  //----------------------------------------------------------------------
+  StanWarmupLibrary::CompatibilityReport
+  StanWarmupLibrary::FindClosest(const std::string & key,
+                                 const std::vector<std::string> & paramNames,
+                                 const StanConfig & cfg) const
+  {
+    const std::vector<Entry> entries = Entries(key);
+
+    CompatibilityReport best;
+    best.key = key;
+    best.nEntries = entries.size();
+    if (entries.empty())
+    {
+      best.problems.push_back("no entries for this key in " + fDirName);
+      return best;
+    }
+
+    int bestNumWarmup = 0;
+    for (std::size_t entryIdx = 0; entryIdx < entries.size(); entryIdx++)
+    {
+      CompatibilityReport report;
+      report.key = key;
+      report.nEntries = entries.size();
+      report.entry = Compare(entries[entryIdx], paramNames, cfg, report);
+
+      // compatible beats incompatible.  then the fewest differences, then the longest warmup
+      bool better;
+      if (entryIdx == 0)
+        better = true;
+      else if (report.Compatible() != best.Compatible())
+        better = report.Compatible();
+      else if (report.Compatible())
+        better = report.notes.size() < best.notes.size() ||
+                 (report.notes.size() == best.notes.size() && entries[entryIdx].numWarmup > bestNumWarmup);
+      else
+        better = report.problems.size() < best.problems.size();
+
+      if (better)
+      {
+        best = std::move(report);
+        bestNumWarmup = entries[entryIdx].numWarmup;
+      }
+    }
+
+    return best;
+  }
+
+  //----------------------------------------------------------------------
+  std::shared_ptr<const StanWarmupLibrary::Entry>
+  StanWarmupLibrary::Compare(const Entry & entry,
+                             const std::vector<std::string> & paramNames,
+                             const StanConfig & cfg,
+                             CompatibilityReport & report)
+  {
+    report.closestFile = entry.fileName;
+    report.problems.clear();
+    report.notes.clear();
+
+    // where each of the parameters we want is in the entry
+    std::vector<int> idx;
+    std::vector<std::string> missing;
+    for (const auto & name : paramNames)
+    {
+      auto itr = std::find(entry.paramNames.begin(), entry.paramNames.end(), name);
+      if (itr == entry.paramNames.end())
+        missing.push_back(name);
+      else
+        idx.push_back(std::distance(entry.paramNames.begin(), itr));
+    }
+    std::vector<std::string> extra;
+    for (const auto & name : entry.paramNames)
+    {
+      if (std::find(paramNames.begin(), paramNames.end(), name) == paramNames.end())
+        extra.push_back(name);
+    }
+
+    if (!missing.empty())
+      report.problems.push_back("no adapted metric for " + JoinNames(missing));
+    if (!extra.empty())
+      report.notes.push_back("marginalizing the metric over parameters not being fitted: " + JoinNames(extra));
+
+    if (cfg.denseMassMx && !entry.denseMassMx)
+      report.problems.push_back("a dense mass matrix was requested, but the entry's is diagonal");
+    else if (!cfg.denseMassMx && entry.denseMassMx)
+      report.notes.push_back("using the diagonal of the entry's dense mass matrix");
+
+    if (entry.delta != cfg.delta)
+      report.notes.push_back("the step size was adapted for delta = " + std::to_string(entry.delta) +
+                             ", not " + std::to_string(cfg.delta));
+
+    // the step size is re-adapted, but the metric isn't
+    if (entry.numWarmup < cfg.num_warmup)
+      report.notes.push_back("the metric was adapted in a warmup of " + std::to_string(entry.numWarmup) +
+                             " iterations, shorter than the " + std::to_string(cfg.num_warmup) + " requested");
+
+    const int nEntryParams = entry.paramNames.size();
+    if (entry.invMetric.rows() != nEntryParams || entry.invMetric.cols() != (entry.denseMassMx ? nEntryParams : 1) ||
+        !entry.invMetric.allFinite() || !(entry.stepSize > 0))
+      report.problems.push_back("the entry's hyperparameters are malformed");
+
+    if (!report.problems.empty())
+      return nullptr;
+
+    // now pick out (and reorder) the parameters we want
+    const int n = idx.size();
+    auto ret = std::make_shared<Entry>(entry);
+    ret->paramNames = paramNames;
+    ret->denseMassMx = cfg.denseMassMx;
+    if (cfg.denseMassMx)
+    {
+      // the inverse metric estimates the posterior covariance,
+      // and the block of the parameters we want is their marginal covariance
+      ret->invMetric.resize(n, n);
+      for (int i = 0; i < n; i++)
+      {
+        for (int j = 0; j < n; j++)
+          ret->invMetric(i, j) = entry.invMetric(idx[i], idx[j]);
+      }
+      if (Eigen::LLT<Eigen::MatrixXd>(ret->invMetric).info() != Eigen::Success)
+        report.problems.push_back("the entry's inverse metric isn't positive definite");
+    }
+    else
+    {
+      ret->invMetric.resize(n, 1);
+      for (int i = 0; i < n; i++)
+        ret->invMetric(i, 0) = entry.invMetric(idx[i], entry.denseMassMx ? idx[i] : 0);
+      if (!(ret->invMetric.array() > 0).all())
+        report.problems.push_back("the entry's inverse metric isn't positive definite");
+    }
+
+    if (entry.points.cols() == nEntryParams)
+    {
+      ret->points.resize(entry.points.rows(), n);
+      for (int i = 0; i < n; i++)
+        ret->points.col(i) = entry.points.col(idx[i]);
+    }
+    else
+      ret->points.resize(0, n);
+
+    if (!report.problems.empty())
+      return nullptr;
+
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  std::string StanWarmupLibrary::Add(const Entry & entry) const
+  {
+    gSystem->mkdir(fDirName.c_str(), true);
+
+    // unique even among jobs sharing the library from different machines
+    static std::atomic<unsigned int> nAdded(0);
+    const std::string fileName = fDirName + "/" + FilePrefix(entry.key) +
+                                 gSystem->HostName() + "_" + std::to_string(gSystem->GetPid()) + "_" +
+                                 std::to_string(std::time(nullptr)) + "_" + std::to_string(nAdded++) + ".root";
+
+    // written under a temporary name and then renamed, so that
+    // nobody looking up an entry ever sees it half-written
+    const std::string tmpName = fileName + ".tmp";
+
+    TDirectory * oldDir = gDirectory;
+    {
+      TFile f(tmpName.c_str(), "RECREATE");
+      if (f.IsZombie())
+      {
+        std::cerr << "StanWarmupLibrary: couldn't write " << tmpName << ".  Warmup not saved" << std::endl;
+        if (oldDir)
+          oldDir->cd();
+        return "";
+      }
+
+      TDirectory * dir = f.mkdir("warmup");
+      dir->cd();
+
+      TObjString("StanWarmupLibraryEntry").Write("type");
+      TObjString(entry.key.c_str()).Write("key");
+
+      TList paramNames;
+      paramNames.SetOwner();
+      for (const auto & name : entry.paramNames)
+        paramNames.AddLast(new TObjString(name.c_str()));
+      paramNames.Write("paramNames", TObject::kSingleKey);
+
+      TParameter<bool>("denseMassMx", entry.denseMassMx).Write();
+      TParameter<double>("delta", entry.delta).Write();
+      TParameter<int>("numWarmup", entry.numWarmup).Write();
+      TParameter<double>("stepsize", entry.stepSize).Write();
+      TMatrixDFromEigenMatrixXd(entry.invMetric).Write("inv_metric");
+      if (entry.points.rows() > 0)
+        TMatrixDFromEigenMatrixXd(entry.points).Write("points");
+
+      dir->Write();
+      f.Close();
+    }
+    if (oldDir)
+      oldDir->cd();
+
+    if (gSystem->Rename(tmpName.c_str(), fileName.c_str()) != 0)
+    {
+      std::cerr << "StanWarmupLibrary: couldn't move " << tmpName << " to " << fileName << ".  Warmup not saved" << std::endl;
+      return "";
+    }
+
+    return fileName;
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<StanWarmupLibrary::Entry> StanWarmupLibrary::Entries(const std::string & key) const
+  {
+    std::vector<std::string> fileNames;
+    if (void * dir = gSystem->OpenDirectory(fDirName.c_str()))
+    {
+      // (the ".tmp" files still being written don't end in ".root")
+      const std::string prefix = FilePrefix(key);
+      const std::string suffix = ".root";
+      while (const char * ent = gSystem->GetDirEntry(dir))
+      {
+        const std::string name = ent;
+        if (name.compare(0, prefix.size(), prefix) == 0 && name.size() > suffix.size() &&
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+          fileNames.push_back(fDirName + "/" + name);
+      }
+      gSystem->FreeDirectory(dir);
+    }
+    // so that ties in FindClosest() always go the same way
+    std::sort(fileNames.begin(), fileNames.end());
+
+    std::vector<Entry> ret;
+    for (const auto & fileName : fileNames)
+    {
+      auto entry = LoadEntry(fileName);
+      // different keys can share a hash
+      if (entry && entry->key == key)
+        ret.push_back(std::move(*entry));
+    }
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  std::unique_ptr<StanWarmupLibrary::Entry> StanWarmupLibrary::LoadEntry(const std::string & fileName)
+  {
+    TDirectory * oldDir = gDirectory;
+    TFile f(fileName.c_str());
+    if (oldDir)
+      oldDir->cd();
+    if (f.IsZombie())
+      return nullptr;
+
+    TDirectory * dir = f.GetDirectory("warmup");
+    if (!dir)
+      return nullptr;
+
+    std::unique_ptr<TObjString> tag(dynamic_cast<TObjString*>(dir->Get("type")));
+    if (!tag || tag->GetString() != "StanWarmupLibraryEntry")
+      return nullptr;
+
+    std::unique_ptr<TObjString> key(dynamic_cast<TObjString*>(dir->Get("key")));
+    std::unique_ptr<TList> paramNames(dynamic_cast<TList*>(dir->Get("paramNames")));
+    std::unique_ptr<TParameter<bool>> dense(dynamic_cast<TParameter<bool>*>(dir->Get("denseMassMx")));
+    std::unique_ptr<TParameter<double>> delta(dynamic_cast<TParameter<double>*>(dir->Get("delta")));
+    std::unique_ptr<TParameter<int>> numWarmup(dynamic_cast<TParameter<int>*>(dir->Get("numWarmup")));
+    std::unique_ptr<TParameter<double>> stepSize(dynamic_cast<TParameter<double>*>(dir->Get("stepsize")));
+    std::unique_ptr<TMatrixD> invMetric(dynamic_cast<TMatrixD*>(dir->Get("inv_metric")));
+    if (!key || !paramNames || !dense || !delta || !numWarmup || !stepSize || !invMetric)
+    {
+      std::cerr << "StanWarmupLibrary: skipping incomplete entry " << fileName << std::endl;
+      return nullptr;
+    }
+    paramNames->SetOwner();
+
+    auto entry = std::make_unique<Entry>();
+    entry->key = key->GetString().Data();
+    for (const TObject * nameObj : *paramNames)
+    {
+      if (auto str = dynamic_cast<const TObjString*>(nameObj))
+        entry->paramNames.emplace_back(str->GetName());
+    }
+    entry->denseMassMx = dense->GetVal();
+    entry->delta = delta->GetVal();
+    entry->numWarmup = numWarmup->GetVal();
+    entry->stepSize = stepSize->GetVal();
+    entry->invMetric = EigenMatrixXdFromTMatrixD(invMetric.get());
+
+    std::unique_ptr<TMatrixD> points(dynamic_cast<TMatrixD*>(dir->Get("points")));
+    if (points)
+      entry->points = EigenMatrixXdFromTMatrixD(points.get());
+
+    entry->fileName = fileName;
+
+    return entry;
+  }
+}
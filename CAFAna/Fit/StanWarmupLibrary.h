@@ -0,0 +1,94 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+
+namespace ana
+{
+  struct StanConfig;
+
+  /// \brief On-disk library of adapted Stan step sizes and inverse metrics, for reuse by later fits
+  ///
+  /// Fake-data and systematic-variation jobs fitting the same parameters to the same
+  /// samples all end up adapting much the same hyperparameters, and the warmup that does it
+  /// is often half the running time.  A StanFitter given a library (StanFitter::UseWarmupLibrary())
+  /// starts from the closest compatible entry and only runs a short window re-adapting the
+  /// step size.  When there's nothing compatible it does the full warmup and adds the result.
+  ///
+  /// Entries are keyed by a name of the user's choosing for the samples being fitted
+  /// (eg. "ndfd_allsyst"), together with the names of the fitted parameters and the
+  /// mass matrix type.  Each entry is its own ROOT file in the library directory,
+  /// so any number of jobs can share one library.
+  class StanWarmupLibrary
+  {
+    public:
+      /// The results of one warmup
+      struct Entry
+      {
+        std::string key;                     ///< Identifies the samples being fitted
+        std::vector<std::string> paramNames; ///< Short names of the fit vars, then the systs
+        bool denseMassMx = false;
+        double delta = 0;                    ///< Target acceptance statistic the step size was adapted to
+        int numWarmup = 0;                   ///< Number of warmup iterations the entry came from
+        double stepSize = 0;
+        Eigen::MatrixXd invMetric;           ///< In Stan's unconstrained space.  NxN if dense, Nx1 if diagonal
+        Eigen::MatrixXd points;              ///< Last warmup point of each chain (one per row), for starting chains from
+        std::string fileName;                ///< Where the entry was read from
+      };
+
+      /// The outcome of looking for a warmup to reuse.  See FindClosest()
+      struct CompatibilityReport
+      {
+        /// The closest compatible entry, converted to the parameters and mass matrix type asked for.
+        /// Null if a fresh warmup is needed
+        std::shared_ptr<const Entry> entry;
+
+        std::string key;
+        std::size_t nEntries = 0;            ///< How many entries there were for this key
+        std::string closestFile;             ///< The entry that came closest, compatible or not
+        std::vector<std::string> problems;   ///< Why the closest entry can't be used
+        std::vector<std::string> notes;      ///< Differences that the short re-adaptation takes care of
+
+        bool Compatible() const { return bool(entry); }
+
+        void Print(std::ostream & os = std::cout) const;
+      };
+
+      /// \param dirName  Directory holding the entries.  Created when the first entry is added
+      explicit StanWarmupLibrary(const std::string & dirName);
+
+      /// \brief Find the entry for \a key most suited to fitting \a paramNames with configuration \a cfg
+      ///
+      /// An entry can only be used if it has all the parameters in \a paramNames
+      /// (extra ones are marginalized away), and if it's dense when a dense mass matrix is wanted.
+      /// Of those, the one with the fewest other differences wins, then the one with the longest warmup.
+      CompatibilityReport FindClosest(const std::string & key,
+                                      const std::vector<std::string> & paramNames,
+                                      const StanConfig & cfg) const;
+
+      /// Write \a entry out as a new file in the library.  Returns the file name
+      std::string Add(const Entry & entry) const;
+
+      /// All the entries in the library with key \a key
+      std::vector<Entry> Entries(const std::string & key) const;
+
+      const std::string & DirName() const { return fDirName; }
+
+    protected:
+      /// Nullptr if \a fileName isn't a library entry
+      static std::unique_ptr<Entry> LoadEntry(const std::string & fileName);
+
+      /// Fill \a report with how \a entry differs from what's asked for.
+      /// If it's usable, also return it converted to \a paramNames and the requested mass matrix type
+      static std::shared_ptr<const Entry> Compare(const Entry & entry,
+                                                  const std::vector<std::string> & paramNames,
+                                                  const StanConfig & cfg,
+                                                  CompatibilityReport & report);
+
+      std::string fDirName;
+  };
+}
@@ -72,6 +72,18 @@ namespace ana
     return Predict(calc);
   }
 
+  //----------------------------------------------------------------------
+  void IPrediction::PredictSystInto(osc::IOscCalc* calc,
+                                    const SystShifts& syst,
+                                    double pot,
+                                    Eigen::Ref<Eigen::ArrayXd> ret,
+                                    const BinRanges* /*bins*/) const
+  {
+    const Eigen::ArrayXd pred = PredictSyst(calc, syst).GetEigen(pot);
+    assert(pred.size() == ret.size());
+    ret = pred;
+  }
+
   //----------------------------------------------------------------------
   Spectrum IPrediction::PredictSyst(osc::IOscCalcStan* calc,
                                     const SystShifts& syst) const
@@ -7,6 +7,8 @@
 #include "CAFAna/Core/OscillatableSpectrum.h"
 
 #include <iostream>
+#include <utility>
+#include <vector>
 
 class TDirectory;
 
@@ -58,6 +60,12 @@ namespace ana
 
   class SystShifts;
 
+  /// \brief A subset of the bins of a spectrum
+  ///
+  /// Stored as [begin, end) ranges of indices into the flattened array
+  /// (including under/overflow), so that loops over them stay contiguous
+  typedef std::vector<std::pair<int, int>> BinRanges;
+
   /// Standard interface to all prediction techniques
   class IPrediction
   {
@@ -70,6 +78,21 @@ namespace ana
     virtual Spectrum PredictSyst(osc::IOscCalc* calc, const SystShifts& syst) const;
     virtual Spectrum PredictSyst(osc::IOscCalcStan* calc, const SystShifts& syst) const;
 
+    /// \brief Equivalent to PredictSyst(calc, syst).GetEigen(pot), but
+    /// writing into a caller-owned array
+    ///
+    /// \a ret must already have the right size (including under/overflow).
+    /// The default implementation goes via \ref PredictSyst. Predictions that
+    /// can avoid the temporaries should override it.
+    ///
+    /// \param bins If set, only these bins of \a ret need to be filled. The
+    ///             contents of the others are unspecified.
+    virtual void PredictSystInto(osc::IOscCalc* calc,
+                                 const SystShifts& syst,
+                                 double pot,
+                                 Eigen::Ref<Eigen::ArrayXd> ret,
+                                 const BinRanges* bins = 0) const;
+
     virtual Spectrum PredictComponent(osc::IOscCalc* calc,
                                       Flavors::Flavors_t flav,
                                       Current::Current_t curr,
@@ -10,6 +10,10 @@
 #include "TObjString.h"
 #include "TH1D.h"
 
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+
 namespace ana
 {
   //----------------------------------------------------------------------
@@ -42,6 +46,49 @@ namespace ana
                             Sign::kBoth);
   }
 
+  namespace
+  {
+    struct FusedChannel
+    {
+      Flavors::Flavors_t flav;
+      Sign::Sign_t sign;
+      int from, to;
+      const OscillatableSpectrum& (IExtrap::*comp)();
+    };
+
+    const FusedChannel kFusedChannels[] = {
+      {Flavors::kNuEToNuE,    Sign::kNu,     +12, +12, &IExtrap::NueSurvComponent},
+      {Flavors::kNuEToNuE,    Sign::kAntiNu, -12, -12, &IExtrap::AntiNueSurvComponent},
+      {Flavors::kNuEToNuMu,   Sign::kNu,     +12, +14, &IExtrap::NumuAppComponent},
+      {Flavors::kNuEToNuMu,   Sign::kAntiNu, -12, -14, &IExtrap::AntiNumuAppComponent},
+      {Flavors::kNuEToNuTau,  Sign::kNu,     +12, +16, &IExtrap::TauFromEComponent},
+      {Flavors::kNuEToNuTau,  Sign::kAntiNu, -12, -16, &IExtrap::AntiTauFromEComponent},
+      {Flavors::kNuMuToNuE,   Sign::kNu,     +14, +12, &IExtrap::NueAppComponent},
+      {Flavors::kNuMuToNuE,   Sign::kAntiNu, -14, -12, &IExtrap::AntiNueAppComponent},
+      {Flavors::kNuMuToNuMu,  Sign::kNu,     +14, +14, &IExtrap::NumuSurvComponent},
+      {Flavors::kNuMuToNuMu,  Sign::kAntiNu, -14, -14, &IExtrap::AntiNumuSurvComponent},
+      {Flavors::kNuMuToNuTau, Sign::kNu,     +14, +16, &IExtrap::TauFromMuComponent},
+      {Flavors::kNuMuToNuTau, Sign::kAntiNu, -14, -16, &IExtrap::AntiTauFromMuComponent}
+    };
+  }
+
+  //----------------------------------------------------------------------
+  const FusedOscillator& PredictionExtrap::GetFused() const
+  {
+    std::call_once(fFusedOnce, [this]()
+    {
+      std::vector<const OscillatableSpectrum*> specs;
+      std::vector<std::pair<int, int>> chans;
+      for(const FusedChannel& ch: kFusedChannels){
+        specs.push_back(&(fExtrap->*ch.comp)());
+        chans.emplace_back(ch.from, ch.to);
+      }
+      fFused = std::make_unique<const FusedOscillator>(specs, chans);
+    });
+
+    return *fFused;
+  }
+
   //----------------------------------------------------------------------
   // the actual implementation
   template<typename T>
@@ -53,7 +100,17 @@ namespace ana
     Spectrum ret = fExtrap->NCComponent(); // Get binning
     ret.Clear();
 
-    if(curr & Current::kCC){
+    if constexpr(std::is_same_v<T, double>){
+      if(curr & Current::kCC){
+        std::vector<bool> use(std::size(kFusedChannels));
+        for(unsigned int c = 0; c < use.size(); ++c){
+          use[c] = flav & kFusedChannels[c].flav && sign & kFusedChannels[c].sign;
+        }
+        if(std::find(use.begin(), use.end(), true) != use.end())
+          ret += GetFused().Oscillated(calc, use);
+      }
+    }
+    else if(curr & Current::kCC){
       if(flav & Flavors::kNuEToNuE    && sign & Sign::kNu)     ret += fExtrap->NueSurvComponent().    Oscillated(calc, +12, +12);
       if(flav & Flavors::kNuEToNuE    && sign & Sign::kAntiNu) ret += fExtrap->AntiNueSurvComponent().Oscillated(calc, -12, -12);
 
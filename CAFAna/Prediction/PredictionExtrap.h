@@ -3,6 +3,9 @@
 #include "CAFAna/Prediction/IPrediction.h"
 #include "CAFAna/Extrap/IExtrap.h"
 
+#include <memory>
+#include <mutex>
+
 namespace ana
 {
   //  class IExtrap;
@@ -53,6 +56,13 @@ namespace ana
                                Current::Current_t curr,
                                Sign::Sign_t sign) const;
 
+    /// All twelve CC components, for the double-precision path. Built on
+    /// first use
+    const FusedOscillator& GetFused() const;
+
     IExtrap* fExtrap;
+
+    mutable std::once_flag fFusedOnce;
+    mutable std::unique_ptr<const FusedOscillator> fFused;
   };
 }
@@ -7,6 +7,7 @@
 #include "CAFAna/Core/Registry.h"
 #include "CAFAna/Core/Stan.h"
 #include "CAFAna/Core/Utilities.h"
+#include "CAFAna/Core/WorkerPool.h"
 
 #include "TDirectory.h"
 #include "TH2.h"
@@ -25,6 +26,7 @@
 
 #include <algorithm>
 #include <malloc.h>
+#include <mutex>
 
 #ifdef USE_PREDINTERP_OMP
 #include <omp.h>
@@ -247,6 +249,11 @@ namespace ana
   //----------------------------------------------------------------------
   void PredictionInterp::InitFits() const
   {
+    // Predictions can be requested from several threads at once (parallel
+    // fits, sub-experiments and gradient components), so only one of them
+    // does the initialization and the rest wait for it
+    std::lock_guard<std::mutex> lock(fInitMutex);
+
     // No systs
     if(fPreds.empty()){
       if(fBinning.POT() > 0 || fBinning.Livetime() > 0) return;
@@ -366,6 +373,46 @@ namespace ana
                                 Sign::kBoth);
   }
 
+  //----------------------------------------------------------------------
+  void PredictionInterp::PredictSystInto(osc::IOscCalc* calc,
+                                         const SystShifts& shift,
+                                         double pot,
+                                         Eigen::Ref<Eigen::ArrayXd> ret,
+                                         const BinRanges* bins) const
+  {
+    InitFits();
+
+    CheckSysts(shift);
+
+    const TMD5* hash = calc ? calc->GetParamsHash() : 0;
+
+    ret.setZero();
+
+    AddShiftedComponent(calc, hash, shift, Flavors::kNuEToNuE,    Current::kCC, Sign::kBoth, kNueSurv,  pot, ret, bins);
+    AddShiftedComponent(calc, hash, shift, Flavors::kNuEToNuMu,   Current::kCC, Sign::kBoth, kOther,    pot, ret, bins);
+    AddShiftedComponent(calc, hash, shift, Flavors::kNuEToNuTau,  Current::kCC, Sign::kBoth, kOther,    pot, ret, bins);
+
+    AddShiftedComponent(calc, hash, shift, Flavors::kNuMuToNuE,   Current::kCC, Sign::kBoth, kNueApp,   pot, ret, bins);
+    AddShiftedComponent(calc, hash, shift, Flavors::kNuMuToNuMu,  Current::kCC, Sign::kBoth, kNumuSurv, pot, ret, bins);
+    AddShiftedComponent(calc, hash, shift, Flavors::kNuMuToNuTau, Current::kCC, Sign::kBoth, kOther,    pot, ret, bins);
+
+    AddShiftedComponent(calc, hash, shift, Flavors::kAll,         Current::kNC, Sign::kBoth, kNC,       pot, ret, bins);
+
+    delete hash;
+  }
+
+  //----------------------------------------------------------------------
+  void PredictionInterp::CheckSysts(const SystShifts& shift) const
+  {
+    // Check that we're able to handle all the systs we were passed
+    shift.ForEachActiveSyst([this](const ISyst* syst){
+      if(find_pred(syst) == fPreds.end()){
+        std::cerr << "This PredictionInterp is not set up to handle the requested systematic: " << syst->ShortName() << std::endl;
+        abort();
+      }
+    });
+  }
+
   //----------------------------------------------------------------------
   Spectrum PredictionInterp::ShiftSpectrum(const Spectrum &s, CoeffsType type,
                                            bool nubar,
@@ -398,7 +445,8 @@ namespace ana
                                    T* arr,
                                    CoeffsType type,
                                    bool nubar,
-                                   const SystShifts& shift) const
+                                   const SystShifts& shift,
+                                   const BinRanges* bins) const
   {
     static_assert(std::is_same_v<T, double> ||
                   std::is_same_v<T, stan::math::var>,
@@ -411,7 +459,15 @@ namespace ana
       abort();
     }
 
+    // Either all the bins, or only those requested
+    const unsigned int nRanges = bins ? bins->size() : 1;
+    auto RangeBegin = [&](unsigned int r){return bins ? (*bins)[r].first : 0;};
+    auto RangeEnd = [&](unsigned int r){return bins ? (*bins)[r].second : int(N);};
+
 #ifdef USE_PREDINTERP_OMP
+    // Share the thread budget with any enclosing parallelism (eg
+    // MultiExperiment), and never more than we have corrections for
+    const int nThreads = std::min(4u, LocalThreadBudget());
     T corr[4][N];
     for (unsigned int i = 0; i < 4; ++i) {
       for (unsigned int j = 0; j < N; ++j) {
@@ -425,7 +481,9 @@ namespace ana
 
     size_t NPreds = fPreds.size();
 
-    #pragma omp parallel for
+#ifdef USE_PREDINTERP_OMP
+    #pragma omp parallel for num_threads(nThreads)
+#endif
     for (size_t p_it = 0; p_it < NPreds; ++p_it) {
       const ISyst *syst = fPreds[p_it].first;
       const ShiftedPreds &sp = fPreds[p_it].second;
@@ -449,29 +507,28 @@ namespace ana
       const T x_sqr = util::sqr(x);
 
 #ifdef USE_PREDINTERP_OMP
-      ShiftSpectrumKernel(fits, N, x, x_sqr, x_cube,
-                          corr[omp_get_thread_num()]);
+      T* c = corr[omp_get_thread_num()];
 #else
-      ShiftSpectrumKernel(fits, N, x, x_sqr, x_cube, corr);
+      T* c = corr;
 #endif
-    } // end for syst
 
-#ifdef USE_PREDINTERP_OMP
-    for (unsigned int i = 1; i < 4; ++i) {
-      for (unsigned int j = 0; j < N; ++j) {
-        corr[0][j] *= corr[i][j];
-      };
-    }
-#endif
+      // Keep the kernel running over contiguous blocks so it still vectorizes
+      for(unsigned int r = 0; r < nRanges; ++r){
+        const int b0 = RangeBegin(r);
+        ShiftSpectrumKernel(fits+b0, RangeEnd(r)-b0, x, x_sqr, x_cube, c+b0);
+      }
+    } // end for syst
 
-    for (unsigned int n = 0; n < N; ++n) {
-      if (arr[n] > fMinMCStats) {
+    for(unsigned int r = 0; r < nRanges; ++r){
+      for(int n = RangeBegin(r); n < RangeEnd(r); ++n){
 #ifdef USE_PREDINTERP_OMP
-        // std::max() doesn't work with stan::math::var
-        arr[n] *= (corr[0][n] > 0.) ? corr[0][n] : 0.;
+        for(unsigned int i = 1; i < 4; ++i) corr[0][n] *= corr[i][n];
+        const T& c = corr[0][n];
 #else
-        arr[n] *= (corr[n] > 0.) ? corr[n] : 0.;
+        const T& c = corr[n];
 #endif
+        // std::max() doesn't work with stan::math::var
+        if(arr[n] > fMinMCStats) arr[n] *= (c > 0.) ? c : 0.;
       }
     }
   }
@@ -518,19 +575,23 @@ namespace ana
               ShiftedComponent(calc, hash, shift, flav, curr, Sign::kNu,     type));
     }
 
+    // Should the interpolation use the nubar fits?
+    const bool nubar = (fSplitBySign && sign == Sign::kAntiNu);
+
+    // stan::math::vars get reset every time Stan's log_prob() is called, so
+    // they have their own kind of cache
+    if constexpr(std::is_same_v<T, stan::math::var>){
+      return ShiftSpectrum(NomStan(calc, hash, flav, curr, sign), type, nubar, shift);
+    }
+
     // Must be the base case of the recursion to use the cache. Otherwise we
     // can cache systematically shifted versions of our children, which is
     // wrong. Also, some calculators won't hash themselves.
-    // Moreover, caching is not going to work with stan::math::vars
-    // since they get reset every time Stan's log_prob() is called.
-    const bool canCache = (hash != 0) && !std::is_same<T, stan::math::var>::value;
+    const bool canCache = (hash != 0);
 
     const Key_t key = {flav, curr, sign};
     auto it = fNomCache->find(key);
 
-    // Should the interpolation use the nubar fits?
-    const bool nubar = (fSplitBySign && sign == Sign::kAntiNu);
-
     // We have the nominal for this exact combination of flav, curr, sign, calc
     // stored.  Shift it and return.
     if(canCache && it != fNomCache->end() && it->second.hash == *hash){
@@ -552,6 +613,195 @@ namespace ana
     return ShiftSpectrum(nom, type, nubar, shift);
   }
 
+  //----------------------------------------------------------------------
+  Spectrum PredictionInterp::NomStan(osc::IOscCalcStan* calc,
+                                     const TMD5* hash,
+                                     Flavors::Flavors_t flav,
+                                     Current::Current_t curr,
+                                     Sign::Sign_t sign) const
+  {
+    static const bool enabled = getenv("CAFANA_PRED_STAN_OSC_CACHE") ? bool(atoi(getenv("CAFANA_PRED_STAN_OSC_CACHE"))) : true;
+
+    auto adj = dynamic_cast<osc::IOscCalcAdjustableStan*>(calc);
+    if(!enabled || !adj || !hash) return fPredNom->PredictComponent(calc, flav, curr, sign);
+
+    // Everything the oscillation depends on. The ones after L and rho are
+    // the ones that can be fitted, and so need derivatives
+    const std::vector<stan::math::var> pars = {adj->GetDmsq21(), adj->GetDmsq32(),
+                                               adj->GetTh12(), adj->GetTh13(),
+                                               adj->GetTh23(), adj->GetdCP()};
+    std::vector<double> parVals = {adj->GetL(), adj->GetRho()};
+    for(const stan::math::var& p: pars) parVals.push_back(p.val());
+
+    const Key_t key = {flav, curr, sign};
+    auto it = fStanNomCache->find(key);
+
+    const std::type_index calcType(typeid(*calc));
+
+    if(it == fStanNomCache->end() || !(it->second.hash == *hash) ||
+       it->second.calcType != calcType || it->second.params != parVals){
+      // New oscillation parameters. Calculate the prediction on the main
+      // stack just as if there were no cache (a Jacobian costs one sweep per
+      // bin, which is only worth it if we come back here), but remember the
+      // values
+      Spectrum nom = fPredNom->PredictComponent(calc, flav, curr, sign);
+
+      StanVal_t val{*hash, calcType, parVals, nom, nom.HasStan(), Eigen::MatrixXd()};
+      if(val.stan){
+        val.nom = Spectrum(Eigen::ArrayXd(stan::math::value_of(nom.GetEigenStan(nom.POT()))),
+                           HistAxis(nom.GetLabels(), nom.GetBinnings()),
+                           nom.POT(), nom.Livetime());
+      }
+
+      if(it == fStanNomCache->end())
+        fStanNomCache->emplace(key, std::move(val));
+      else
+        it->second = std::move(val);
+
+      return nom;
+    }
+
+    StanVal_t& val = it->second;
+    if(!val.stan) return val.nom;
+
+    if(val.jac.rows() == 0) val.jac = NomStanJacobian(adj, flav, curr, sign);
+
+    // Hang each bin off the current parameters with its precomputed
+    // derivatives. Much less tape than the oscillation calculation itself
+    const Eigen::ArrayXd arr = val.nom.GetEigen(val.nom.POT());
+    assert(val.jac.rows() == arr.size());
+
+    Eigen::ArrayXstan vec(arr.size());
+    std::vector<stan::math::var> operands;
+    std::vector<double> grads;
+    for(int bin = 0; bin < arr.size(); ++bin){
+      operands.clear();
+      grads.clear();
+      for(unsigned int parIdx = 0; parIdx < pars.size(); ++parIdx){
+        if(val.jac(bin, parIdx) == 0) continue;
+        operands.push_back(pars[parIdx]);
+        grads.push_back(val.jac(bin, parIdx));
+      }
+      vec[bin] = operands.empty() ? stan::math::var(arr[bin]) : stan::math::precomputed_gradients(arr[bin], operands, grads);
+    }
+
+    return Spectrum(std::move(vec), HistAxis(val.nom.GetLabels(), val.nom.GetBinnings()), val.nom.POT(), val.nom.Livetime());
+  }
+
+  //----------------------------------------------------------------------
+  Eigen::MatrixXd PredictionInterp::NomStanJacobian(osc::IOscCalcAdjustableStan* calc,
+                                                    Flavors::Flavors_t flav,
+                                                    Current::Current_t curr,
+                                                    Sign::Sign_t sign) const
+  {
+    // Everything on here is recovered when it goes out of scope, leaving the
+    // log-prob being evaluated on the main stack untouched
+    stan::math::nested_rev_autodiff nested;
+
+    // Independent copies of the parameters, on the nested stack, and a
+    // calculator using them (which mustn't reuse anything it cached from the
+    // main stack)
+    std::unique_ptr<osc::IOscCalcAdjustableStan> c(calc->Copy());
+    c->InvalidateCache();
+
+    const std::vector<stan::math::var> pars = {calc->GetDmsq21().val(), calc->GetDmsq32().val(),
+                                               calc->GetTh12().val(), calc->GetTh13().val(),
+                                               calc->GetTh23().val(), calc->GetdCP().val()};
+    c->SetDmsq21(pars[0]);
+    c->SetDmsq32(pars[1]);
+    c->SetTh12(pars[2]);
+    c->SetTh13(pars[3]);
+    c->SetTh23(pars[4]);
+    c->SetdCP(pars[5]);
+
+    const Spectrum nom = fPredNom->PredictComponent(c.get(), flav, curr, sign);
+    Eigen::ArrayXstan arr = nom.GetEigenStan(nom.POT());
+
+    Eigen::MatrixXd jac(arr.size(), pars.size());
+    for(int bin = 0; bin < arr.size(); ++bin){
+      nested.set_zero_all_adjoints();
+      arr[bin].grad();
+      for(unsigned int parIdx = 0; parIdx < pars.size(); ++parIdx)
+        jac(bin, parIdx) = pars[parIdx].adj();
+    }
+
+    return jac;
+  }
+
+  //----------------------------------------------------------------------
+  void PredictionInterp::AddShiftedComponent(osc::IOscCalc* calc,
+                                             const TMD5* hash,
+                                             const SystShifts& shift,
+                                             Flavors::Flavors_t flav,
+                                             Current::Current_t curr,
+                                             Sign::Sign_t sign,
+                                             CoeffsType type,
+                                             double pot,
+                                             Eigen::Ref<Eigen::ArrayXd> ret,
+                                             const BinRanges* bins) const
+  {
+    if(fSplitBySign && sign == Sign::kBoth){
+      AddShiftedComponent(calc, hash, shift, flav, curr, Sign::kAntiNu, type, pot, ret, bins);
+      AddShiftedComponent(calc, hash, shift, flav, curr, Sign::kNu,     type, pot, ret, bins);
+      return;
+    }
+
+    // Should the interpolation use the nubar fits?
+    const bool nubar = (fSplitBySign && sign == Sign::kAntiNu);
+
+    // Reuse the same storage every time, so no allocation is necessary
+    Eigen::ArrayXd& arr = *fScratch;
+    double nomPOT;
+
+    if(hash){
+      // Same caching scheme as _ShiftedComponent()
+      const Key_t key = {flav, curr, sign};
+      auto it = fNomCache->find(key);
+      if(it == fNomCache->end()){
+        const Spectrum nom = fPredNom->PredictComponent(calc, flav, curr, sign);
+        it = fNomCache->emplace(key, Val_t({*hash, nom})).first;
+      }
+      else if(!(it->second.hash == *hash)){
+        it->second = {*hash, fPredNom->PredictComponent(calc, flav, curr, sign)};
+      }
+
+      Val_t& val = it->second;
+      if(val.arr.size() == 0) val.arr = val.nom.GetEigen(val.nom.POT());
+
+      nomPOT = val.nom.POT();
+      arr.resize(val.arr.size());
+      if(bins){
+        for(const std::pair<int, int>& r: *bins){
+          arr.segment(r.first, r.second-r.first) = val.arr.segment(r.first, r.second-r.first);
+        }
+      }
+      else{
+        arr = val.arr;
+      }
+    }
+    else{
+      const Spectrum nom = fPredNom->PredictComponent(calc, flav, curr, sign);
+      nomPOT = nom.POT();
+      arr = nom.GetEigen(nomPOT);
+    }
+
+    assert(nomPOT > 0);
+    assert(arr.size() == ret.size());
+
+    // Shift at the component's own POT, as ShiftSpectrum() does, since the
+    // MC stats threshold is expressed in those terms
+    ShiftBins(arr.size(), arr.data(), type, nubar, shift, bins);
+
+    if(bins){
+      for(const std::pair<int, int>& r: *bins){
+        ret.segment(r.first, r.second-r.first) += arr.segment(r.first, r.second-r.first) * (pot/nomPOT);
+      }
+    }
+    else{
+      ret += arr * (pot/nomPOT);
+    }
+  }
+
   void PredictionInterp::DiscardSysts(std::vector<ISyst const *> const &systs) {
 
     size_t NPreds = fPreds.size();
@@ -586,13 +836,7 @@ namespace ana
 
     assert (ret.POT() > 0 && "Can't PredictComponentSyst() for 0 POT");
 
-    // Check that we're able to handle all the systs we were passed
-    for(const ISyst* syst: shift.ActiveSysts()){
-      if(find_pred(syst) == fPreds.end()){
-        std::cerr << "This PredictionInterp is not set up to handle the requested systematic: " << syst->ShortName() << std::endl;
-        abort();
-      }
-    } // end for syst
+    CheckSysts(shift);
 
 
     const TMD5* hash = calc ? calc->GetParamsHash() : 0;
@@ -11,6 +11,8 @@
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <typeindex>
 
 #include "TMD5.h"
 
@@ -59,6 +61,13 @@ namespace ana
     Spectrum PredictSyst(osc::IOscCalcStan* calc,
                          const SystShifts& shift) const override;
 
+    /// Accumulates the shifted components directly into \a ret
+    void PredictSystInto(osc::IOscCalc* calc,
+                         const SystShifts& shift,
+                         double pot,
+                         Eigen::Ref<Eigen::ArrayXd> ret,
+                         const BinRanges* bins = 0) const override;
+
     Spectrum PredictComponent(osc::IOscCalc* calc,
                               Flavors::Flavors_t flav,
                               Current::Current_t curr,
@@ -257,21 +266,67 @@ namespace ana
     struct Val_t
     {
       TMD5 hash;
-      Spectrum nom;  // todo: we can't cache stan::math::vars because they wind up getting invalidated when the Stan stack is cleared.  but keeping only a <double> version around in this cache means that we're dumping the autodiff for the oscillation calculator part, which may mean Stan won't explore the space correctly.  Not sure what to do here.
+      Spectrum nom;  // Stan calculators use fStanNomCache instead
+      /// Contents of \a nom at its own POT. Filled on demand by
+      /// \ref AddShiftedComponent
+      Eigen::ArrayXd arr;
     };
     mutable ThreadLocal<std::map<Key_t, Val_t>> fNomCache;
 
+    /// stan::math::vars can't be cached, because they're invalidated when the
+    /// Stan stack is cleared after every log-prob evaluation. Instead keep
+    /// the double-valued nominal and its derivatives with respect to the
+    /// oscillation parameters, and rebuild the vars from those
+    struct StanVal_t
+    {
+      TMD5 hash; ///< Of the calculator, as for \ref Val_t
+      std::type_index calcType; ///< Calculators of different types may hash the same
+      std::vector<double> params; ///< See \ref NomStan
+      Spectrum nom; ///< Double-valued
+      bool stan; ///< Did the prediction depend on the oscillation parameters at all?
+      /// [bin][param] derivatives of \a nom's contents at its own POT. Only
+      /// computed (by \ref NomStanJacobian) once the same parameters come
+      /// round a second time, empty until then
+      Eigen::MatrixXd jac;
+    };
+    mutable ThreadLocal<std::map<Key_t, StanVal_t>> fStanNomCache;
+
+    /// Working space for \ref AddShiftedComponent
+    mutable ThreadLocal<Eigen::ArrayXd> fScratch;
+
     bool fSplitBySign;
 
     // Don't apply systs to bins with fewer than this many MC stats
     double fMinMCStats;
 
+    /// Fill the fit coefficients, if not already done. Thread-safe
     void InitFits() const;
+    mutable std::mutex fInitMutex;
+
+    /// Abort if \a shift includes systematics we don't know about
+    void CheckSysts(const SystShifts& shift) const;
 
     void InitFitsHelper(ShiftedPreds& sp,
                         std::vector<std::vector<std::vector<Coeffs>>>& fits,
                         Sign::Sign_t sign) const;
 
+    /// \brief Nominal component for a Stan calculator, via \ref fStanNomCache
+    ///
+    /// As for the double-valued cache, nothing is cached if \a hash is
+    /// null. Set $CAFANA_PRED_STAN_OSC_CACHE=0 to always calculate it afresh
+    Spectrum NomStan(osc::IOscCalcStan* calc,
+                     const TMD5* hash,
+                     Flavors::Flavors_t flav,
+                     Current::Current_t curr,
+                     Sign::Sign_t sign) const;
+
+    /// Derivatives of the nominal component's bins with respect to the
+    /// parameters \ref NomStan caches on, evaluated on a nested autodiff stack
+    Eigen::MatrixXd NomStanJacobian(osc::IOscCalcAdjustableStan* calc,
+                                    Flavors::Flavors_t flav,
+                                    Current::Current_t curr,
+                                    Sign::Sign_t sign) const;
+
     /// Templated helper for \ref ShiftedComponent
     template <typename T>
     Spectrum _ShiftedComponent(osc::_IOscCalc<T>* calc,
@@ -282,6 +337,21 @@ namespace ana
                                Sign::Sign_t sign,
                                CoeffsType type) const;
 
+    /// \brief Helper for \ref PredictSystInto
+    ///
+    /// Equivalent to adding ShiftedComponent(...).GetEigen(pot) to \a ret,
+    /// but without allocating once the cache is warm
+    void AddShiftedComponent(osc::IOscCalc* calc,
+                             const TMD5* hash,
+                             const SystShifts& shift,
+                             Flavors::Flavors_t flav,
+                             Current::Current_t curr,
+                             Sign::Sign_t sign,
+                             CoeffsType type,
+                             double pot,
+                             Eigen::Ref<Eigen::ArrayXd> ret,
+                             const BinRanges* bins) const;
+
     /// Templated helper for \ref PredictComponentSyst
     template <typename T>
     Spectrum _PredictComponentSyst(osc::_IOscCalc<T>* calc,
@@ -291,12 +361,15 @@ namespace ana
                                    Sign::Sign_t sign) const;
 
     /// Helper for \ref ShiftSpectrum
+    ///
+    /// \param bins If set, only these bins are shifted
     template <typename T>
     void ShiftBins(unsigned int N,
                    T* arr,
                    CoeffsType type,
                    bool nubar,
-                   const SystShifts& shift) const;
+                   const SystShifts& shift,
+                   const BinRanges* bins = 0) const;
   };
 
 }